@@ -0,0 +1,335 @@
+#include "aot.h"
+#include "bytecode.h"
+#include "chunk.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <math.h>
+#include <stdlib.h>
+
+// Chunks of a script in the order their C functions are written: the script,
+// then depth first through the function constants. The image decodes to the
+// same tree, so the loader walks them in the same order
+typedef struct {
+  Chunk **chunks;
+  int count;
+  int capacity;
+} ChunkList;
+
+static void collectChunks(ChunkList *list, Chunk *chunk) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+    list->chunks =
+        (Chunk **)realloc(list->chunks, sizeof(Chunk *) * list->capacity);
+    if (list->chunks == NULL)
+      exit(1);
+  }
+  list->chunks[list->count++] = chunk;
+  for (size_t i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant))
+      collectChunks(list, &AS_FUNCTION(constant)->chunk);
+  }
+}
+
+static void emitImage(FILE *out, uint8_t *image, size_t size) {
+  // NOTE: writable, run() quickens the code in place
+  fprintf(out, "_Alignas(8) static uint8_t image[] = {");
+  for (size_t i = 0; i < size; i++) {
+    fprintf(out, i % 16 == 0 ? "\n    %u," : " %u,", image[i]);
+  }
+  fprintf(out, "\n};\n\n");
+}
+
+static void emitConstant(FILE *out, Chunk *chunk, size_t index) {
+  Value value = chunk->constants.values[index];
+  if (IS_NUMBER(value) && isfinite(AS_NUMBER(value))) {
+    // Hex floats are exact. NaN and the infinities, which only come out of
+    // constant folding, are read from the pool like the objects
+    fprintf(out, "*sp++ = NUMBER_VAL(%a);", AS_NUMBER(value));
+  } else if (IS_NIL(value)) {
+    fprintf(out, "*sp++ = NIL_VAL;");
+  } else if (IS_BOOL(value)) {
+    fprintf(out, "*sp++ = BOOL_VAL(%s);", AS_BOOL(value) ? "true" : "false");
+  } else {
+    fprintf(out, "*sp++ = chunk->constants.values[%zu];", index);
+  }
+}
+
+static size_t readSlot(uint8_t *code, bool isLong) {
+  return isLong ? (size_t)((code[1] << 16) | (code[2] << 8) | code[3])
+                : code[1];
+}
+
+// The C form of one instruction, the same as its handler in run()
+static void emitInstruction(FILE *out, Chunk *chunk, int offset,
+                            bool label) {
+  uint8_t *code = chunk->code + offset;
+  // Operands are only read by the instructions that have them
+#define JUMP() ((code[1] << 8) | code[2])
+#define SLOT(longOp) readSlot(code, code[0] == longOp)
+  if (label)
+    fprintf(out, "i%d:\n", offset);
+  fprintf(out, "  ");
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+    emitConstant(out, chunk, SLOT(OP_CONSTANT_LONG));
+    break;
+  case OP_NIL:
+    fprintf(out, "*sp++ = NIL_VAL;");
+    break;
+  case OP_TRUE:
+    fprintf(out, "*sp++ = BOOL_VAL(true);");
+    break;
+  case OP_FALSE:
+    fprintf(out, "*sp++ = BOOL_VAL(false);");
+    break;
+  case OP_POP:
+    fprintf(out, "sp--;");
+    break;
+  case OP_GET_LOCAL:
+    fprintf(out, "*sp++ = slots[%d];", code[1]);
+    break;
+  case OP_SET_LOCAL:
+    fprintf(out, "slots[%d] = sp[-1];", code[1]);
+    break;
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+    fprintf(out,
+            "vm->globalValues.values[%zu] = *--sp;\n"
+            "  writeBarrier(vm, NULL, *sp);",
+            SLOT(OP_DEFINE_GLOBAL_LONG));
+    break;
+  // An undefined global is reported by run()
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+    fprintf(out,
+            "if (IS_UNDEFINED(vm->globalValues.values[%zu]))\n"
+            "    AOT_EXIT(%d);\n"
+            "  *sp++ = vm->globalValues.values[%zu];",
+            SLOT(OP_GET_GLOBAL_LONG), offset, SLOT(OP_GET_GLOBAL_LONG));
+    break;
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+    fprintf(out,
+            "if (IS_UNDEFINED(vm->globalValues.values[%zu]))\n"
+            "    AOT_EXIT(%d);\n"
+            "  vm->globalValues.values[%zu] = sp[-1];\n"
+            "  writeBarrier(vm, NULL, sp[-1]);",
+            SLOT(OP_SET_GLOBAL_LONG), offset, SLOT(OP_SET_GLOBAL_LONG));
+    break;
+  case OP_GET_UPVALUE:
+    fprintf(out, "*sp++ = *closure->upvalues[%d]->location;", code[1]);
+    break;
+  case OP_SET_UPVALUE:
+    fprintf(out,
+            "*closure->upvalues[%d]->location = sp[-1];\n"
+            "  writeBarrier(vm, (Obj *)closure->upvalues[%d], sp[-1]);",
+            code[1], code[1]);
+    break;
+  case OP_ADD:
+    fprintf(out, "AOT_BINARY(NUMBER_VAL, +, %d);", offset);
+    break;
+  case OP_SUBTRACT:
+    fprintf(out, "AOT_BINARY(NUMBER_VAL, -, %d);", offset);
+    break;
+  case OP_MULTIPLY:
+    fprintf(out, "AOT_BINARY(NUMBER_VAL, *, %d);", offset);
+    break;
+  case OP_DIVIDE:
+    fprintf(out, "AOT_BINARY(NUMBER_VAL, /, %d);", offset);
+    break;
+  case OP_GREATER:
+    fprintf(out, "AOT_BINARY(BOOL_VAL, >, %d);", offset);
+    break;
+  case OP_LESS:
+    fprintf(out, "AOT_BINARY(BOOL_VAL, <, %d);", offset);
+    break;
+  case OP_EQUAL:
+    fprintf(out, "sp[-2] = BOOL_VAL(valuesEqual(sp[-2], sp[-1]));\n"
+                 "  sp--;");
+    break;
+  case OP_NOT:
+    fprintf(out, "sp[-1] = BOOL_VAL(AOT_FALSEY(sp[-1]));");
+    break;
+  case OP_NEGATE:
+    fprintf(out,
+            "if (!IS_NUMBER(sp[-1]))\n"
+            "    AOT_EXIT(%d);\n"
+            "  sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));",
+            offset);
+    break;
+  case OP_PRINT:
+    fprintf(out, "printValue(*--sp);\n"
+                 "  printf(\"\\n\");");
+    break;
+  case OP_JUMP:
+    fprintf(out, "goto i%d;", offset + 3 + JUMP());
+    break;
+  case OP_JUMP_IF_FALSE:
+    fprintf(out,
+            "if (AOT_FALSEY(sp[-1]))\n"
+            "    goto i%d;",
+            offset + 3 + JUMP());
+    break;
+  // A pending collection waits for the safepoint of OP_LOOP in run()
+  case OP_LOOP:
+    fprintf(out,
+            "if (vm->gcRequested)\n"
+            "    AOT_EXIT(%d);\n"
+            "  goto i%d;",
+            offset, offset + 3 - JUMP());
+    break;
+  default:
+    fprintf(out, "AOT_EXIT(%d);", offset);
+    break;
+  }
+  fprintf(out, "\n");
+#undef JUMP
+#undef SLOT
+}
+
+// Where run() comes back into the C after the instruction at offset left it
+// there, or -1 if it never does. Only these offsets get a case in the entry
+// switch, every other label is reached by a goto alone so the C compiler
+// sees straight line code between them. An undefined global is an error, it
+// does not come back
+static int resumeOffset(Chunk *chunk, int offset) {
+  uint8_t *code = chunk->code + offset;
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_POP:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_EQUAL:
+  case OP_NOT:
+  case OP_PRINT:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+    return -1;
+  case OP_LOOP:
+    return offset + 3 - ((code[1] << 8) | code[2]);
+  default:
+    return offset + instructionLength(chunk, offset);
+  }
+}
+
+// Bytes of code above which a chunk is left to run(). The time C compilers
+// take over one function grows faster than its length, a script of a few
+// thousand statements at the top level would take minutes to build
+#define AOT_MAX_CODE 4096
+
+static void emitChunk(FILE *out, Chunk *chunk, int index) {
+  // The entries, and with them the jump targets, are the labels
+  bool *entries = (bool *)calloc(chunk->count + 1, sizeof(bool));
+  bool *labels = (bool *)calloc(chunk->count + 1, sizeof(bool));
+  if (entries == NULL || labels == NULL)
+    exit(1);
+  entries[0] = labels[0] = true;
+  for (int offset = 0; offset < (int)chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t *code = chunk->code + offset;
+    int resume = resumeOffset(chunk, offset);
+    if (resume >= 0)
+      entries[resume] = labels[resume] = true;
+    if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE)
+      labels[offset + 3 + ((code[1] << 8) | code[2])] = true;
+  }
+
+  fprintf(out,
+          "static uint8_t *chunk%d(VM *vm, Value *slots, ObjClosure *closure,\n"
+          "                        uint8_t *ip) {\n"
+          "  Chunk *chunk = closure == NULL ? vm->chunk : "
+          "&closure->function->chunk;\n"
+          "  Value *sp = vm->stackTop;\n"
+          "  switch (ip - chunk->code) {\n",
+          index);
+  for (int offset = 0; offset < (int)chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (entries[offset])
+      fprintf(out, "  case %d:\n    goto i%d;\n", offset, offset);
+  }
+  fprintf(out, "  default:\n    return ip;\n  }\n");
+  for (int offset = 0; offset < (int)chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    emitInstruction(out, chunk, offset, labels[offset]);
+  }
+  fprintf(out, "}\n\n");
+  free(entries);
+  free(labels);
+}
+
+bool emitC(VM *vm, Chunk *chunk, const char *path, FILE *out) {
+  size_t size;
+  uint8_t *image = encodeBytecode(vm, chunk, &size);
+  ChunkList list = {NULL, 0, 0};
+  collectChunks(&list, chunk);
+
+  fprintf(out,
+          "// Generated by clox --emit-c from %s. Build it with every clox\n"
+          "// source but main.c:\n"
+          "//   cc -O2 -I clox program.c $(ls clox/*.c | grep -v main.c) -lm\n"
+          "#include \"aot.h\"\n\n",
+          path);
+  emitImage(out, image, size);
+  for (int i = 0; i < list.count; i++) {
+    if (list.chunks[i]->count <= AOT_MAX_CODE)
+      emitChunk(out, list.chunks[i], i);
+  }
+  fprintf(out, "static NativeCode natives[] = {");
+  for (int i = 0; i < list.count; i++) {
+    fprintf(out, i % 4 == 0 ? "\n   " : "");
+    if (list.chunks[i]->count <= AOT_MAX_CODE)
+      fprintf(out, " chunk%d,", i);
+    else
+      fprintf(out, " NULL,");
+  }
+  fprintf(out, "\n};\n\n"
+               "int main(void) {\n"
+               "  return runNative(image, sizeof(image), natives,\n"
+               "                   sizeof(natives) / sizeof(natives[0]));\n"
+               "}\n");
+  free(image);
+  free(list.chunks);
+  return !ferror(out);
+}
+
+int runNative(uint8_t *image, size_t size, NativeCode *natives, int count) {
+  VM vm;
+  initVM(&vm);
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!readBytecode(&vm, image, size, &chunk)) {
+    fprintf(stderr, "Could not load the compiled script.\n");
+    return 74;
+  }
+  ChunkList list = {NULL, 0, 0};
+  collectChunks(&list, &chunk);
+  if (list.count != count) {
+    fprintf(stderr, "The compiled script does not match its code.\n");
+    return 74;
+  }
+  for (int i = 0; i < count; i++) {
+    list.chunks[i]->native = natives[i];
+  }
+  free(list.chunks);
+
+  vm.native = true;
+  InterpretResult result = interpretChunk(&vm, &chunk);
+  freeChunk(&chunk);
+  freeVM(&vm);
+  return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
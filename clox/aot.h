@@ -0,0 +1,46 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <stdio.h>
+
+// Ahead of time compiler. clox --emit-c script.lox writes a C program holding
+// the script's .loxc image and each of its chunks translated to C: a label
+// per instruction, jumps as gotos and constants as literals. Built with every
+// clox source but main.c, the program loads the image without compiling
+// anything and runs it with the translation attached to each chunk.
+// Instructions with no C form (calls, returns, closures, classes and
+// properties) are left to run(), which goes back to the native code at the
+// next instruction, see nativeTable. Chunks above AOT_MAX_CODE bytes stay
+// interpreted
+
+// Writes the C program for chunk, just compiled by vm, to out
+bool emitC(VM *vm, Chunk *chunk, const char *path, FILE *out);
+// The main() of a generated program: loads image, gives each chunk its
+// native code in the order emitC wrote them and runs it. Returns the exit
+// status clox would have
+int runNative(uint8_t *image, size_t size, NativeCode *natives, int count);
+
+// Helpers of the generated code, which has vm, chunk and sp (the stack top,
+// stored back on the way out) in scope
+#define AOT_EXIT(offset)                                                       \
+  do {                                                                         \
+    vm->stackTop = sp;                                                         \
+    return chunk->code + (offset);                                             \
+  } while (false)
+#define AOT_FALSEY(value)                                                      \
+  (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+// Anything but two numbers goes to run(), for strings or the type error
+#define AOT_BINARY(valueType, op, offset)                                      \
+  do {                                                                         \
+    if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2]))                              \
+      AOT_EXIT(offset);                                                        \
+    sp[-2] = valueType(AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1]));                \
+    sp--;                                                                      \
+  } while (false)
+
+#endif
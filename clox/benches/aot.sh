@@ -0,0 +1,52 @@
+#!/bin/sh
+# Compares the interpreter against the script translated to C by --emit-c and
+# built with the runtime.
+#
+#   sh benches/aot.sh [script.lox] [runs]
+#
+# Both must print the same output, then the best wall time of each over the
+# given number of runs is reported. The time of the C build is not counted.
+set -eu
+
+cd "$(dirname "$0")/.."
+SCRIPT=${1:-benches/collatz.lox}
+RUNS=${2:-5}
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 $(find . -maxdepth 1 -name '*.c') -o "$OUT/clox"
+"$OUT/clox" --emit-c "$SCRIPT" >"$OUT/program.c"
+$CC -O2 -I . "$OUT/program.c" $(find . -maxdepth 1 -name '*.c' ! -name main.c) \
+  -o "$OUT/program" -lm
+
+"$OUT/clox" --no-cache "$SCRIPT" >"$OUT/interpreter.out"
+"$OUT/program" >"$OUT/native.out"
+if ! cmp -s "$OUT/interpreter.out" "$OUT/native.out"; then
+  echo "outputs differ:" >&2
+  diff "$OUT/interpreter.out" "$OUT/native.out" >&2 || true
+  exit 1
+fi
+
+best() {
+  best=
+  i=0
+  while [ "$i" -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$@" >/dev/null
+    end=$(date +%s%N)
+    elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+interpreter=$(best "$OUT/clox" --no-cache "$SCRIPT")
+native=$(best "$OUT/program")
+echo "script:      $SCRIPT (best of $RUNS)"
+echo "interpreter: ${interpreter} ms"
+echo "native:      ${native} ms"
+awk -v i="$interpreter" -v n="$native" 'BEGIN { printf "speedup:     %.2fx\n", i / n }'
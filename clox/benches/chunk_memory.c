@@ -0,0 +1,88 @@
+// Memory report for the line table of a compiled chunk.
+//
+//   cc -O2 -I. $(find . -maxdepth 1 -name '*.c' ! -name main.c) \
+//     benches/chunk_memory.c -o chunk-memory
+//   ./chunk-memory [script.lox]
+//
+// Without a script it compiles a generated one, thousands of short
+// arithmetic statements on their own lines. It prints the bytes per
+// instruction spent on code and on line information, for the old layout (one
+// int per code byte) and for the run length encoded table now in Chunk.
+#include "chunk.h"
+#include "compiler.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GENERATED_STATEMENTS 20000
+
+static char *generateScript(void) {
+  const char *prologue = "{\nvar a = 1;\nvar b = 2;\n";
+  const char *statement = "a = a + b;\n"
+                          "if (a > b) { b = b * a - b; } else { a = b; }\n";
+  size_t capacity =
+      strlen(prologue) + GENERATED_STATEMENTS * strlen(statement) + 3;
+  char *source = malloc(capacity);
+  strcpy(source, prologue);
+  for (int i = 0; i < GENERATED_STATEMENTS; i++) {
+    strcat(source + strlen(prologue) + i * strlen(statement), statement);
+  }
+  strcat(source, "}\n");
+  return source;
+}
+
+static char *readScript(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file %s.\n", path);
+    exit(74);
+  }
+  fseek(file, 0L, SEEK_END);
+  size_t size = ftell(file);
+  rewind(file);
+  char *source = malloc(size + 1);
+  size_t read = fread(source, 1, size, file);
+  source[read] = '\0';
+  fclose(file);
+  return source;
+}
+
+int main(int argc, const char *argv[]) {
+  char *source = argc > 1 ? readScript(argv[1]) : generateScript();
+
+  VM vm;
+  initVM(&vm);
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!compile(&vm, source, &chunk)) {
+    fprintf(stderr, "Compile error.\n");
+    return 65;
+  }
+
+  size_t instructions = 0;
+  for (int offset = 0; offset < (int)chunk.count;
+       offset += instructionLength(&chunk, offset)) {
+    instructions++;
+  }
+
+  size_t codeBytes = chunk.count;
+  size_t perByteLines = chunk.count * sizeof(int);
+  size_t runLines = chunk.lineCount * sizeof(LineStart);
+
+  printf("instructions:        %zu\n", instructions);
+  printf("code:                %zu bytes (%.2f per instruction)\n", codeBytes,
+         (double)codeBytes / instructions);
+  printf("lines, one per byte: %zu bytes (%.2f per instruction)\n",
+         perByteLines, (double)perByteLines / instructions);
+  printf("lines, run length:   %zu bytes (%.2f per instruction, %zu runs)\n",
+         runLines, (double)runLines / instructions, chunk.lineCount);
+  printf("code + lines:        %.2f -> %.2f bytes per instruction\n",
+         (double)(codeBytes + perByteLines) / instructions,
+         (double)(codeBytes + runLines) / instructions);
+
+  freeChunk(&chunk);
+  freeVM(&vm);
+  free(source);
+  return 0;
+}
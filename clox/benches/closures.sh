@@ -0,0 +1,56 @@
+#!/bin/sh
+# Compares clox against the Rust tree-walker on function and closure heavy
+# code, where the tree-walker resolves every variable through its chain of
+# environment maps and clox reads stack slots and upvalues.
+#
+#   sh benches/closures.sh [script.lox] [runs]
+#
+# The tree-walker is taken from $YASL, by default the release build of the
+# parent crate (built with cargo when missing). Both must print the same
+# output, then the best wall time of each over the given number of runs is
+# reported.
+set -eu
+
+cd "$(dirname "$0")/.."
+SCRIPT=${1:-benches/closures.lox}
+RUNS=${2:-3}
+CC=${CC:-cc}
+YASL=${YASL:-../target/release/yasl}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 $(find . -maxdepth 1 -name '*.c') -o "$OUT/clox"
+if [ ! -x "$YASL" ]; then
+  (cd .. && cargo build --release)
+fi
+
+"$OUT/clox" --no-cache "$SCRIPT" >"$OUT/clox.out"
+"$YASL" "$SCRIPT" >"$OUT/yasl.out"
+if ! cmp -s "$OUT/clox.out" "$OUT/yasl.out"; then
+  echo "outputs differ:" >&2
+  diff "$OUT/clox.out" "$OUT/yasl.out" >&2
+  exit 1
+fi
+
+best() {
+  best=
+  i=0
+  while [ "$i" -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$@" "$SCRIPT" >/dev/null
+    end=$(date +%s%N)
+    elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+walker=$(best "$YASL")
+clox=$(best "$OUT/clox" --no-cache)
+echo "script:      $SCRIPT (best of $RUNS)"
+echo "tree-walker: ${walker} ms"
+echo "clox:        ${clox} ms"
+awk -v w="$walker" -v c="$clox" 'BEGIN { printf "speedup:     %.1fx\n", w / c }'
@@ -0,0 +1,115 @@
+// Hardware counters of a command, the way perf stat counts them but with no
+// dependency on the perf tool, see benches/tos.sh.
+//
+//   cc -O2 benches/counters.c -o counters
+//   ./counters clox --no-cache script.lox
+//
+// Runs the command with user space instructions, cycles and task clock
+// counted from its exec to its exit, then prints them on one line to stderr:
+//
+//   instructions=N cycles=N task-ms=N
+//
+// A counter the machine does not expose (a VM without a virtual PMU, or
+// perf_event_paranoid above 2) is printed as n/a. Exits with the status of
+// the command.
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+  int fd;
+} Counter;
+
+// Counts pid from its next exec, and everything it forks
+static int openCounter(Counter *counter, pid_t pid) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = counter->type;
+  attr.config = counter->config;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: counters command [args...]\n");
+    return 64;
+  }
+  Counter counters[] = {
+      {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+      {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+      {"task-ms", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1},
+  };
+  int counterCount = sizeof(counters) / sizeof(counters[0]);
+
+  // NOTE: the child waits on the pipe until its counters exist, so none of
+  // its instructions go uncounted and none of ours are
+  int go[2];
+  if (pipe(go) != 0) {
+    perror("pipe");
+    return 1;
+  }
+  pid_t child = fork();
+  if (child < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (child == 0) {
+    char byte;
+    close(go[1]);
+    if (read(go[0], &byte, 1) != 1)
+      _exit(1);
+    close(go[0]);
+    execvp(argv[1], argv + 1);
+    fprintf(stderr, "counters: %s: %s\n", argv[1], strerror(errno));
+    _exit(127);
+  }
+  close(go[0]);
+  for (int i = 0; i < counterCount; i++)
+    counters[i].fd = openCounter(&counters[i], child);
+  if (write(go[1], "", 1) != 1) {
+    perror("write");
+    return 1;
+  }
+  close(go[1]);
+
+  int status;
+  if (waitpid(child, &status, 0) < 0) {
+    perror("waitpid");
+    return 1;
+  }
+  for (int i = 0; i < counterCount; i++) {
+    Counter *counter = &counters[i];
+    uint64_t count;
+    if (i > 0)
+      fprintf(stderr, " ");
+    if (counter->fd < 0 ||
+        read(counter->fd, &count, sizeof(count)) != sizeof(count)) {
+      fprintf(stderr, "%s=n/a", counter->name);
+      continue;
+    }
+    // The task clock counts nanoseconds
+    if (counter->type == PERF_TYPE_SOFTWARE)
+      count /= 1000000;
+    fprintf(stderr, "%s=%llu", counter->name, (unsigned long long)count);
+    close(counter->fd);
+  }
+  fprintf(stderr, "\n");
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return 128 + WTERMSIG(status);
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Compares the direct threaded dispatch of run() against the portable switch.
+#
+#   sh benches/dispatch.sh [script.lox] [runs]
+#
+# Builds clox twice (with and without -DNO_COMPUTED_GOTO) and reports the best
+# wall time of each build over the given number of runs.
+set -eu
+
+cd "$(dirname "$0")/.."
+SCRIPT=${1:-benches/arith.lox}
+RUNS=${2:-5}
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+SOURCES=$(find . -maxdepth 1 -name '*.c')
+$CC -O2 $SOURCES -o "$OUT/clox-threaded"
+$CC -O2 -DNO_COMPUTED_GOTO $SOURCES -o "$OUT/clox-switch"
+
+best() {
+  bin=$1
+  best=
+  i=0
+  while [ "$i" -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$bin" "$SCRIPT" >/dev/null
+    end=$(date +%s%N)
+    elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+switch=$(best "$OUT/clox-switch")
+threaded=$(best "$OUT/clox-threaded")
+echo "script:   $SCRIPT (best of $RUNS)"
+echo "switch:   ${switch} ms"
+echo "threaded: ${threaded} ms"
+awk -v s="$switch" -v t="$threaded" 'BEGIN { printf "speedup:  %.2fx\n", s / t }'
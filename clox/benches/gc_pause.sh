@@ -0,0 +1,60 @@
+#!/bin/sh
+# Pause time distribution of the stop the world collector versus the
+# incremental one at a few step budgets.
+#
+#   sh benches/gc_pause.sh [script.lox] [budgets...]
+#
+# Without a script it generates a request loop style job: a large live heap
+# of strings held by globals, plus a loop that keeps making temporaries, so
+# every cycle has both a lot to mark and a lot to sweep. Strings are interned,
+# so the responses are built from counters that only repeat after ~100k
+# iterations, long after the old copy died.
+set -eu
+
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 $(find . -maxdepth 1 -name '*.c') -o "$OUT/clox"
+
+if [ $# -ge 1 ]; then
+  SCRIPT=$1
+  shift
+else
+  SCRIPT="$OUT/job.lox"
+  awk 'BEGIN {
+    for (i = 0; i < 20000; i++) {
+      printf "var session%d = \"user\" + \"%d\";\n", i, i;
+    }
+    print "var response = \"\";";
+    # Three counters with coprime periods, ~100k distinct responses
+    split("body tag id", names);
+    split(". # -", marks);
+    split("48 47 45", periods);
+    for (k = 1; k <= 3; k++) printf "var %s = \"\";\n", names[k];
+    print "for (var i = 0; i < 300000; i = i + 1) {";
+    for (k = 1; k <= 3; k++) {
+      full = "";
+      for (j = 0; j < periods[k]; j++) full = full marks[k];
+      printf "  %s = %s + \"%s\";\n", names[k], names[k], marks[k];
+      printf "  if (%s == \"%s\") %s = \"\";\n", names[k], full, names[k];
+    }
+    print "  response = \"status: 200 OK \" + id + tag + body + session0;";
+    print "}";
+    print "print response;";
+  }' >"$SCRIPT"
+fi
+BUDGETS=${*:-500 200 50}
+
+report() {
+  echo "$1"
+  "$OUT/clox" --no-cache --gc-stats "$2" "$SCRIPT" 2>&1 >/dev/null |
+    grep -v "bytes freed" | sed 's/^gc: /  /'
+}
+
+echo "script: $SCRIPT ($(wc -c <"$SCRIPT") bytes)"
+report "stop the world:" --gc=mark-sweep
+for budget in $BUDGETS; do
+  report "incremental, ${budget}us steps:" "--gc-pause-us=$budget"
+done
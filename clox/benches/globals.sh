@@ -0,0 +1,46 @@
+#!/bin/sh
+# Compares global variable access against an older revision of clox, e.g. the
+# one before globals were resolved to slots at compile time.
+#
+#   sh benches/globals.sh <base-revision> [script.lox] [runs]
+#
+# Builds clox from the working tree and from the given git revision, and
+# reports the best wall time of each build over the given number of runs.
+set -eu
+
+cd "$(dirname "$0")/.."
+BASE=$1
+SCRIPT=${2:-benches/globals.lox}
+RUNS=${3:-5}
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+mkdir "$OUT/base"
+git archive "$BASE" . | tar -x -C "$OUT/base"
+$CC -O2 $(find "$OUT/base" -maxdepth 1 -name '*.c') -o "$OUT/clox-base"
+$CC -O2 $(find . -maxdepth 1 -name '*.c') -o "$OUT/clox-head"
+
+best() {
+  bin=$1
+  best=
+  i=0
+  while [ "$i" -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$bin" --no-cache "$SCRIPT" >/dev/null
+    end=$(date +%s%N)
+    elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+base=$(best "$OUT/clox-base")
+head=$(best "$OUT/clox-head")
+echo "script: $SCRIPT (best of $RUNS)"
+echo "$BASE: ${base} ms"
+echo "tree:   ${head} ms"
+awk -v b="$base" -v h="$head" 'BEGIN { printf "speedup: %.2fx\n", b / h }'
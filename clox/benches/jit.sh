@@ -0,0 +1,54 @@
+#!/bin/sh
+# Compares the interpreter against the baseline JIT (--jit) and the tracing
+# JIT (--tracing-jit).
+#
+#   sh benches/jit.sh [script.lox] [runs]
+#
+# All engines must print the same output, then the best wall time of each
+# over the given number of runs is reported.
+set -eu
+
+cd "$(dirname "$0")/.."
+SCRIPT=${1:-benches/collatz.lox}
+RUNS=${2:-5}
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 $(find . -maxdepth 1 -name '*.c') -o "$OUT/clox"
+
+"$OUT/clox" --no-cache "$SCRIPT" >"$OUT/interpreter.out"
+for engine in --jit --tracing-jit; do
+  "$OUT/clox" --no-cache "$engine" "$SCRIPT" >"$OUT/jit.out"
+  if ! cmp -s "$OUT/interpreter.out" "$OUT/jit.out"; then
+    echo "outputs differ with $engine:" >&2
+    diff "$OUT/interpreter.out" "$OUT/jit.out" >&2 || true
+    exit 1
+  fi
+done
+
+best() {
+  best=
+  i=0
+  while [ "$i" -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$OUT/clox" --no-cache "$@" "$SCRIPT" >/dev/null
+    end=$(date +%s%N)
+    elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+interpreter=$(best)
+jit=$(best --jit)
+tracing=$(best --tracing-jit)
+echo "script:      $SCRIPT (best of $RUNS)"
+echo "interpreter: ${interpreter} ms"
+echo "jit:         ${jit} ms"
+awk -v i="$interpreter" -v j="$jit" 'BEGIN { printf "speedup:     %.2fx\n", i / j }'
+echo "tracing jit: ${tracing} ms"
+awk -v i="$interpreter" -v j="$tracing" 'BEGIN { printf "speedup:     %.2fx\n", i / j }'
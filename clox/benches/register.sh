@@ -0,0 +1,58 @@
+#!/bin/sh
+# Compares the stack VM against the register VM (--register-vm) on the call
+# heavy fib and the loop heavy collatz.
+#
+#   sh benches/register.sh [runs]
+#
+# Both VMs must print the same output, then for each script the number of
+# instructions dispatched (--vm-stats) and the best wall time over the given
+# number of runs are reported.
+set -eu
+
+cd "$(dirname "$0")/.."
+RUNS=${1:-5}
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 $(find . -maxdepth 1 -name '*.c') -o "$OUT/clox" -lm
+
+best() {
+  best=
+  i=0
+  while [ "$i" -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$OUT/clox" --no-cache "$@" >/dev/null
+    end=$(date +%s%N)
+    elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+# Instructions dispatched, stack and register ones added up
+instructions() {
+  "$OUT/clox" --no-cache --vm-stats "$@" 2>&1 >/dev/null |
+    awk '/^vm:/ { print $2 + $5 }'
+}
+
+for script in benches/fib.lox benches/collatz.lox; do
+  "$OUT/clox" --no-cache "$script" >"$OUT/stack.out"
+  "$OUT/clox" --no-cache --register-vm "$script" >"$OUT/register.out"
+  if ! cmp -s "$OUT/stack.out" "$OUT/register.out"; then
+    echo "outputs differ on $script:" >&2
+    diff "$OUT/stack.out" "$OUT/register.out" >&2 || true
+    exit 1
+  fi
+
+  stack=$(best "$script")
+  register=$(best --register-vm "$script")
+  echo "script:   $script (best of $RUNS)"
+  echo "stack:    $(instructions "$script") instructions, ${stack} ms"
+  echo "register: $(instructions --register-vm "$script") instructions," \
+    "${register} ms"
+  awk -v s="$stack" -v r="$register" 'BEGIN { printf "speedup:  %.2fx\n", s / r }'
+done
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Cold start of a short script from source versus from a precompiled .loxc.
+#
+#   sh benches/startup.sh [script.lox] [runs]
+#
+# Without a script it generates a cron style job: a few thousand settings
+# and a little arithmetic, so the run time is dominated by the front end.
+# Reports the average wall time per run of each form.
+set -eu
+
+cd "$(dirname "$0")/.."
+RUNS=${2:-50}
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 $(find . -maxdepth 1 -name '*.c') -o "$OUT/clox"
+
+if [ $# -ge 1 ]; then
+  SCRIPT=$1
+else
+  SCRIPT="$OUT/job.lox"
+  awk 'BEGIN {
+    print "var total = 0;";
+    for (i = 0; i < 3000; i++) {
+      printf "var setting%d = %d * 2 + %d.5;\n", i, i, i;
+      printf "if (setting%d > 100) { total = total + setting%d; }\n", i, i;
+    }
+    print "print total;";
+  }' >"$SCRIPT"
+fi
+"$OUT/clox" --compile "$SCRIPT" -o "$OUT/job.loxc"
+
+average() {
+  start=$(date +%s%N)
+  i=0
+  while [ "$i" -lt "$RUNS" ]; do
+    "$OUT/clox" "$1" >/dev/null
+    i=$((i + 1))
+  done
+  end=$(date +%s%N)
+  echo $(((end - start) / RUNS / 1000))
+}
+
+source=$(average "$SCRIPT")
+bytecode=$(average "$OUT/job.loxc")
+echo "script:   $SCRIPT ($(wc -c <"$SCRIPT") bytes, $RUNS runs)"
+echo "source:   ${source} us per run"
+echo ".loxc:    ${bytecode} us per run"
+awk -v s="$source" -v b="$bytecode" 'BEGIN { printf "speedup:  %.2fx\n", s / b }'
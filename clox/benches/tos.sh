@@ -0,0 +1,63 @@
+#!/bin/sh
+# Compares run() with its top of stack cached in a register against the
+# build keeping every value in memory (-DNO_TOS_CACHE).
+#
+#   sh benches/tos.sh [script.lox ...]
+#
+# Both builds must print the same output, then for each script the user space
+# instructions, cycles and task clock of one run are reported, counted by
+# benches/counters.c, with the best wall time over $RUNS runs. Machines that
+# expose no hardware counters report them as n/a.
+set -eu
+
+cd "$(dirname "$0")/.."
+RUNS=${RUNS:-5}
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+if [ "$#" -eq 0 ]; then
+  set -- benches/arith.lox benches/collatz.lox benches/fib.lox
+fi
+
+SOURCES=$(find . -maxdepth 1 -name '*.c')
+$CC -O2 $SOURCES -o "$OUT/clox-tos" -lm
+$CC -O2 -DNO_TOS_CACHE $SOURCES -o "$OUT/clox-memory" -lm
+$CC -O2 benches/counters.c -o "$OUT/counters"
+
+best() {
+  best=
+  i=0
+  while [ "$i" -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$1" --no-cache "$SCRIPT" >/dev/null
+    end=$(date +%s%N)
+    elapsed=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+      best=$elapsed
+    fi
+    i=$((i + 1))
+  done
+  echo "$best"
+}
+
+counters() {
+  "$OUT/counters" "$1" --no-cache "$SCRIPT" 2>&1 >/dev/null |
+    grep '^instructions='
+}
+
+for SCRIPT in "$@"; do
+  "$OUT/clox-memory" --no-cache "$SCRIPT" >"$OUT/memory.out"
+  "$OUT/clox-tos" --no-cache "$SCRIPT" >"$OUT/tos.out"
+  if ! cmp -s "$OUT/memory.out" "$OUT/tos.out"; then
+    echo "outputs differ on $SCRIPT:" >&2
+    diff "$OUT/memory.out" "$OUT/tos.out" >&2 || true
+    exit 1
+  fi
+
+  memory=$(best "$OUT/clox-memory")
+  tos=$(best "$OUT/clox-tos")
+  echo "script:    $SCRIPT (best of $RUNS)"
+  echo "in memory: $(counters "$OUT/clox-memory") wall-ms=${memory}"
+  echo "cached:    $(counters "$OUT/clox-tos") wall-ms=${tos}"
+  awk -v m="$memory" -v t="$tos" 'BEGIN { printf "speedup:   %.2fx\n", m / t }'
+done
@@ -0,0 +1,520 @@
+#include "bytecode.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Growable byte buffer the file is assembled in before being written.
+// NOTE: plain realloc, not reallocate: the buffer is scratch space outside the
+// VM heap and growing it must not run a collection while the chunk being
+// saved is not rooted anywhere
+typedef struct {
+  size_t count;
+  size_t capacity;
+  uint8_t *bytes;
+} Buffer;
+
+static void reserve(Buffer *buffer, size_t length) {
+  if (buffer->capacity >= buffer->count + length)
+    return;
+  while (buffer->capacity < buffer->count + length) {
+    buffer->capacity = GROW_CAPACITY(buffer->capacity);
+  }
+  buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+  if (buffer->bytes == NULL)
+    exit(1);
+}
+
+static size_t append(Buffer *buffer, const void *data, size_t length) {
+  reserve(buffer, length);
+  size_t offset = buffer->count;
+  memcpy(buffer->bytes + offset, data, length);
+  buffer->count += length;
+  return offset;
+}
+
+static void align(Buffer *buffer, size_t alignment) {
+  static const uint8_t zeros[8] = {0};
+  size_t padding = (alignment - buffer->count % alignment) % alignment;
+  append(buffer, zeros, padding);
+}
+
+static void writeString(Buffer *buffer, ObjString *string) {
+  uint32_t length = (uint32_t)string->length;
+  append(buffer, &length, sizeof(length));
+  append(buffer, string->chars, length);
+}
+
+// recordOffset is where the chunk record of a function constant was written
+static void writeConstant(Buffer *buffer, Value value, uint32_t recordOffset) {
+  uint8_t tag;
+  if (IS_NIL(value)) {
+    tag = CONSTANT_NIL;
+    append(buffer, &tag, 1);
+  } else if (IS_BOOL(value)) {
+    tag = AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE;
+    append(buffer, &tag, 1);
+  } else if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    tag = CONSTANT_NUMBER;
+    append(buffer, &tag, 1);
+    append(buffer, &number, sizeof(number));
+  } else if (IS_STRING(value)) {
+    tag = CONSTANT_STRING;
+    append(buffer, &tag, 1);
+    writeString(buffer, AS_STRING(value));
+  } else if (IS_FUNCTION(value)) {
+    ObjFunction *function = AS_FUNCTION(value);
+    int32_t counts[2] = {function->arity, function->upvalueCount};
+    tag = CONSTANT_FUNCTION;
+    append(buffer, &tag, 1);
+    append(buffer, &recordOffset, sizeof(recordOffset));
+    append(buffer, counts, sizeof(counts));
+    writeString(buffer, function->name);
+  }
+}
+
+// Appends a chunk record and returns its offset in the buffer. The records of
+// nested functions are written first, a record only points backwards
+static size_t writeChunkRecord(Buffer *buffer, Chunk *chunk) {
+  uint32_t *functionRecords =
+      malloc(sizeof(uint32_t) * chunk->constants.count);
+  if (functionRecords == NULL && chunk->constants.count > 0)
+    exit(1);
+  for (size_t i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    functionRecords[i] =
+        IS_FUNCTION(value)
+            ? (uint32_t)writeChunkRecord(buffer, &AS_FUNCTION(value)->chunk)
+            : 0;
+  }
+
+  align(buffer, 4);
+  ChunkRecord record;
+  size_t recordOffset = append(buffer, &record, sizeof(record));
+
+  record.codeLength = (uint32_t)chunk->count;
+  record.codeOffset = (uint32_t)append(buffer, chunk->code, chunk->count);
+
+  align(buffer, 4);
+  record.lineCount = (uint32_t)chunk->lineCount;
+  record.linesOffset = (uint32_t)append(buffer, chunk->lines,
+                                        sizeof(LineStart) * chunk->lineCount);
+
+  record.propertyCacheCount = (uint32_t)chunk->propertyCacheCount;
+  record.invokeCacheCount = (uint32_t)chunk->invokeCacheCount;
+  record.constantCount = (uint32_t)chunk->constants.count;
+  record.constantsOffset = (uint32_t)buffer->count;
+  for (size_t i = 0; i < chunk->constants.count; i++) {
+    writeConstant(buffer, chunk->constants.values[i], functionRecords[i]);
+  }
+  free(functionRecords);
+
+  // The buffer may have moved while growing, patch the record last
+  memcpy(buffer->bytes + recordOffset, &record, sizeof(record));
+  return recordOffset;
+}
+
+static size_t writeGlobalNames(Buffer *buffer, VM *vm) {
+  size_t offset = buffer->count;
+  for (size_t i = 0; i < vm->globalNames.count; i++) {
+    writeString(buffer, AS_STRING(vm->globalNames.values[i]));
+  }
+  return offset;
+}
+
+uint8_t *encodeBytecode(VM *vm, Chunk *chunk, size_t *size) {
+  Buffer buffer = {0, 0, NULL};
+  BytecodeHeader header;
+  memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+  header.version = BYTECODE_VERSION;
+  header.byteOrder = BYTECODE_BYTE_ORDER;
+  append(&buffer, &header, sizeof(header));
+
+  header.chunkOffset = (uint32_t)writeChunkRecord(&buffer, chunk);
+  header.globalCount = (uint32_t)vm->globalNames.count;
+  header.globalsOffset = (uint32_t)writeGlobalNames(&buffer, vm);
+  memcpy(buffer.bytes, &header, sizeof(header));
+  *size = buffer.count;
+  return buffer.bytes;
+}
+
+bool saveBytecode(VM *vm, Chunk *chunk, const char *path) {
+  size_t size;
+  uint8_t *bytes = encodeBytecode(vm, chunk, &size);
+  FILE *file = fopen(path, "wb");
+  bool ok = file != NULL && fwrite(bytes, 1, size, file) == size;
+  if (file != NULL && fclose(file) != 0)
+    ok = false;
+  free(bytes);
+  return ok;
+}
+
+bool isBytecodeFile(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  char magic[4];
+  bool isBytecode = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                    memcmp(magic, BYTECODE_MAGIC, sizeof(magic)) == 0;
+  fclose(file);
+  return isBytecode;
+}
+
+// Bounds checked view of the mapped file, a truncated or corrupted file must
+// fail to load instead of crashing the VM, see also checkCode
+typedef struct {
+  const uint8_t *base;
+  size_t size;
+} Reader;
+
+static bool inBounds(Reader *reader, size_t offset, size_t length) {
+  return offset <= reader->size && length <= reader->size - offset;
+}
+
+static bool readChunkRecord(VM *vm, Reader *reader, size_t offset,
+                            Chunk *chunk, Obj *owner);
+
+// Reads a length prefixed string at *offset and moves past it
+static ObjString *readString(VM *vm, Reader *reader, size_t *offset) {
+  uint32_t length;
+  if (!inBounds(reader, *offset, sizeof(length)))
+    return NULL;
+  memcpy(&length, reader->base + *offset, sizeof(length));
+  *offset += sizeof(length);
+  if (!inBounds(reader, *offset, length))
+    return NULL;
+  ObjString *string =
+      copyString(vm, (const char *)reader->base + *offset, (int)length);
+  *offset += length;
+  return string;
+}
+
+static ObjFunction *readFunction(VM *vm, Reader *reader, size_t *offset,
+                                 size_t parentOffset) {
+  uint32_t recordOffset;
+  int32_t counts[2];
+  if (!inBounds(reader, *offset, sizeof(recordOffset) + sizeof(counts)))
+    return NULL;
+  memcpy(&recordOffset, reader->base + *offset, sizeof(recordOffset));
+  memcpy(counts, reader->base + *offset + sizeof(recordOffset), sizeof(counts));
+  *offset += sizeof(recordOffset) + sizeof(counts);
+  // NOTE: records only point backwards, a corrupted file can't loop
+  if (recordOffset >= parentOffset || counts[0] < 0 || counts[0] > 255 ||
+      counts[1] < 0 || counts[1] > UINT8_COUNT)
+    return NULL;
+
+  ObjFunction *function = newFunction(vm);
+  pushVM(vm, OBJ_VAL(function)); // NOTE: roots its chunk while it is read
+  function->arity = counts[0];
+  function->upvalueCount = counts[1];
+  function->name = readString(vm, reader, offset);
+  bool loaded = function->name != NULL;
+  if (loaded) {
+    writeBarrier(vm, (Obj *)function, OBJ_VAL(function->name));
+    loaded = readChunkRecord(vm, reader, recordOffset, &function->chunk,
+                             (Obj *)function);
+  }
+  popVM(vm);
+  return loaded ? function : NULL;
+}
+
+// owner is the function the chunk belongs to, NULL for the script
+static bool readConstants(VM *vm, Reader *reader, ChunkRecord *record,
+                          size_t recordOffset, Chunk *chunk, Obj *owner) {
+  size_t offset = record->constantsOffset;
+  for (uint32_t i = 0; i < record->constantCount; i++) {
+    if (!inBounds(reader, offset, 1))
+      return false;
+    uint8_t tag = reader->base[offset++];
+    switch (tag) {
+    case CONSTANT_NIL:
+      writeValueArray(&chunk->constants, NIL_VAL);
+      break;
+    case CONSTANT_FALSE:
+      writeValueArray(&chunk->constants, BOOL_VAL(false));
+      break;
+    case CONSTANT_TRUE:
+      writeValueArray(&chunk->constants, BOOL_VAL(true));
+      break;
+    case CONSTANT_NUMBER: {
+      double number;
+      if (!inBounds(reader, offset, sizeof(number)))
+        return false;
+      memcpy(&number, reader->base + offset, sizeof(number));
+      offset += sizeof(number);
+      writeValueArray(&chunk->constants, NUMBER_VAL(number));
+      break;
+    }
+    case CONSTANT_STRING:
+    case CONSTANT_FUNCTION: {
+      Obj *object =
+          tag == CONSTANT_STRING
+              ? (Obj *)readString(vm, reader, &offset)
+              : (Obj *)readFunction(vm, reader, &offset, recordOffset);
+      if (object == NULL)
+        return false;
+      pushVM(vm, OBJ_VAL(object)); // NOTE: reachable while the pool grows
+      writeValueArray(&chunk->constants, OBJ_VAL(object));
+      writeBarrier(vm, owner, OBJ_VAL(object));
+      popVM(vm);
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// A constant or global operand, 8 or 24 bits
+static size_t readOperand(const uint8_t *code, bool isLong) {
+  return isLong ? (size_t)((code[0] << 16) | (code[1] << 8) | code[2])
+                : code[0];
+}
+
+static bool isStringConstant(Chunk *chunk, size_t constant) {
+  return constant < chunk->constants.count &&
+         IS_STRING(chunk->constants.values[constant]);
+}
+
+// Checks the operands of the instruction at offset and returns its length,
+// or 0 if it is unknown, runs past the code or indexes out of range
+static int checkInstruction(VM *vm, Chunk *chunk, int offset,
+                            int upvalueCount) {
+  const uint8_t *code = chunk->code + offset;
+  size_t room = chunk->count - offset;
+  uint8_t op = code[0];
+  // NOTE: quickened forms are rewritten from generic ones while running, a
+  // file never holds them
+  if (op > OP_INVOKE_LONG)
+    return 0;
+  bool isLong = op >= OP_CONSTANT_LONG;
+  // The length of OP_CLOSURE depends on its function constant
+  if (op == OP_CLOSURE || op == OP_CLOSURE_LONG) {
+    size_t head = isLong ? 4 : 2;
+    if (room < head)
+      return 0;
+    size_t constant = readOperand(code + 1, isLong);
+    if (constant >= chunk->constants.count ||
+        !IS_FUNCTION(chunk->constants.values[constant]))
+      return 0;
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    if (room < head + 2 * (size_t)function->upvalueCount)
+      return 0;
+    for (int i = 0; i < function->upvalueCount; i++) {
+      uint8_t isLocal = code[head + 2 * i];
+      uint8_t index = code[head + 2 * i + 1];
+      if (isLocal > 1 || (!isLocal && index >= upvalueCount))
+        return 0;
+    }
+    return (int)head + 2 * function->upvalueCount;
+  }
+  int length = instructionLength(chunk, offset);
+  if ((size_t)length > room)
+    return 0;
+
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+    return readOperand(code + 1, isLong) < chunk->constants.count ? length
+                                                                  : 0;
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+    return readOperand(code + 1, isLong) < vm->globalValues.count ? length
+                                                                  : 0;
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+    return code[1] < upvalueCount ? length : 0;
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_CLASS_LONG:
+  case OP_METHOD_LONG:
+    return isStringConstant(chunk, readOperand(code + 1, isLong)) ? length
+                                                                  : 0;
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY_LONG: {
+    const uint8_t *cache = code + (isLong ? 4 : 2);
+    return isStringConstant(chunk, readOperand(code + 1, isLong)) &&
+                   (size_t)((cache[0] << 8) | cache[1]) <
+                       chunk->propertyCacheCount
+               ? length
+               : 0;
+  }
+  case OP_INVOKE:
+  case OP_INVOKE_LONG: {
+    // The cache index follows the argument count
+    const uint8_t *cache = code + (isLong ? 5 : 3);
+    return isStringConstant(chunk, readOperand(code + 1, isLong)) &&
+                   (size_t)((cache[0] << 8) | cache[1]) <
+                       chunk->invokeCacheCount
+               ? length
+               : 0;
+  }
+  default:
+    return length;
+  }
+}
+
+// Walks the code once before anything runs it, run() trusts every operand:
+// instructions must be known and fit in the code, their indices must be in
+// range, jumps must land on an instruction and the code must end in a return.
+// NOTE: stack depths are not checked
+static bool checkCode(VM *vm, Chunk *chunk, int upvalueCount) {
+  int count = (int)chunk->count;
+  bool *starts = (bool *)calloc(count + 1, sizeof(bool));
+  if (starts == NULL)
+    exit(1);
+  bool valid = count > 0;
+  int last = 0;
+  for (int offset = 0; offset < count && valid;) {
+    starts[offset] = true;
+    last = offset;
+    int length = checkInstruction(vm, chunk, offset, upvalueCount);
+    valid = length > 0;
+    offset += length;
+  }
+  valid = valid && chunk->code[last] == OP_RETURN;
+  for (int offset = 0; offset < count && valid;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t op = chunk->code[offset];
+    if (op != OP_JUMP && op != OP_JUMP_IF_FALSE && op != OP_LOOP)
+      continue;
+    int distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    int target =
+        op == OP_LOOP ? offset + 3 - distance : offset + 3 + distance;
+    valid = target >= 0 && target < count && starts[target];
+  }
+  free(starts);
+  return valid;
+}
+
+static bool readChunkRecord(VM *vm, Reader *reader, size_t offset,
+                            Chunk *chunk, Obj *owner) {
+  ChunkRecord record;
+  if (offset % 4 != 0 || !inBounds(reader, offset, sizeof(record)))
+    return false;
+  memcpy(&record, reader->base + offset, sizeof(record));
+
+  if (!inBounds(reader, record.codeOffset, record.codeLength) ||
+      record.linesOffset % 4 != 0 ||
+      !inBounds(reader, record.linesOffset,
+                sizeof(LineStart) * (size_t)record.lineCount) ||
+      record.propertyCacheCount > MAX_INLINE_CACHES ||
+      record.invokeCacheCount > MAX_INLINE_CACHES) {
+    return false;
+  }
+
+  // NOTE: code and lines point into the mapping, a zero capacity tells
+  // freeChunk they are borrowed
+  chunk->code = (uint8_t *)reader->base + record.codeOffset;
+  chunk->count = record.codeLength;
+  chunk->capacity = 0;
+  chunk->lines = (LineStart *)(reader->base + record.linesOffset);
+  chunk->lineCount = record.lineCount;
+  chunk->lineCapacity = 0;
+  for (uint32_t i = 0; i < record.propertyCacheCount; i++) {
+    addPropertyCache(chunk);
+  }
+  for (uint32_t i = 0; i < record.invokeCacheCount; i++) {
+    addInvokeCache(chunk);
+  }
+
+  int upvalueCount = owner == NULL ? 0 : ((ObjFunction *)owner)->upvalueCount;
+  return readConstants(vm, reader, &record, offset, chunk, owner) &&
+         checkCode(vm, chunk, upvalueCount);
+}
+
+// Claims the slots the chunk was compiled against. They only line up in a VM
+// that has not resolved other globals first, anything else fails the load
+static bool readGlobalNames(VM *vm, Reader *reader, BytecodeHeader *header) {
+  size_t offset = header->globalsOffset;
+  for (uint32_t i = 0; i < header->globalCount; i++) {
+    uint32_t length;
+    if (!inBounds(reader, offset, sizeof(length)))
+      return false;
+    memcpy(&length, reader->base + offset, sizeof(length));
+    offset += sizeof(length);
+    if (!inBounds(reader, offset, length))
+      return false;
+    ObjString *name =
+        copyString(vm, (const char *)reader->base + offset, (int)length);
+    offset += length;
+    if (globalSlot(vm, name) != (int)i)
+      return false;
+  }
+  return true;
+}
+
+bool readBytecode(VM *vm, uint8_t *base, size_t size, Chunk *chunk) {
+  BytecodeHeader header;
+  if (size < sizeof(header))
+    return false;
+  memcpy(&header, base, sizeof(header));
+  Reader reader = {base, size};
+  // NOTE: the chunk is a root while its objects are allocated, otherwise a
+  // collection would free the constants read so far
+  Chunk *running = vm->chunk;
+  vm->chunk = chunk;
+  bool loaded =
+      memcmp(header.magic, BYTECODE_MAGIC, sizeof(header.magic)) == 0 &&
+      header.version == BYTECODE_VERSION &&
+      header.byteOrder == BYTECODE_BYTE_ORDER &&
+      readGlobalNames(vm, &reader, &header) &&
+      readChunkRecord(vm, &reader, header.chunkOffset, chunk, NULL);
+  vm->chunk = running;
+  if (!loaded)
+    freeChunk(chunk);
+  return loaded;
+}
+
+bool loadBytecode(VM *vm, const char *path, MappedFile *file, Chunk *chunk) {
+  file->base = NULL;
+  file->size = 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(BytecodeHeader)) {
+    close(fd);
+    return false;
+  }
+
+  // Private and writable: the VM may patch code in place, those writes stay
+  // in our copy-on-write pages and never reach the file
+  void *base = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return false;
+  file->base = base;
+  file->size = info.st_size;
+  if (!readBytecode(vm, file->base, file->size, chunk)) {
+    unmapBytecode(file);
+    return false;
+  }
+  return true;
+}
+
+void unmapBytecode(MappedFile *file) {
+  if (file->base != NULL) {
+    munmap(file->base, file->size);
+  }
+  file->base = NULL;
+  file->size = 0;
+}
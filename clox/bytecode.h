@@ -0,0 +1,75 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+
+// On disk format of a compiled chunk (.loxc files). All integers are native
+// endian, the files are meant to be produced and run on the same machine.
+//
+//   BytecodeHeader
+//   chunk records of the functions, innermost first
+//   chunk record: ChunkRecord, code bytes, LineStart runs, constants
+//   global names: uint32_t length then the characters, in slot order
+//
+// Code and line runs are used in place from the mapped file, only the
+// constant pool is decoded since strings must become VM objects. The global
+// instructions carry slots of the VM that compiled the chunk, the names let
+// the loader claim the same slots in a fresh VM.
+#define BYTECODE_MAGIC "LOXC"
+#define BYTECODE_VERSION 6
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t byteOrder; // BYTECODE_BYTE_ORDER as written by the producer
+  uint32_t chunkOffset;
+  uint32_t globalCount;
+  uint32_t globalsOffset;
+} BytecodeHeader;
+
+#define BYTECODE_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  uint32_t codeLength;
+  uint32_t codeOffset;
+  uint32_t lineCount;
+  uint32_t linesOffset; // 4 byte aligned, an array of LineStart
+  uint32_t constantCount;
+  uint32_t constantsOffset;
+  // Inline caches of the property and invoke instructions, they start empty
+  // so only their number is stored
+  uint32_t propertyCacheCount;
+  uint32_t invokeCacheCount;
+} ChunkRecord;
+
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE,
+  CONSTANT_NUMBER, // 8 bytes, the double
+  CONSTANT_STRING, // uint32_t length, then the characters
+  // uint32_t offset of its chunk record, int32_t arity and upvalue count,
+  // then the name as a string
+  CONSTANT_FUNCTION,
+} ConstantTag;
+
+// A .loxc file mapped in memory, the chunks loaded from it borrow its code
+// so it must stay mapped until they are freed
+typedef struct {
+  uint8_t *base;
+  size_t size;
+} MappedFile;
+
+bool isBytecodeFile(const char *path);
+// The bytes of a .loxc file for chunk, malloc'd
+uint8_t *encodeBytecode(VM *vm, Chunk *chunk, size_t *size);
+bool saveBytecode(VM *vm, Chunk *chunk, const char *path);
+bool loadBytecode(VM *vm, const char *path, MappedFile *file, Chunk *chunk);
+// Loads from a .loxc image already in memory. The chunks borrow its code, and
+// may patch it, so it must be writable and outlive them
+bool readBytecode(VM *vm, uint8_t *base, size_t size, Chunk *chunk);
+void unmapBytecode(MappedFile *file);
+
+#endif
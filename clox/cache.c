@@ -0,0 +1,180 @@
+#include "cache.h"
+#include "bytecode.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "vm.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_PATH_MAX 4096
+// Temporary files older than this belong to a writer that died
+#define STALE_TEMP_SECONDS 3600
+
+// 64 bit FNV-1a, wide enough that two different scripts never share a key in
+// practice (the length is part of the key as well)
+static uint64_t hashSource(const char *source, size_t length) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)source[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static bool makeDirectory(const char *path) {
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static bool cacheDirectory(char *dir, size_t size) {
+  const char *override = getenv("CLOX_CACHE_DIR");
+  if (override != NULL && override[0] != '\0') {
+    return snprintf(dir, size, "%s", override) < (int)size &&
+           makeDirectory(dir);
+  }
+
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char parent[CACHE_PATH_MAX];
+  int written;
+  if (xdg != NULL && xdg[0] != '\0') {
+    written = snprintf(parent, sizeof(parent), "%s", xdg);
+  } else if (home != NULL && home[0] != '\0') {
+    written = snprintf(parent, sizeof(parent), "%s/.cache", home);
+  } else {
+    return false;
+  }
+  return written < (int)sizeof(parent) &&
+         snprintf(dir, size, "%s/clox", parent) < (int)size &&
+         makeDirectory(parent) && makeDirectory(dir);
+}
+
+typedef struct {
+  char name[64];
+  time_t mtime;
+  off_t size;
+} CacheEntry;
+
+static int compareEntries(const void *a, const void *b) {
+  time_t left = ((const CacheEntry *)a)->mtime;
+  time_t right = ((const CacheEntry *)b)->mtime;
+  return (left > right) - (left < right);
+}
+
+static bool hasSuffix(const char *name, const char *suffix) {
+  size_t length = strlen(name), suffixLength = strlen(suffix);
+  return length >= suffixLength &&
+         strcmp(name + length - suffixLength, suffix) == 0;
+}
+
+// Least recently used eviction, only runs after a new entry was written so
+// hits never pay for scanning the directory
+static void evictEntries(const char *dir) {
+  DIR *handle = opendir(dir);
+  if (handle == NULL)
+    return;
+
+  size_t count = 0, capacity = 0;
+  CacheEntry *entries = NULL;
+  off_t totalBytes = 0;
+  time_t now = time(NULL);
+  char path[CACHE_PATH_MAX];
+
+  struct dirent *item;
+  while ((item = readdir(handle)) != NULL) {
+    bool isEntry = hasSuffix(item->d_name, ".loxc");
+    bool isTemp = strstr(item->d_name, ".loxc.tmp.") != NULL;
+    if ((!isEntry && !isTemp) || strlen(item->d_name) >= 64)
+      continue;
+    struct stat info;
+    if (snprintf(path, sizeof(path), "%s/%s", dir, item->d_name) >=
+            (int)sizeof(path) ||
+        stat(path, &info) != 0)
+      continue;
+    if (isTemp) {
+      if (now - info.st_mtime > STALE_TEMP_SECONDS)
+        unlink(path);
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity < 64 ? 64 : capacity * 2;
+      entries = realloc(entries, sizeof(CacheEntry) * capacity);
+      if (entries == NULL)
+        exit(1);
+    }
+    CacheEntry *entry = &entries[count++];
+    snprintf(entry->name, sizeof(entry->name), "%s", item->d_name);
+    entry->mtime = info.st_mtime;
+    entry->size = info.st_size;
+    totalBytes += info.st_size;
+  }
+  closedir(handle);
+
+  qsort(entries, count, sizeof(CacheEntry), compareEntries);
+  for (size_t i = 0;
+       i < count && (count - i > CACHE_MAX_ENTRIES || totalBytes > CACHE_MAX_BYTES);
+       i++) {
+    if (snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name) <
+            (int)sizeof(path) &&
+        unlink(path) == 0)
+      totalBytes -= entries[i].size;
+  }
+  free(entries);
+}
+
+// Write to a private temporary name, then rename over the final name. The
+// rename is atomic so readers see either no entry or a complete one
+static void storeEntry(VM *vm, Chunk *chunk, const char *dir, const char *path) {
+  char tempPath[CACHE_PATH_MAX];
+  if (snprintf(tempPath, sizeof(tempPath), "%s.tmp.%ld", path,
+               (long)getpid()) >= (int)sizeof(tempPath))
+    return;
+  if (!saveBytecode(vm, chunk, tempPath) || rename(tempPath, path) != 0) {
+    unlink(tempPath);
+    return;
+  }
+  evictEntries(dir);
+}
+
+InterpretResult interpretCached(VM *vm, const char *source) {
+  char dir[CACHE_PATH_MAX];
+  if (!cacheDirectory(dir, sizeof(dir))) {
+    return interpret(vm, source);
+  }
+
+  size_t length = strlen(source);
+  char path[CACHE_PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%016llx-%zx.loxc", dir,
+               (unsigned long long)hashSource(source, length),
+               length) >= (int)sizeof(path)) {
+    return interpret(vm, source);
+  }
+
+  MappedFile file;
+  Chunk chunk;
+  initChunk(&chunk);
+  if (loadBytecode(vm, path, &file, &chunk)) {
+    utimensat(AT_FDCWD, path, NULL, 0); // Mark as recently used
+    InterpretResult result = interpretChunk(vm, &chunk);
+    freeChunk(&chunk);
+    unmapBytecode(&file);
+    return result;
+  }
+
+  // Miss, or an entry the loader rejected (another format version, a damaged
+  // or foreign file): compile and replace it
+  if (!compile(vm, source, &chunk)) {
+    freeChunk(&chunk);
+    return INTERPRET_COMPILE_ERROR;
+  }
+  storeEntry(vm, &chunk, dir, path);
+  InterpretResult result = interpretChunk(vm, &chunk);
+  freeChunk(&chunk);
+  return result;
+}
@@ -0,0 +1,21 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "vm.h"
+
+// On disk cache of compiled scripts, like __pycache__ but keyed by a hash of
+// the source text instead of the file name. Entries are .loxc files (see
+// bytecode.h) in $CLOX_CACHE_DIR, $XDG_CACHE_HOME/clox or ~/.cache/clox.
+//
+// Entries are written to a temporary file and renamed into place so
+// concurrent runs never see a partial file. A hit refreshes the entry's
+// mtime, and when the cache grows past CACHE_MAX_ENTRIES or CACHE_MAX_BYTES
+// the least recently used entries are removed.
+#define CACHE_MAX_ENTRIES 512
+#define CACHE_MAX_BYTES (64 * 1024 * 1024)
+
+// Runs source, reusing the cached bytecode when this exact source was
+// compiled before. Falls back to a plain compile if the cache is unusable
+InterpretResult interpretCached(VM *vm, const char *source);
+
+#endif
@@ -1,25 +1,146 @@
 #include "chunk.h"
+#include "jit.h"
 #include "memory.h"
+#include "object.h"
+#include "regvm.h"
 #include "value.h"
 #include <stdlib.h>
+#include <string.h>
 
 void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
+  chunk->constantIndexCapacity = 0;
+  chunk->constantIndex = NULL;
+  chunk->propertyCacheCount = 0;
+  chunk->propertyCacheCapacity = 0;
+  chunk->propertyCaches = NULL;
+  chunk->invokeCacheCount = 0;
+  chunk->invokeCacheCapacity = 0;
+  chunk->invokeCaches = NULL;
+  chunk->loopTraces = NULL;
+  chunk->native = NULL;
+  chunk->regCode = NULL;
 }
 
+static uint32_t hashConstant(Value value) {
+  if (IS_STRING(value))
+    return AS_STRING(value)->hash;
+  uint64_t bits;
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(bits));
+  } else if (IS_OBJ(value)) {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  } else {
+    bits = IS_NIL(value) ? 1 : 2 + AS_BOOL(value);
+  }
+  // NOTE: fold the 64 bits so the exponent of doubles takes part in the hash
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// Stricter than valuesEqual: numbers must be the same bits so 0 and -0 keep
+// separate slots
+static bool sameConstant(Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a), y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return valuesEqual(a, b);
+}
+
+static int *findConstant(Chunk *chunk, Value value, uint32_t hash) {
+  size_t mask = chunk->constantIndexCapacity - 1;
+  for (size_t index = hash & mask;; index = (index + 1) & mask) {
+    int *bucket = &chunk->constantIndex[index];
+    if (*bucket == -1 ||
+        sameConstant(chunk->constants.values[*bucket], value)) {
+      return bucket;
+    }
+  }
+}
+
+static void growConstantIndex(Chunk *chunk) {
+  size_t oldCapacity = chunk->constantIndexCapacity;
+  FREE_ARRAY(int, chunk->constantIndex, oldCapacity);
+  chunk->constantIndexCapacity = GROW_CAPACITY(oldCapacity);
+  chunk->constantIndex =
+      GROW_ARRAY(int, NULL, 0, chunk->constantIndexCapacity);
+  for (size_t i = 0; i < chunk->constantIndexCapacity; i++) {
+    chunk->constantIndex[i] = -1;
+  }
+  for (size_t i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    *findConstant(chunk, value, hashConstant(value)) = (int)i;
+  }
+}
+
+// Returns the slot of value in the constant pool, reusing an existing slot
+// when the same literal was already added
 size_t addConstant(Chunk *chunk, Value value) {
+  // Keep the index at most half full, probes stay short
+  if ((chunk->constants.count + 1) * 2 > chunk->constantIndexCapacity) {
+    growConstantIndex(chunk);
+  }
+  uint32_t hash = hashConstant(value);
+  int *bucket = findConstant(chunk, value, hash);
+  if (*bucket != -1)
+    return (size_t)*bucket;
+
   writeValueArray(&chunk->constants, value);
+  *bucket = (int)chunk->constants.count - 1;
   return chunk->constants.count - 1;
 }
 
+// Returns the index of a new empty inline cache for a property instruction
+size_t addPropertyCache(Chunk *chunk) {
+  if (chunk->propertyCacheCapacity < chunk->propertyCacheCount + 1) {
+    size_t oldCapacity = chunk->propertyCacheCapacity;
+    chunk->propertyCacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->propertyCaches =
+        GROW_ARRAY(PropertyCache, chunk->propertyCaches, oldCapacity,
+                   chunk->propertyCacheCapacity);
+  }
+  chunk->propertyCaches[chunk->propertyCacheCount] =
+      (PropertyCache){NULL, NULL, 0};
+  return chunk->propertyCacheCount++;
+}
+
+// Returns the index of a new empty inline cache for an OP_INVOKE
+size_t addInvokeCache(Chunk *chunk) {
+  if (chunk->invokeCacheCapacity < chunk->invokeCacheCount + 1) {
+    size_t oldCapacity = chunk->invokeCacheCapacity;
+    chunk->invokeCacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->invokeCaches =
+        GROW_ARRAY(InvokeCache, chunk->invokeCaches, oldCapacity,
+                   chunk->invokeCacheCapacity);
+  }
+  chunk->invokeCaches[chunk->invokeCacheCount] = (InvokeCache){0};
+  return chunk->invokeCacheCount++;
+}
+
 void freeChunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  // NOTE: a zero capacity with a non NULL array means the chunk borrows it,
+  // e.g. code mapped straight from a .loxc file (see bytecode.c)
+  if (chunk->capacity > 0)
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  if (chunk->lineCapacity > 0)
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(int, chunk->constantIndex, chunk->constantIndexCapacity);
+  FREE_ARRAY(PropertyCache, chunk->propertyCaches,
+             chunk->propertyCacheCapacity);
+  FREE_ARRAY(InvokeCache, chunk->invokeCaches, chunk->invokeCacheCapacity);
+  freeLoopTraces(chunk->loopTraces);
+  freeRegCode(chunk->regCode);
   initChunk(chunk);
 }
 
@@ -27,12 +148,93 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
   if (chunk->capacity < chunk->count + 1) {
     size_t oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
-    chunk->lines =
-        GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     chunk->code =
         GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
   }
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
+
+  // Still on the same line, the current run already covers this byte
+  if (chunk->lineCount > 0 &&
+      chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    size_t oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity,
+                              chunk->lineCapacity);
+  }
+  LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+  lineStart->offset = (int)chunk->count - 1;
+  lineStart->line = line;
+}
+
+// Source line of the byte at offset. Binary search over the runs, only
+// needed for error reporting and the disassembler so it stays off the hot
+// path
+int getLine(Chunk *chunk, int offset) {
+  size_t low = 0;
+  size_t high = chunk->lineCount;
+  // Find the last run starting at or before offset
+  while (high - low > 1) {
+    size_t mid = low + (high - low) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return chunk->lineCount == 0 ? 0 : chunk->lines[low].line;
+}
+
+// Size in bytes of the instruction at offset, opcode plus operands
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CLASS:
+  case OP_METHOD:
+    return 2;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+    return 3;
+  case OP_CONSTANT_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+  case OP_CLASS_LONG:
+  case OP_METHOD_LONG:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+    return 4;
+  case OP_INVOKE:
+    return 5;
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY_LONG:
+    return 6;
+  case OP_INVOKE_LONG:
+    return 7;
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    bool isLong = chunk->code[offset] == OP_CLOSURE_LONG;
+    int constant = isLong ? (chunk->code[offset + 1] << 16) |
+                                (chunk->code[offset + 2] << 8) |
+                                chunk->code[offset + 3]
+                          : chunk->code[offset + 1];
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    return (isLong ? 4 : 2) + 2 * function->upvalueCount;
+  }
+  default:
+    return 1;
+  }
 }
@@ -12,18 +12,146 @@ typedef enum {
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
+  OP_NIL,
+  OP_TRUE,
+  OP_FALSE,
+  OP_NOT,
+  OP_EQUAL,
+  OP_GREATER,
+  OP_LESS,
+  OP_PRINT,
+  OP_POP,
+  OP_DEFINE_GLOBAL,
+  OP_GET_GLOBAL,
+  OP_SET_GLOBAL,
+  OP_GET_LOCAL,
+  OP_SET_LOCAL,
+  OP_JUMP,          // 16 bit forward offset
+  OP_JUMP_IF_FALSE, // 16 bit forward offset, leaves the condition on the stack
+  OP_LOOP,          // 16 bit backward offset
+  OP_CALL,          // argument count, the callee sits below the arguments
+  OP_TAIL_CALL,     // OP_CALL that reuses the caller's frame, see optimizer.c
+  // Function constant, then an (isLocal, index) byte pair per upvalue
+  OP_CLOSURE,
+  OP_GET_UPVALUE,
+  OP_SET_UPVALUE,
+  OP_CLOSE_UPVALUE, // moves the top of the stack into its upvalue, then pops
+  OP_CLASS,         // class name constant
+  OP_METHOD,        // name constant, binds the closure on top to the class
+  // Name constant, then the 16 bit index of the instruction's PropertyCache
+  OP_GET_PROPERTY,
+  OP_SET_PROPERTY,
+  // Method call fused with its lookup: name constant, argument count, then
+  // the 16 bit index of the instruction's InvokeCache
+  OP_INVOKE,
+  // Same as their short forms but with a 24 bit constant index, for chunks
+  // with more than 256 constants
+  OP_CONSTANT_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  OP_CLOSURE_LONG,
+  OP_CLASS_LONG,
+  OP_METHOD_LONG,
+  OP_GET_PROPERTY_LONG,
+  OP_SET_PROPERTY_LONG,
+  OP_INVOKE_LONG,
+  // Quickened forms, never emitted by the compiler. The first run of a
+  // generic instruction rewrites it in place to the form for the operand
+  // types it saw, and the form rewrites itself back when they change, see
+  // QUICKEN in vm.c
+  OP_ADD_NUM_NUM,
+  OP_ADD_STR_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  OP_NEGATE_NUM,
 } OpCode;
 
+#define MAX_SHORT_CONSTANT UINT8_MAX
+#define MAX_LONG_CONSTANT 0xffffff
+#define MAX_INLINE_CACHES (UINT16_MAX + 1)
+#define INVOKE_CACHE_ENTRIES 4
+
+struct LoopTrace;
+struct ObjClass;
+struct ObjClosure;
+struct ObjShape;
+struct RegCode;
+struct VM;
+
+// A chunk translated to C by --emit-c, see aot.h. Runs the frame from ip, an
+// instruction boundary, and returns the ip of the first instruction it
+// leaves to run()
+typedef uint8_t *(*NativeCode)(struct VM *vm, Value *slots,
+                               struct ObjClosure *closure, uint8_t *ip);
+
+// Inline cache of one property instruction: the shape of the last instance
+// it saw and where the field lives in instances of that shape. A store that
+// added the field also remembers the shape the instance moved to.
+// NOTE: shapes are never freed, see ObjShape, so a stale entry is only ever
+// a miss
+typedef struct {
+  struct ObjShape *shape; // NULL until the instruction first misses
+  struct ObjShape *next;  // shape after a store, equal to shape unless adding
+  int slot;
+} PropertyCache;
+
+// Method one OP_INVOKE called for receivers of one class and shape. The shape
+// is part of the key because a field of the same name would shadow the method
+typedef struct {
+  struct ObjClass *klass; // NULL for an unused entry
+  struct ObjShape *shape;
+  struct ObjClosure *method;
+} InvokeEntry;
+
+// Polymorphic inline cache of one OP_INVOKE, filled in order. Once all the
+// entries are taken the site is megamorphic and uses vm->methodCache.
+// NOTE: unlike shapes, classes and methods can die, the entries are traced
+// as references of the chunk's function (see blackenObject)
+typedef struct {
+  InvokeEntry entries[INVOKE_CACHE_ENTRIES];
+} InvokeCache;
+
+// One run of the line table: every byte from offset up to the offset of the
+// next run was compiled from line
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 typedef struct {
   size_t count; // points to the next location in the array
   size_t capacity;
   uint8_t *code;
-  int *lines;
+  size_t lineCount;
+  size_t lineCapacity;
+  LineStart *lines; // run-length encoded, sorted by offset
   ValueArray constants;
+  // Open addressing index over constants (-1 marks an empty bucket) so equal
+  // literals share one slot while the chunk is being written
+  size_t constantIndexCapacity;
+  int *constantIndex;
+  size_t propertyCacheCount;
+  size_t propertyCacheCapacity;
+  // Indexed by the operand of the property instructions
+  PropertyCache *propertyCaches;
+  size_t invokeCacheCount;
+  size_t invokeCacheCapacity;
+  InvokeCache *invokeCaches; // indexed by the operand of OP_INVOKE
+  struct LoopTrace *loopTraces; // hot loops of the tracing JIT, see jit.c
+  NativeCode native; // set in programs built from --emit-c output
+  struct RegCode *regCode; // register form, see regvm.c
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 size_t addConstant(Chunk *chunk, Value value);
+size_t addPropertyCache(Chunk *chunk);
+size_t addInvokeCache(Chunk *chunk);
+int instructionLength(Chunk *chunk, int offset);
+int getLine(Chunk *chunk, int offset);
 #endif
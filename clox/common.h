@@ -5,6 +5,28 @@
 # include <stddef.h>
 # include <stdint.h>
 
-#define DEBUG_TRACE_EXECUTION 
+#define UINT8_COUNT (UINT8_MAX + 1)
+
+// Direct threaded dispatch in run() relies on the labels-as-values extension
+// of GCC and Clang. Build with -DNO_COMPUTED_GOTO to get the portable switch
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Pack every Value in 64 bits using the unused NaN space of doubles, keeps
+// stack slots and constants at 8 bytes. Build with -DNO_NAN_BOXING to get the
+// plain tagged union (easier to inspect in a debugger)
+#ifndef NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+// run() keeps the value on top of the stack in a local instead of in its
+// slot, see TOS. Build with -DNO_TOS_CACHE to keep every value in memory
+#ifndef NO_TOS_CACHE
+#define TOS_CACHE
+#endif
+
+// Build with -DDEBUG_STRESS_GC to run a collection on every allocation, shakes
+// out objects that are not reachable from a root while still in use
 
 # endif
@@ -1,23 +1,1019 @@
 #include "compiler.h"
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "value.h"
+#include "vm.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-void compile(Scanner *scanner, const char *source) {
-  initScanner(scanner, source);
-  int line = -1;
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+typedef enum {
+  PREC_NONE,
+  PREC_ASSIGNMENT, // =
+  PREC_OR,         // or
+  PREC_AND,        // and
+  PREC_EQUALITY,   // == !=
+  PREC_COMPARISON, // < > <= >=
+  PREC_TERM,       // + -
+  PREC_FACTOR,     // * /
+  PREC_UNARY,      // ! -
+  PREC_CALL,       // . ()
+  PREC_PRIMARY
+} Precedence;
+
+typedef struct {
+  Token name;
+  int depth; // -1 while the initializer is being compiled
+  bool isCaptured; // a closure uses it, leaving its scope closes the upvalue
+} Local;
+
+// A variable of an enclosing function used by this one
+typedef struct {
+  uint8_t index; // slot of the local, or of the upvalue when not isLocal
+  bool isLocal;  // a local of the directly enclosing function
+} Upvalue;
+
+typedef enum {
+  TYPE_FUNCTION,
+  TYPE_INITIALIZER, // init method, returns this
+  TYPE_METHOD,
+  TYPE_SCRIPT,
+} FunctionType;
+
+// Locals live in the VM stack, the index in this array is their slot in the
+// call frame
+typedef struct Compiler {
+  struct Compiler *enclosing;
+  ObjFunction *function; // NULL for the script, its code goes in parser->chunk
+  FunctionType type;
+  Local locals[UINT8_COUNT];
+  int localCount;
+  Upvalue upvalues[UINT8_COUNT];
+  int scopeDepth; // 0 is the global scope
+} Compiler;
+
+// The class whose body is being compiled, this is only valid inside one
+typedef struct ClassCompiler {
+  struct ClassCompiler *enclosing;
+} ClassCompiler;
+
+typedef struct Parser {
+  Scanner scanner;
+  Token current;
+  Token previous;
+  bool hadError;
+  bool panicMode; // suppress cascading errors until we synchronize
+  VM *vm;
+  Compiler *compiler;
+  ClassCompiler *currentClass;
+  Chunk *chunk;
+} Parser;
+
+typedef void (*ParseFn)(Parser *parser, bool canAssign);
+
+typedef struct {
+  ParseFn prefix;
+  ParseFn infix;
+  Precedence precedence;
+} ParseRule;
+
+static Chunk *currentChunk(Parser *parser) {
+  ObjFunction *function = parser->compiler->function;
+  return function != NULL ? &function->chunk : parser->chunk;
+}
+
+static void errorAt(Parser *parser, Token *token, const char *message) {
+  if (parser->panicMode)
+    return;
+  parser->panicMode = true;
+  fprintf(stderr, "[line %d] Error", token->line);
+
+  if (token->type == TOKEN_EOF) {
+    fprintf(stderr, " at end");
+  } else if (token->type == TOKEN_ERROR) {
+    // Nothing, the message already says what is wrong
+  } else {
+    fprintf(stderr, " at '%.*s'", token->lenght, token->start);
+  }
+
+  fprintf(stderr, ": %s\n", message);
+  parser->hadError = true;
+}
+
+static void error(Parser *parser, const char *message) {
+  errorAt(parser, &parser->previous, message);
+}
+
+static void errorAtCurrent(Parser *parser, const char *message) {
+  errorAt(parser, &parser->current, message);
+}
+
+static void advance(Parser *parser) {
+  parser->previous = parser->current;
   for (;;) {
-    Token token = scanToken(scanner);
+    parser->current = scanToken(&parser->scanner);
+    if (parser->current.type != TOKEN_ERROR)
+      break;
+    errorAtCurrent(parser, parser->current.start);
+  }
+}
 
-    if (token.line != line) {
-      printf("%4d ", token.line);
-      line = token.line;
-    } else {
-      printf("   | ");
+static void consume(Parser *parser, TokenType type, const char *message) {
+  if (parser->current.type == type) {
+    advance(parser);
+    return;
+  }
+  errorAtCurrent(parser, message);
+}
+
+static bool check(Parser *parser, TokenType type) {
+  return parser->current.type == type;
+}
+
+static bool match(Parser *parser, TokenType type) {
+  if (!check(parser, type))
+    return false;
+  advance(parser);
+  return true;
+}
+
+static void emitByte(Parser *parser, uint8_t byte) {
+  writeChunk(currentChunk(parser), byte, parser->previous.line);
+}
+
+static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
+  emitByte(parser, byte1);
+  emitByte(parser, byte2);
+}
+
+static void emitLoop(Parser *parser, int loopStart) {
+  emitByte(parser, OP_LOOP);
+
+  // +2 to also jump over the operand of OP_LOOP itself
+  int offset = currentChunk(parser)->count - loopStart + 2;
+  if (offset > UINT16_MAX)
+    error(parser, "Loop body too large.");
+
+  emitByte(parser, (offset >> 8) & 0xff);
+  emitByte(parser, offset & 0xff);
+}
+
+// Emits a jump with a placeholder operand, returns where to patch it
+static int emitJump(Parser *parser, uint8_t instruction) {
+  emitByte(parser, instruction);
+  emitByte(parser, 0xff);
+  emitByte(parser, 0xff);
+  return currentChunk(parser)->count - 2;
+}
+
+// Falling off the end of a function or the script returns nil, an
+// initializer returns the instance in slot 0
+static void emitReturn(Parser *parser) {
+  if (parser->compiler->type == TYPE_INITIALIZER) {
+    emitBytes(parser, OP_GET_LOCAL, 0);
+  } else {
+    emitByte(parser, OP_NIL);
+  }
+  emitByte(parser, OP_RETURN);
+}
+
+static size_t makeConstant(Parser *parser, Value value) {
+  // NOTE: keep a fresh string reachable while the pool grows
+  pushVM(parser->vm, value);
+  size_t constant = addConstant(currentChunk(parser), value);
+  writeBarrier(parser->vm, (Obj *)parser->compiler->function, value);
+  popVM(parser->vm);
+  if (constant > MAX_LONG_CONSTANT) {
+    error(parser, "Too many constants in one chunk.");
+    return 0;
+  }
+  return constant;
+}
+
+// Emits op with a one byte operand, a constant index or a global slot, or
+// longOp with a 24 bit one when the index doesn't fit
+static void emitConstantOp(Parser *parser, uint8_t op, uint8_t longOp,
+                           size_t constant) {
+  if (constant <= MAX_SHORT_CONSTANT) {
+    emitBytes(parser, op, (uint8_t)constant);
+    return;
+  }
+  emitByte(parser, longOp);
+  emitByte(parser, (constant >> 16) & 0xff);
+  emitByte(parser, (constant >> 8) & 0xff);
+  emitByte(parser, constant & 0xff);
+}
+
+// A property instruction carries the index of its own inline cache after the
+// name constant
+static void emitPropertyOp(Parser *parser, uint8_t op, uint8_t longOp,
+                           size_t name) {
+  emitConstantOp(parser, op, longOp, name);
+  size_t cache = addPropertyCache(currentChunk(parser));
+  if (cache >= MAX_INLINE_CACHES) {
+    error(parser, "Too many property accesses in one chunk.");
+    cache = 0;
+  }
+  emitByte(parser, (cache >> 8) & 0xff);
+  emitByte(parser, cache & 0xff);
+}
+
+// OP_INVOKE carries the argument count between the name and its cache
+static void emitInvoke(Parser *parser, size_t name, uint8_t argCount) {
+  emitConstantOp(parser, OP_INVOKE, OP_INVOKE_LONG, name);
+  emitByte(parser, argCount);
+  size_t cache = addInvokeCache(currentChunk(parser));
+  if (cache >= MAX_INLINE_CACHES) {
+    error(parser, "Too many method calls in one chunk.");
+    cache = 0;
+  }
+  emitByte(parser, (cache >> 8) & 0xff);
+  emitByte(parser, cache & 0xff);
+}
+
+static void emitConstant(Parser *parser, Value value) {
+  emitConstantOp(parser, OP_CONSTANT, OP_CONSTANT_LONG,
+                 makeConstant(parser, value));
+}
+
+static void patchJump(Parser *parser, int offset) {
+  // -2 to adjust for the bytecode of the jump offset itself
+  int jump = currentChunk(parser)->count - offset - 2;
+  if (jump > UINT16_MAX) {
+    error(parser, "Too much code to jump over.");
+  }
+  currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+  currentChunk(parser)->code[offset + 1] = jump & 0xff;
+}
+
+static void initCompiler(Parser *parser, Compiler *compiler,
+                         FunctionType type) {
+  compiler->enclosing = parser->compiler;
+  compiler->function = NULL;
+  compiler->type = type;
+  compiler->localCount = 0;
+  compiler->scopeDepth = 0;
+  parser->compiler = compiler;
+  if (type == TYPE_SCRIPT)
+    return;
+
+  // NOTE: allocated once the compiler is linked, it is a root from here on
+  VM *vm = parser->vm;
+  compiler->function = newFunction(vm);
+  compiler->function->name =
+      copyString(vm, parser->previous.start, parser->previous.lenght);
+  writeBarrier(vm, (Obj *)compiler->function,
+               OBJ_VAL(compiler->function->name));
+
+  // Slot 0 of a call frame holds the closure being called, or the receiver
+  // of a method
+  Local *local = &compiler->locals[compiler->localCount++];
+  local->depth = 0;
+  local->isCaptured = false;
+  if (type == TYPE_FUNCTION) {
+    local->name.start = "";
+    local->name.lenght = 0;
+  } else {
+    local->name.start = "this";
+    local->name.lenght = 4;
+  }
+}
+
+// Finishes the current function and returns it, NULL for the script
+static ObjFunction *endCompiler(Parser *parser) {
+  emitReturn(parser);
+  ObjFunction *function = parser->compiler->function;
+  if (!parser->hadError) {
+    optimizeChunk(currentChunk(parser));
+  }
+#ifdef DEBUG_PRINT_CODE
+  if (!parser->hadError) {
+    disassembleChunk(currentChunk(parser),
+                     function != NULL ? function->name->chars : "<script>");
+  }
+#endif
+  parser->compiler = parser->compiler->enclosing;
+  return function;
+}
+
+static void beginScope(Parser *parser) { parser->compiler->scopeDepth++; }
+
+static void endScope(Parser *parser) {
+  Compiler *compiler = parser->compiler;
+  compiler->scopeDepth--;
+  while (compiler->localCount > 0 &&
+         compiler->locals[compiler->localCount - 1].depth >
+             compiler->scopeDepth) {
+    // A captured variable outlives the scope in its upvalue
+    emitByte(parser, compiler->locals[compiler->localCount - 1].isCaptured
+                         ? OP_CLOSE_UPVALUE
+                         : OP_POP);
+    compiler->localCount--;
+  }
+}
+
+static void expression(Parser *parser);
+static void statement(Parser *parser);
+static void declaration(Parser *parser);
+static ParseRule *getRule(TokenType type);
+static void parsePrecedence(Parser *parser, Precedence precedence);
+
+// Globals are resolved here rather than by name at runtime, the instructions
+// carry the slot of the name in vm->globalValues
+static size_t globalSlotOf(Parser *parser, Token *name) {
+  int slot = globalSlot(parser->vm,
+                        copyString(parser->vm, name->start, name->lenght));
+  if (slot < 0) {
+    error(parser, "Too many global variables.");
+    return 0;
+  }
+  return (size_t)slot;
+}
+
+static size_t identifierConstant(Parser *parser, Token *name) {
+  return makeConstant(
+      parser, OBJ_VAL(copyString(parser->vm, name->start, name->lenght)));
+}
+
+static bool identifiersEqual(Token *a, Token *b) {
+  if (a->lenght != b->lenght)
+    return false;
+  return memcmp(a->start, b->start, a->lenght) == 0;
+}
+
+// Returns the stack slot of a local variable, or -1 if name is a global
+static int resolveLocal(Parser *parser, Compiler *compiler, Token *name) {
+  // NOTE: walk backwards so inner declarations shadow outer ones
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local *local = &compiler->locals[i];
+    if (identifiersEqual(name, &local->name)) {
+      if (local->depth == -1) {
+        error(parser, "Can't read local variable in its own initializer.");
+      }
+      return i;
     }
-    printf("%2d '%.*s'\n", token.type, token.lenght, token.start);
+  }
+  return -1;
+}
+
+static int addUpvalue(Parser *parser, Compiler *compiler, uint8_t index,
+                      bool isLocal) {
+  int upvalueCount = compiler->function->upvalueCount;
+  for (int i = 0; i < upvalueCount; i++) {
+    Upvalue *upvalue = &compiler->upvalues[i];
+    if (upvalue->index == index && upvalue->isLocal == isLocal)
+      return i;
+  }
+  if (upvalueCount == UINT8_COUNT) {
+    error(parser, "Too many closure variables in function.");
+    return 0;
+  }
+  compiler->upvalues[upvalueCount].isLocal = isLocal;
+  compiler->upvalues[upvalueCount].index = index;
+  return compiler->function->upvalueCount++;
+}
+
+// Returns the upvalue slot of a variable declared by an enclosing function,
+// or -1 if name is a global. Every function in between captures it too, so a
+// closure only ever copies upvalues from the function that creates it
+static int resolveUpvalue(Parser *parser, Compiler *compiler, Token *name) {
+  if (compiler->enclosing == NULL)
+    return -1;
+
+  int local = resolveLocal(parser, compiler->enclosing, name);
+  if (local != -1) {
+    compiler->enclosing->locals[local].isCaptured = true;
+    return addUpvalue(parser, compiler, (uint8_t)local, true);
+  }
+  int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
+  if (upvalue != -1)
+    return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
+  return -1;
+}
 
-    if (token.type == TOKEN_EOF) {
+static void addLocal(Parser *parser, Token name) {
+  Compiler *compiler = parser->compiler;
+  if (compiler->localCount == UINT8_COUNT) {
+    error(parser, "Too many local variables in function.");
+    return;
+  }
+  Local *local = &compiler->locals[compiler->localCount++];
+  local->name = name;
+  local->depth = -1;
+  local->isCaptured = false;
+}
+
+static void declareVariable(Parser *parser) {
+  Compiler *compiler = parser->compiler;
+  if (compiler->scopeDepth == 0)
+    return;
+
+  Token *name = &parser->previous;
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local *local = &compiler->locals[i];
+    if (local->depth != -1 && local->depth < compiler->scopeDepth) {
       break;
     }
+    if (identifiersEqual(name, &local->name)) {
+      error(parser, "Already a variable with this name in this scope.");
+    }
+  }
+  addLocal(parser, *name);
+}
+
+static size_t parseVariable(Parser *parser, const char *errorMessage) {
+  consume(parser, TOKEN_IDENTIFIER, errorMessage);
+
+  declareVariable(parser);
+  if (parser->compiler->scopeDepth > 0)
+    return 0;
+
+  return globalSlotOf(parser, &parser->previous);
+}
+
+static void markInitialized(Parser *parser) {
+  Compiler *compiler = parser->compiler;
+  if (compiler->scopeDepth == 0)
+    return;
+  compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
+}
+
+static void defineVariable(Parser *parser, size_t global) {
+  // Locals are already in place, the initializer left them on the stack
+  if (parser->compiler->scopeDepth > 0) {
+    markInitialized(parser);
+    return;
+  }
+  emitConstantOp(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
+}
+
+static void binary(Parser *parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
+  ParseRule *rule = getRule(operatorType);
+  // NOTE: +1 because binary operators are left associative
+  parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+
+  switch (operatorType) {
+  case TOKEN_BANG_EQUAL:
+    emitBytes(parser, OP_EQUAL, OP_NOT);
+    break;
+  case TOKEN_EQUAL_EQUAL:
+    emitByte(parser, OP_EQUAL);
+    break;
+  case TOKEN_GREATER:
+    emitByte(parser, OP_GREATER);
+    break;
+  case TOKEN_GREATER_EQUAL:
+    emitBytes(parser, OP_LESS, OP_NOT);
+    break;
+  case TOKEN_LESS:
+    emitByte(parser, OP_LESS);
+    break;
+  case TOKEN_LESS_EQUAL:
+    emitBytes(parser, OP_GREATER, OP_NOT);
+    break;
+  case TOKEN_PLUS:
+    emitByte(parser, OP_ADD);
+    break;
+  case TOKEN_MINUS:
+    emitByte(parser, OP_SUBTRACT);
+    break;
+  case TOKEN_STAR:
+    emitByte(parser, OP_MULTIPLY);
+    break;
+  case TOKEN_SLASH:
+    emitByte(parser, OP_DIVIDE);
+    break;
+  default:
+    return; // Unreachable
+  }
+}
+
+static void literal(Parser *parser, bool canAssign) {
+  switch (parser->previous.type) {
+  case TOKEN_FALSE:
+    emitByte(parser, OP_FALSE);
+    break;
+  case TOKEN_NIL:
+    emitByte(parser, OP_NIL);
+    break;
+  case TOKEN_TRUE:
+    emitByte(parser, OP_TRUE);
+    break;
+  default:
+    return; // Unreachable
+  }
+}
+
+static uint8_t argumentList(Parser *parser) {
+  uint8_t argCount = 0;
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
+    do {
+      expression(parser);
+      if (argCount == 255) {
+        error(parser, "Can't have more than 255 arguments.");
+      }
+      argCount++;
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return argCount;
+}
+
+static void call(Parser *parser, bool canAssign) {
+  uint8_t argCount = argumentList(parser);
+  emitBytes(parser, OP_CALL, argCount);
+}
+
+static void dot(Parser *parser, bool canAssign) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  size_t name = identifierConstant(parser, &parser->previous);
+
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitPropertyOp(parser, OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+  } else if (match(parser, TOKEN_LEFT_PAREN)) {
+    // A call right after the dot looks the method up and calls it in one go
+    uint8_t argCount = argumentList(parser);
+    emitInvoke(parser, name, argCount);
+  } else {
+    emitPropertyOp(parser, OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+  }
+}
+
+static void grouping(Parser *parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+static void number(Parser *parser, bool canAssign) {
+  double value = strtod(parser->previous.start, NULL);
+  emitConstant(parser, NUMBER_VAL(value));
+}
+
+static void string(Parser *parser, bool canAssign) {
+  // +1 and -2 to trim the quotes
+  emitConstant(parser,
+               OBJ_VAL(copyString(parser->vm, parser->previous.start + 1,
+                                  parser->previous.lenght - 2)));
+}
+
+static void namedVariable(Parser *parser, Token name, bool canAssign) {
+  int slot = resolveLocal(parser, parser->compiler, &name);
+  if (slot != -1) {
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+      expression(parser);
+      emitBytes(parser, OP_SET_LOCAL, (uint8_t)slot);
+    } else {
+      emitBytes(parser, OP_GET_LOCAL, (uint8_t)slot);
+    }
+    return;
+  }
+
+  slot = resolveUpvalue(parser, parser->compiler, &name);
+  if (slot != -1) {
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+      expression(parser);
+      emitBytes(parser, OP_SET_UPVALUE, (uint8_t)slot);
+    } else {
+      emitBytes(parser, OP_GET_UPVALUE, (uint8_t)slot);
+    }
+    return;
+  }
+
+  size_t global = globalSlotOf(parser, &name);
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitConstantOp(parser, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, global);
+  } else {
+    emitConstantOp(parser, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, global);
+  }
+}
+
+static void variable(Parser *parser, bool canAssign) {
+  namedVariable(parser, parser->previous, canAssign);
+}
+
+static void this_(Parser *parser, bool canAssign) {
+  if (parser->currentClass == NULL) {
+    error(parser, "Can't use 'this' outside of a class.");
+    return;
+  }
+  // this is slot 0 of the method, closures inside it capture it as usual
+  variable(parser, false);
+}
+
+static void unary(Parser *parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
+
+  // Compile the operand first, the operator is applied to its result
+  parsePrecedence(parser, PREC_UNARY);
+
+  switch (operatorType) {
+  case TOKEN_BANG:
+    emitByte(parser, OP_NOT);
+    break;
+  case TOKEN_MINUS:
+    emitByte(parser, OP_NEGATE);
+    break;
+  default:
+    return; // Unreachable
+  }
+}
+
+static void and_(Parser *parser, bool canAssign) {
+  // Left operand is on the stack, if it is falsey it is the result
+  int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+
+  emitByte(parser, OP_POP);
+  parsePrecedence(parser, PREC_AND);
+
+  patchJump(parser, endJump);
+}
+
+static void or_(Parser *parser, bool canAssign) {
+  int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  int endJump = emitJump(parser, OP_JUMP);
+
+  patchJump(parser, elseJump);
+  emitByte(parser, OP_POP);
+
+  parsePrecedence(parser, PREC_OR);
+  patchJump(parser, endJump);
+}
+
+ParseRule rules[] = {
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
+    [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
+    [TOKEN_MINUS] = {unary, binary, PREC_TERM},
+    [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
+    [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_BANG] = {unary, NULL, PREC_NONE},
+    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
+    [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
+    [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
+    [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
+    [TOKEN_STRING] = {string, NULL, PREC_NONE},
+    [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
+    [TOKEN_AND] = {NULL, and_, PREC_AND},
+    [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
+    [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IF] = {NULL, NULL, PREC_NONE},
+    [TOKEN_NIL] = {literal, NULL, PREC_NONE},
+    [TOKEN_OR] = {NULL, or_, PREC_OR},
+    [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
+    [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
+    [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
+};
+
+// Pratt parser core: parse anything at precedence level or higher
+static void parsePrecedence(Parser *parser, Precedence precedence) {
+  advance(parser);
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
+  if (prefixRule == NULL) {
+    error(parser, "Expect expression.");
+    return;
+  }
+
+  // Only the lowest precedence expressions can be assignment targets
+  bool canAssign = precedence <= PREC_ASSIGNMENT;
+  prefixRule(parser, canAssign);
+
+  while (precedence <= getRule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infixRule = getRule(parser->previous.type)->infix;
+    infixRule(parser, canAssign);
+  }
+
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target.");
+  }
+}
+
+static ParseRule *getRule(TokenType type) { return &rules[type]; }
+
+static void expression(Parser *parser) {
+  parsePrecedence(parser, PREC_ASSIGNMENT);
+}
+
+static void block(Parser *parser) {
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(parser);
+  }
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+static void varDeclaration(Parser *parser) {
+  size_t global = parseVariable(parser, "Expect variable name.");
+
+  if (match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+  } else {
+    emitByte(parser, OP_NIL);
+  }
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+  defineVariable(parser, global);
+}
+
+// Compiles the parameters and body of a function, then emits the closure that
+// creates it at runtime
+static void function(Parser *parser, FunctionType type) {
+  Compiler compiler;
+  initCompiler(parser, &compiler, type);
+  beginScope(parser);
+
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
+    do {
+      compiler.function->arity++;
+      if (compiler.function->arity > 255) {
+        errorAtCurrent(parser, "Can't have more than 255 parameters.");
+      }
+      size_t constant = parseVariable(parser, "Expect parameter name.");
+      defineVariable(parser, constant);
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(parser);
+
+  // NOTE: no endScope, the frame and its locals go away with OP_RETURN
+  ObjFunction *function = endCompiler(parser);
+  emitConstantOp(parser, OP_CLOSURE, OP_CLOSURE_LONG,
+                 makeConstant(parser, OBJ_VAL(function)));
+  for (int i = 0; i < function->upvalueCount; i++) {
+    emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+    emitByte(parser, compiler.upvalues[i].index);
+  }
+}
+
+static void method(Parser *parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+  size_t name = identifierConstant(parser, &parser->previous);
+  FunctionType type = TYPE_METHOD;
+  if (parser->previous.lenght == 4 &&
+      memcmp(parser->previous.start, "init", 4) == 0) {
+    type = TYPE_INITIALIZER;
+  }
+  function(parser, type);
+  emitConstantOp(parser, OP_METHOD, OP_METHOD_LONG, name);
+}
+
+static void classDeclaration(Parser *parser) {
+  size_t global = parseVariable(parser, "Expect class name.");
+  Token className = parser->previous;
+  size_t name = identifierConstant(parser, &className);
+  emitConstantOp(parser, OP_CLASS, OP_CLASS_LONG, name);
+  defineVariable(parser, global);
+
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = parser->currentClass;
+  parser->currentClass = &classCompiler;
+
+  // The class goes back on the stack while OP_METHOD binds the methods to it
+  namedVariable(parser, className, false);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    method(parser);
+  }
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(parser, OP_POP);
+
+  parser->currentClass = classCompiler.enclosing;
+}
+
+static void funDeclaration(Parser *parser) {
+  size_t global = parseVariable(parser, "Expect function name.");
+  // A function can refer to itself, it is usable before its body is compiled
+  markInitialized(parser);
+  function(parser, TYPE_FUNCTION);
+  defineVariable(parser, global);
+}
+
+static void expressionStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emitByte(parser, OP_POP);
+}
+
+static void forStatement(Parser *parser) {
+  // The initializer variable is scoped to the loop
+  beginScope(parser);
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(parser, TOKEN_SEMICOLON)) {
+    // No initializer
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
+  } else {
+    expressionStatement(parser);
+  }
+
+  int loopStart = currentChunk(parser)->count;
+  int exitJump = -1;
+  if (!match(parser, TOKEN_SEMICOLON)) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+    exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+  }
+
+  // NOTE: single pass, the increment is compiled before the body so we jump
+  // over it, run the body, then loop back to it
+  if (!match(parser, TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(parser, OP_JUMP);
+    int incrementStart = currentChunk(parser)->count;
+    expression(parser);
+    emitByte(parser, OP_POP);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    emitLoop(parser, loopStart);
+    loopStart = incrementStart;
+    patchJump(parser, bodyJump);
+  }
+
+  statement(parser);
+  emitLoop(parser, loopStart);
+
+  if (exitJump != -1) {
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP); // Condition
+  }
+  endScope(parser);
+}
+
+static void ifStatement(Parser *parser) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
+
+  int elseJump = emitJump(parser, OP_JUMP);
+
+  patchJump(parser, thenJump);
+  emitByte(parser, OP_POP);
+
+  if (match(parser, TOKEN_ELSE))
+    statement(parser);
+  patchJump(parser, elseJump);
+}
+
+static void printStatement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(parser, OP_PRINT);
+}
+
+static void returnStatement(Parser *parser) {
+  if (parser->compiler->type == TYPE_SCRIPT) {
+    error(parser, "Can't return from top-level code.");
+  }
+  if (match(parser, TOKEN_SEMICOLON)) {
+    emitReturn(parser);
+    return;
+  }
+  if (parser->compiler->type == TYPE_INITIALIZER) {
+    error(parser, "Can't return a value from an initializer.");
+  }
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+  emitByte(parser, OP_RETURN);
+}
+
+static void whileStatement(Parser *parser) {
+  int loopStart = currentChunk(parser)->count;
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
+  emitLoop(parser, loopStart);
+
+  patchJump(parser, exitJump);
+  emitByte(parser, OP_POP);
+}
+
+// Skip tokens until something that looks like a statement boundary
+static void synchronize(Parser *parser) {
+  parser->panicMode = false;
+
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON)
+      return;
+    switch (parser->current.type) {
+    case TOKEN_CLASS:
+    case TOKEN_FUN:
+    case TOKEN_VAR:
+    case TOKEN_FOR:
+    case TOKEN_IF:
+    case TOKEN_WHILE:
+    case TOKEN_PRINT:
+    case TOKEN_RETURN:
+      return;
+    default:; // Do nothing
+    }
+    advance(parser);
+  }
+}
+
+static void declaration(Parser *parser) {
+  if (match(parser, TOKEN_CLASS)) {
+    classDeclaration(parser);
+  } else if (match(parser, TOKEN_FUN)) {
+    funDeclaration(parser);
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
+  } else {
+    statement(parser);
+  }
+
+  if (parser->panicMode)
+    synchronize(parser);
+}
+
+static void statement(Parser *parser) {
+  if (match(parser, TOKEN_PRINT)) {
+    printStatement(parser);
+  } else if (match(parser, TOKEN_FOR)) {
+    forStatement(parser);
+  } else if (match(parser, TOKEN_IF)) {
+    ifStatement(parser);
+  } else if (match(parser, TOKEN_RETURN)) {
+    returnStatement(parser);
+  } else if (match(parser, TOKEN_WHILE)) {
+    whileStatement(parser);
+  } else if (match(parser, TOKEN_LEFT_BRACE)) {
+    beginScope(parser);
+    block(parser);
+    endScope(parser);
+  } else {
+    expressionStatement(parser);
+  }
+}
+
+bool compile(VM *vm, const char *source, Chunk *chunk) {
+  Parser parser;
+  initScanner(&parser.scanner, source);
+  parser.hadError = false;
+  parser.panicMode = false;
+  parser.vm = vm;
+  parser.chunk = chunk;
+  parser.compiler = NULL;
+  parser.currentClass = NULL;
+  vm->parser = &parser;
+
+  Compiler compiler;
+  initCompiler(&parser, &compiler, TYPE_SCRIPT);
+
+  advance(&parser);
+  while (!match(&parser, TOKEN_EOF)) {
+    declaration(&parser);
+  }
+  endCompiler(&parser);
+  vm->parser = NULL;
+  return !parser.hadError;
+}
+
+void markCompilerRoots(VM *vm) {
+  Parser *parser = vm->parser;
+  if (parser == NULL)
+    return;
+  markArray(vm, &parser->chunk->constants);
+  for (Compiler *compiler = parser->compiler; compiler != NULL;
+       compiler = compiler->enclosing) {
+    markObject(vm, (Obj *)compiler->function);
   }
 }
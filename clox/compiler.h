@@ -3,6 +3,12 @@
 #ifndef clox_compiler_h
 #define clox_compiler_h
 
-void compile(Scanner* scanner, const char *source);
+#include "chunk.h"
+#include "object.h"
+
+// Compiles source straight into chunk, returns false on any syntax error
+bool compile(VM *vm, const char *source, Chunk *chunk);
+// Marks the constants of the chunk being compiled, see collectGarbage
+void markCompilerRoots(VM *vm);
 
 #endif
@@ -1,5 +1,6 @@
 #include "debug.h"
 #include "chunk.h"
+#include "object.h"
 #include "value.h"
 #include <stdint.h>
 #include <stdio.h>
@@ -18,12 +19,93 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int constantLongInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint32_t constant = (chunk->code[offset + 1] << 16) |
+                      (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int byteInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  printf("%-16s %4d\n", name, slot);
+  return offset + 2;
+}
+
+static int longInstruction(const char *name, Chunk *chunk, int offset) {
+  uint32_t slot = (chunk->code[offset + 1] << 16) |
+                  (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d\n", name, slot);
+  return offset + 4;
+}
+
+static int closureInstruction(const char *name, Chunk *chunk, int offset) {
+  bool isLong = chunk->code[offset] == OP_CLOSURE_LONG;
+  int end = offset + instructionLength(chunk, offset);
+  int constant = isLong ? (chunk->code[offset + 1] << 16) |
+                              (chunk->code[offset + 2] << 8) |
+                              chunk->code[offset + 3]
+                        : chunk->code[offset + 1];
+  printf("%-16s %4d ", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("\n");
+  // One (isLocal, index) pair per captured variable
+  for (offset += isLong ? 4 : 2; offset < end; offset += 2) {
+    printf("%04d    |                     %s %d\n", offset,
+           chunk->code[offset] ? "local" : "upvalue", chunk->code[offset + 1]);
+  }
+  return end;
+}
+
+// Name constant then the index of the instruction's inline cache
+static int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+  bool isLong = chunk->code[offset] == OP_GET_PROPERTY_LONG ||
+                chunk->code[offset] == OP_SET_PROPERTY_LONG;
+  int constant = isLong ? (chunk->code[offset + 1] << 16) |
+                              (chunk->code[offset + 2] << 8) |
+                              chunk->code[offset + 3]
+                        : chunk->code[offset + 1];
+  offset += isLong ? 4 : 2;
+  int cache = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 2;
+}
+
+static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
+  bool isLong = chunk->code[offset] == OP_INVOKE_LONG;
+  int constant = isLong ? (chunk->code[offset + 1] << 16) |
+                              (chunk->code[offset + 2] << 8) |
+                              chunk->code[offset + 3]
+                        : chunk->code[offset + 1];
+  offset += isLong ? 4 : 2;
+  uint8_t argCount = chunk->code[offset];
+  int cache = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 3;
+}
+
+static int jumpInstruction(const char *name, int sign, Chunk *chunk,
+                           int offset) {
+  uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+  jump |= chunk->code[offset + 2];
+  printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+  return offset + 3;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
@@ -41,6 +123,98 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_RETURN", offset);
   case OP_CONSTANT:
     return constantInstruction("OP_CONSTANT", chunk, offset);
+  case OP_NIL:
+    return simpleInstruction("OP_NIL", offset);
+  case OP_TRUE:
+    return simpleInstruction("OP_TRUE", offset);
+  case OP_FALSE:
+    return simpleInstruction("OP_FALSE", offset);
+  case OP_NOT:
+    return simpleInstruction("OP_NOT", offset);
+  case OP_EQUAL:
+    return simpleInstruction("OP_EQUAL", offset);
+  case OP_GREATER:
+    return simpleInstruction("OP_GREATER", offset);
+  case OP_LESS:
+    return simpleInstruction("OP_LESS", offset);
+  case OP_PRINT:
+    return simpleInstruction("OP_PRINT", offset);
+  case OP_POP:
+    return simpleInstruction("OP_POP", offset);
+  case OP_DEFINE_GLOBAL:
+    return byteInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+  case OP_GET_GLOBAL:
+    return byteInstruction("OP_GET_GLOBAL", chunk, offset);
+  case OP_SET_GLOBAL:
+    return byteInstruction("OP_SET_GLOBAL", chunk, offset);
+  case OP_GET_LOCAL:
+    return byteInstruction("OP_GET_LOCAL", chunk, offset);
+  case OP_SET_LOCAL:
+    return byteInstruction("OP_SET_LOCAL", chunk, offset);
+  case OP_JUMP:
+    return jumpInstruction("OP_JUMP", 1, chunk, offset);
+  case OP_JUMP_IF_FALSE:
+    return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_LOOP:
+    return jumpInstruction("OP_LOOP", -1, chunk, offset);
+  case OP_CALL:
+    return byteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
+  case OP_CLOSURE:
+    return closureInstruction("OP_CLOSURE", chunk, offset);
+  case OP_GET_UPVALUE:
+    return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+  case OP_SET_UPVALUE:
+    return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+  case OP_CLOSE_UPVALUE:
+    return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+  case OP_CLASS:
+    return constantInstruction("OP_CLASS", chunk, offset);
+  case OP_METHOD:
+    return constantInstruction("OP_METHOD", chunk, offset);
+  case OP_GET_PROPERTY:
+    return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+  case OP_SET_PROPERTY:
+    return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+  case OP_INVOKE:
+    return invokeInstruction("OP_INVOKE", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+  case OP_DEFINE_GLOBAL_LONG:
+    return longInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+  case OP_GET_GLOBAL_LONG:
+    return longInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+  case OP_SET_GLOBAL_LONG:
+    return longInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+  case OP_CLOSURE_LONG:
+    return closureInstruction("OP_CLOSURE_LONG", chunk, offset);
+  case OP_CLASS_LONG:
+    return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
+  case OP_METHOD_LONG:
+    return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
+  case OP_GET_PROPERTY_LONG:
+    return propertyInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
+  case OP_SET_PROPERTY_LONG:
+    return propertyInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
+  case OP_INVOKE_LONG:
+    return invokeInstruction("OP_INVOKE_LONG", chunk, offset);
+  case OP_ADD_NUM_NUM:
+    return simpleInstruction("OP_ADD_NUM_NUM", offset);
+  case OP_ADD_STR_STR:
+    return simpleInstruction("OP_ADD_STR_STR", offset);
+  case OP_SUBTRACT_NUM:
+    return simpleInstruction("OP_SUBTRACT_NUM", offset);
+  case OP_MULTIPLY_NUM:
+    return simpleInstruction("OP_MULTIPLY_NUM", offset);
+  case OP_DIVIDE_NUM:
+    return simpleInstruction("OP_DIVIDE_NUM", offset);
+  case OP_GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset);
+  case OP_LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset);
+  case OP_NEGATE_NUM:
+    return simpleInstruction("OP_NEGATE_NUM", offset);
   default:
     printf("Unkwon opcode %d\n", instruction);
     return offset + 1;
@@ -0,0 +1,1373 @@
+#include "jit.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Machine code of one function. Every instruction of its chunk has its own
+// stretch of code, so run() can hand a frame over at any instruction and the
+// code hands it back at any instruction
+struct JitCode {
+  uint8_t *code;     // executable mapping, starts with the entry stub
+  size_t size;
+  uint32_t *entries; // machine code offset of each instruction, by bytecode
+                     // offset
+};
+
+#ifdef JIT_AVAILABLE
+
+// Baseline template compiler. Each instruction is translated on its own into
+// a fixed template working on the VM stack exactly as run() does, nothing is
+// kept in registers across instructions. While the code runs:
+//   rbx  the VM
+//   r12  vm->stackTop, written back on the way out
+//   r13  frame->slots
+//   r14  frame->closure
+//   r15  QNAN, to test for numbers
+// Instructions without a template, and templates whose type guard fails,
+// leave with the ip of the instruction in rax and run() takes it from there.
+// NOTE: no template allocates or calls out, so a collection never runs while
+// machine code does and every object pointer it sees is current
+
+typedef uint8_t *(*JitEntry)(VM *vm, Value *slots, ObjClosure *closure,
+                             uint8_t *target);
+
+// A rel32 operand to fill in once every instruction has been placed
+typedef struct {
+  size_t at;
+  int target;  // bytecode offset
+  bool toExit; // the exit stub of the instruction rather than its code
+} Fixup;
+
+// A guard's jump out of a trace, filled in once the stubs are placed
+typedef struct {
+  size_t at;
+  uint8_t *ip; // where run() resumes
+  bool side;   // may grow a side trace
+} PendingExit;
+
+// Operands the trace compiler already knows to be numbers, their guards are
+// left out. Always 0 for baseline code
+#define KNOWN_TOP 1    // peek(0)
+#define KNOWN_SECOND 2 // peek(1)
+
+// NOTE: plain realloc like the bytecode writer, compiling runs from call()
+// and must not start a collection
+typedef struct {
+  uint8_t *code;
+  size_t count;
+  size_t capacity;
+  Fixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+  Chunk *chunk;
+  uint32_t *entries;
+  uint32_t *exits; // offset of the exit stub of each guarded instruction, or 0
+  size_t exitLabel;
+  bool tracing; // guards leave through pending, not exits
+  PendingExit *pending;
+  int exitCount;
+  int exitCapacity;
+  int known; // KNOWN_TOP and KNOWN_SECOND
+  bool failed;
+} Assembler;
+
+static void emitBytes(Assembler *as, const uint8_t *bytes, size_t count) {
+  if (as->count + count > as->capacity) {
+    size_t capacity = as->capacity < 256 ? 256 : as->capacity;
+    while (capacity < as->count + count)
+      capacity *= 2;
+    uint8_t *code = (uint8_t *)realloc(as->code, capacity);
+    if (code == NULL) {
+      as->failed = true;
+      return;
+    }
+    as->code = code;
+    as->capacity = capacity;
+  }
+  memcpy(as->code + as->count, bytes, count);
+  as->count += count;
+}
+
+#define EMIT(as, ...)                                                          \
+  emitBytes(as, (const uint8_t[]){__VA_ARGS__},                                \
+            sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(Assembler *as, uint32_t value) {
+  emitBytes(as, (const uint8_t *)&value, sizeof(value));
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  emitBytes(as, (const uint8_t *)&value, sizeof(value));
+}
+
+static void patch32(Assembler *as, size_t at, uint32_t value) {
+  if (!as->failed)
+    memcpy(as->code + at, &value, sizeof(value));
+}
+
+// Leaves room for a rel32 to the code or the exit stub of an instruction
+static void emitFixup(Assembler *as, int target, bool toExit) {
+  if (as->fixupCount == as->fixupCapacity) {
+    as->fixupCapacity = as->fixupCapacity < 16 ? 16 : as->fixupCapacity * 2;
+    Fixup *fixups =
+        (Fixup *)realloc(as->fixups, sizeof(Fixup) * as->fixupCapacity);
+    if (fixups == NULL) {
+      as->failed = true;
+      return;
+    }
+    as->fixups = fixups;
+  }
+  as->fixups[as->fixupCount++] = (Fixup){as->count, target, toExit};
+  emit32(as, 0);
+}
+
+// jmp, je and jne to the instruction at a bytecode offset
+static void jumpTo(Assembler *as, int target) {
+  EMIT(as, 0xe9);
+  emitFixup(as, target, false);
+}
+
+static void jumpIfEqualTo(Assembler *as, int target) {
+  EMIT(as, 0x0f, 0x84);
+  emitFixup(as, target, false);
+}
+
+// Conditional jump (0x0f condition rel32) out of a trace to a stub of its
+// own resuming run() at ip, see compileTrace. Only a side exit may grow a
+// side trace, the others are for the rare cases left to run()
+static void traceExit(Assembler *as, uint8_t condition, uint8_t *ip,
+                      bool side) {
+  if (as->exitCount == as->exitCapacity) {
+    as->exitCapacity = as->exitCapacity < 16 ? 16 : as->exitCapacity * 2;
+    PendingExit *pending = (PendingExit *)realloc(
+        as->pending, sizeof(PendingExit) * as->exitCapacity);
+    if (pending == NULL) {
+      as->failed = true;
+      return;
+    }
+    as->pending = pending;
+  }
+  EMIT(as, 0x0f, condition);
+  as->pending[as->exitCount++] = (PendingExit){as->count, ip, side};
+  emit32(as, 0);
+}
+
+// Conditional jump to where a failed guard of the instruction at ip hands it
+// back to run(): je is 0x84, jne 0x85. In baseline code that is the exit stub
+// of the instruction, in a trace a side exit
+static void exitIf(Assembler *as, uint8_t condition, uint8_t *ip) {
+  if (as->tracing) {
+    traceExit(as, condition, ip, true);
+    return;
+  }
+  int offset = (int)(ip - as->chunk->code);
+  EMIT(as, 0x0f, condition);
+  emitFixup(as, offset, true);
+  as->exits[offset] = 1;
+}
+
+// mov rax, the address of the instruction; jmp to the shared epilogue
+static void emitExit(Assembler *as, int offset) {
+  EMIT(as, 0x48, 0xb8);
+  emit64(as, (uint64_t)(uintptr_t)(as->chunk->code + offset));
+  EMIT(as, 0xe9);
+  emit32(as, (uint32_t)(as->exitLabel - (as->count + 4)));
+}
+
+static void movRax(Assembler *as, uint64_t value) {
+  EMIT(as, 0x48, 0xb8);
+  emit64(as, value);
+}
+
+static void movRcx(Assembler *as, uint64_t value) {
+  EMIT(as, 0x48, 0xb9);
+  emit64(as, value);
+}
+
+// mov rax/rcx, [r12 + disp]: a value near the top of the stack
+static void loadRax(Assembler *as, int8_t disp) {
+  EMIT(as, 0x49, 0x8b, 0x44, 0x24, (uint8_t)disp);
+}
+
+static void loadRcx(Assembler *as, int8_t disp) {
+  EMIT(as, 0x49, 0x8b, 0x4c, 0x24, (uint8_t)disp);
+}
+
+// mov [r12 + disp], rax
+static void storeRax(Assembler *as, int8_t disp) {
+  EMIT(as, 0x49, 0x89, 0x44, 0x24, (uint8_t)disp);
+}
+
+static void pushRax(Assembler *as) {
+  storeRax(as, 0);
+  EMIT(as, 0x49, 0x83, 0xc4, 0x08); // add r12, 8
+}
+
+static void dropOne(Assembler *as) {
+  EMIT(as, 0x49, 0x83, 0xec, 0x08); // sub r12, 8
+}
+
+// Leaves unless rax (or rcx) holds a number:
+// mov rdx, reg; and rdx, r15; cmp rdx, r15; je exit
+static void guardNumber(Assembler *as, bool inRcx, uint8_t *ip) {
+  EMIT(as, 0x48, 0x89, inRcx ? 0xca : 0xc2);
+  EMIT(as, 0x4c, 0x21, 0xfa);
+  EMIT(as, 0x4c, 0x39, 0xfa);
+  exitIf(as, 0x84, ip);
+}
+
+// Loads the two numbers on top of the stack into xmm0 (left) and xmm1
+static void loadNumbers(Assembler *as, uint8_t *ip) {
+  loadRax(as, -16);
+  loadRcx(as, -8);
+  if (!(as->known & KNOWN_SECOND))
+    guardNumber(as, false, ip);
+  if (!(as->known & KNOWN_TOP))
+    guardNumber(as, true, ip);
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc0); // movq xmm0, rax
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc9); // movq xmm1, rcx
+}
+
+// addsd, subsd, mulsd or divsd xmm0, xmm1, the result replaces both operands
+static void arithmetic(Assembler *as, uint8_t sseOp, uint8_t *ip) {
+  loadNumbers(as, ip);
+  EMIT(as, 0xf2, 0x0f, sseOp, 0xc1);
+  EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc0); // movq rax, xmm0
+  storeRax(as, -16);
+  dropOne(as);
+}
+
+// al holds 0 or 1, turns it into FALSE_VAL or TRUE_VAL in place of both
+// operands: movzx eax, al; mov rcx, FALSE_VAL; add rax, rcx
+static void storeBool(Assembler *as, int8_t disp) {
+  EMIT(as, 0x0f, 0xb6, 0xc0);
+  movRcx(as, FALSE_VAL);
+  EMIT(as, 0x48, 0x01, 0xc8);
+  storeRax(as, disp);
+}
+
+// NOTE: ucomisd sets CF for less and all of ZF, PF and CF when either side
+// is NaN, seta is false then, the same as the C comparison in run()
+static void comparison(Assembler *as, bool less, uint8_t *ip) {
+  loadNumbers(as, ip);
+  if (less) {
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc8); // ucomisd xmm1, xmm0
+  } else {
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc1); // ucomisd xmm0, xmm1
+  }
+  EMIT(as, 0x0f, 0x97, 0xc0); // seta al
+  storeBool(as, -16);
+  dropOne(as);
+}
+
+// Numbers only, anything else is compared by run()
+static void equal(Assembler *as, uint8_t *ip) {
+  loadNumbers(as, ip);
+  EMIT(as, 0x66, 0x0f, 0x2e, 0xc1); // ucomisd xmm0, xmm1
+  EMIT(as, 0x0f, 0x94, 0xc0);       // sete al
+  EMIT(as, 0x0f, 0x9b, 0xc1);       // setnp cl
+  EMIT(as, 0x20, 0xc8);             // and al, cl
+  storeBool(as, -16);
+  dropOne(as);
+}
+
+// cmp rax, rcx against nil and false, the falsey values
+static void compareRax(Assembler *as, uint64_t value) {
+  movRcx(as, value);
+  EMIT(as, 0x48, 0x39, 0xc8);
+}
+
+static void logicalNot(Assembler *as) {
+  loadRax(as, -8);
+  compareRax(as, NIL_VAL);
+  EMIT(as, 0x0f, 0x94, 0xc2); // sete dl
+  compareRax(as, FALSE_VAL);
+  EMIT(as, 0x0f, 0x94, 0xc0); // sete al
+  EMIT(as, 0x08, 0xd0);       // or al, dl
+  storeBool(as, -8);
+}
+
+static void negate(Assembler *as, uint8_t *ip) {
+  loadRax(as, -8);
+  if (!(as->known & KNOWN_TOP))
+    guardNumber(as, false, ip);
+  EMIT(as, 0x48, 0x0f, 0xba, 0xf8, 0x3f); // btc rax, 63
+  storeRax(as, -8);
+}
+
+static void constant(Assembler *as, Value *value) {
+  if (IS_OBJ(*value)) {
+    // NOTE: read from the constant table, a young string in it moves when it
+    // is promoted
+    movRax(as, (uint64_t)(uintptr_t)value);
+    EMIT(as, 0x48, 0x8b, 0x00); // mov rax, [rax]
+  } else {
+    movRax(as, *value);
+  }
+  pushRax(as);
+}
+
+static void getLocal(Assembler *as, int slot) {
+  EMIT(as, 0x49, 0x8b, 0x85); // mov rax, [r13 + disp32]
+  emit32(as, (uint32_t)(slot * sizeof(Value)));
+  pushRax(as);
+}
+
+static void setLocal(Assembler *as, int slot) {
+  loadRax(as, -8);
+  EMIT(as, 0x49, 0x89, 0x85); // mov [r13 + disp32], rax
+  emit32(as, (uint32_t)(slot * sizeof(Value)));
+}
+
+// The global array moves when globals are added, it is read through the VM
+static void getGlobal(Assembler *as, size_t slot, uint8_t *ip) {
+  EMIT(as, 0x48, 0x8b, 0x83); // mov rax, [rbx + disp32]
+  emit32(as, (uint32_t)(offsetof(VM, globalValues) +
+                        offsetof(ValueArray, values)));
+  EMIT(as, 0x48, 0x8b, 0x80); // mov rax, [rax + disp32]
+  emit32(as, (uint32_t)(slot * sizeof(Value)));
+  compareRax(as, UNDEFINED_VAL);
+  exitIf(as, 0x84, ip);
+  pushRax(as);
+}
+
+// Storing an object needs the write barrier, run() does those
+static void setGlobal(Assembler *as, size_t slot, uint8_t *ip) {
+  EMIT(as, 0x48, 0x8b, 0x93); // mov rdx, [rbx + disp32]
+  emit32(as, (uint32_t)(offsetof(VM, globalValues) +
+                        offsetof(ValueArray, values)));
+  EMIT(as, 0x48, 0x8b, 0x82); // mov rax, [rdx + disp32]
+  emit32(as, (uint32_t)(slot * sizeof(Value)));
+  compareRax(as, UNDEFINED_VAL);
+  exitIf(as, 0x84, ip);
+  loadRax(as, -8);
+  if (!(as->known & KNOWN_TOP)) {
+    EMIT(as, 0x48, 0x89, 0xc1); // mov rcx, rax
+    EMIT(as, 0x48, 0xbe);       // mov rsi, QNAN | SIGN_BIT
+    emit64(as, QNAN | SIGN_BIT);
+    EMIT(as, 0x48, 0x21, 0xf1); // and rcx, rsi
+    EMIT(as, 0x48, 0x39, 0xf1); // cmp rcx, rsi
+    exitIf(as, 0x84, ip);
+  }
+  EMIT(as, 0x48, 0x89, 0x82); // mov [rdx + disp32], rax
+  emit32(as, (uint32_t)(slot * sizeof(Value)));
+}
+
+static void getUpvalue(Assembler *as, int index) {
+  EMIT(as, 0x49, 0x8b, 0x86); // mov rax, [r14 + disp32]
+  emit32(as, (uint32_t)(offsetof(ObjClosure, upvalues) +
+                        index * sizeof(ObjUpvalue *)));
+  EMIT(as, 0x48, 0x8b, 0x80); // mov rax, [rax + disp32]
+  emit32(as, (uint32_t)offsetof(ObjUpvalue, location));
+  EMIT(as, 0x48, 0x8b, 0x00); // mov rax, [rax]
+  pushRax(as);
+}
+
+static void jumpIfFalse(Assembler *as, int target) {
+  loadRax(as, -8);
+  compareRax(as, NIL_VAL);
+  jumpIfEqualTo(as, target);
+  compareRax(as, FALSE_VAL);
+  jumpIfEqualTo(as, target);
+}
+
+// A pending collection is left to the safepoint of OP_LOOP in run()
+static void loop(Assembler *as, int target, uint8_t *ip) {
+  EMIT(as, 0x80, 0xbb); // cmp byte [rbx + disp32], 0
+  emit32(as, (uint32_t)offsetof(VM, gcRequested));
+  EMIT(as, 0x00);
+  exitIf(as, 0x85, ip);
+  jumpTo(as, target);
+}
+
+// The shared epilogue every exit jumps to: stores the stack top back,
+// restores the callee saved registers and returns rax
+static void epilogue(Assembler *as) {
+  as->exitLabel = as->count;
+  EMIT(as, 0x4c, 0x89, 0xa3); // mov [rbx + disp32], r12
+  emit32(as, (uint32_t)offsetof(VM, stackTop));
+  EMIT(as, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+}
+
+// Saves the callee saved registers it uses, loads the frame and jumps to the
+// target instruction, followed by the epilogue
+static void entryStub(Assembler *as) {
+  EMIT(as, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+  EMIT(as, 0x48, 0x89, 0xfb); // mov rbx, rdi
+  EMIT(as, 0x49, 0x89, 0xf5); // mov r13, rsi
+  EMIT(as, 0x49, 0x89, 0xd6); // mov r14, rdx
+  EMIT(as, 0x4c, 0x8b, 0xa3); // mov r12, [rbx + disp32]
+  emit32(as, (uint32_t)offsetof(VM, stackTop));
+  EMIT(as, 0x49, 0xbf); // mov r15, QNAN
+  emit64(as, QNAN);
+  EMIT(as, 0xff, 0xe1); // jmp rcx
+  epilogue(as);
+}
+
+static int readSlot(uint8_t *code, bool isLong) {
+  return isLong ? (code[1] << 16) | (code[2] << 8) | code[3] : code[1];
+}
+
+static void compileInstruction(Assembler *as, int offset) {
+  uint8_t *code = as->chunk->code + offset;
+#define JUMP() ((code[1] << 8) | code[2])
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+    constant(as, &as->chunk->constants
+                      .values[readSlot(code, code[0] == OP_CONSTANT_LONG)]);
+    break;
+  case OP_NIL:
+    movRax(as, NIL_VAL);
+    pushRax(as);
+    break;
+  case OP_TRUE:
+    movRax(as, TRUE_VAL);
+    pushRax(as);
+    break;
+  case OP_FALSE:
+    movRax(as, FALSE_VAL);
+    pushRax(as);
+    break;
+  case OP_POP:
+    dropOne(as);
+    break;
+  case OP_GET_LOCAL:
+    getLocal(as, code[1]);
+    break;
+  case OP_SET_LOCAL:
+    setLocal(as, code[1]);
+    break;
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+    getGlobal(as, readSlot(code, code[0] == OP_GET_GLOBAL_LONG), code);
+    break;
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+    setGlobal(as, readSlot(code, code[0] == OP_SET_GLOBAL_LONG), code);
+    break;
+  case OP_GET_UPVALUE:
+    getUpvalue(as, code[1]);
+    break;
+  // A quickened instruction compiles to the same template as its generic
+  // form, both keep their own guards
+  case OP_ADD:
+  case OP_ADD_NUM_NUM:
+    arithmetic(as, 0x58, code);
+    break;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+    arithmetic(as, 0x5c, code);
+    break;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+    arithmetic(as, 0x59, code);
+    break;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+    arithmetic(as, 0x5e, code);
+    break;
+  case OP_LESS:
+  case OP_LESS_NUM:
+    comparison(as, true, code);
+    break;
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    comparison(as, false, code);
+    break;
+  case OP_EQUAL:
+    equal(as, code);
+    break;
+  case OP_NOT:
+    logicalNot(as);
+    break;
+  case OP_NEGATE:
+  case OP_NEGATE_NUM:
+    negate(as, code);
+    break;
+  case OP_JUMP:
+    jumpTo(as, offset + 3 + JUMP());
+    break;
+  case OP_JUMP_IF_FALSE:
+    jumpIfFalse(as, offset + 3 + JUMP());
+    break;
+  case OP_LOOP:
+    loop(as, offset + 3 - JUMP(), code);
+    break;
+  default:
+    // Calls, returns, closures, classes and properties stay in run()
+    emitExit(as, offset);
+    break;
+  }
+#undef JUMP
+}
+
+// Copies the assembled code into a mapping of its own. Written while plain
+// data, executable once done, never both
+static uint8_t *mapCode(Assembler *as) {
+  uint8_t *code = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+    return NULL;
+  memcpy(code, as->code, as->count);
+  if (mprotect(code, as->count, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, as->count);
+    return NULL;
+  }
+  return code;
+}
+
+static void freeAssembler(Assembler *as) {
+  free(as->code);
+  free(as->fixups);
+  free(as->exits);
+  free(as->pending);
+}
+
+void jitCompile(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  Assembler as = {0};
+  as.chunk = chunk;
+  as.entries = (uint32_t *)calloc(chunk->count, sizeof(uint32_t));
+  as.exits = (uint32_t *)calloc(chunk->count, sizeof(uint32_t));
+  if (as.entries == NULL || as.exits == NULL)
+    goto failed;
+
+  entryStub(&as);
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    as.entries[offset] = (uint32_t)as.count;
+    compileInstruction(&as, offset);
+  }
+  // Exit stubs go after all the code, out of the way of the fast paths
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (as.exits[offset] != 0) {
+      as.exits[offset] = (uint32_t)as.count;
+      emitExit(&as, offset);
+    }
+  }
+  for (int i = 0; i < as.fixupCount; i++) {
+    Fixup *fixup = &as.fixups[i];
+    uint32_t target = fixup->toExit ? as.exits[fixup->target]
+                                    : as.entries[fixup->target];
+    patch32(&as, fixup->at, target - (uint32_t)(fixup->at + 4));
+  }
+  if (as.failed)
+    goto failed;
+
+  uint8_t *code = mapCode(&as);
+  if (code == NULL)
+    goto failed;
+  JitCode *jit = (JitCode *)malloc(sizeof(JitCode));
+  if (jit == NULL) {
+    munmap(code, as.count);
+    goto failed;
+  }
+  jit->code = code;
+  jit->size = as.count;
+  jit->entries = as.entries;
+  as.entries = NULL;
+  function->jit = jit;
+  freeAssembler(&as);
+  return;
+
+failed:
+  free(as.entries);
+  freeAssembler(&as);
+  function->hotness = 0;
+}
+
+uint8_t *jitRun(VM *vm, CallFrame *frame, uint8_t *ip) {
+  JitCode *jit = frame->closure->function->jit;
+  uint8_t *target = jit->code + jit->entries[ip - frame->chunk->code];
+  return ((JitEntry)(void *)jit->code)(vm, frame->slots, frame->closure,
+                                       target);
+}
+
+bool jitAvailable(void) { return true; }
+
+void freeJitCode(JitCode *jit) {
+  if (jit == NULL)
+    return;
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+}
+
+// Tracing compiler. A loop that keeps jumping back gets recorded: run() goes
+// on interpreting while traceRecord notes each instruction, the operand types
+// it saw, which way each branch went and which function each call reached.
+// The recorded path is then compiled, calls inlined, into one straight line
+// of the templates above that jumps back to its start. What the recording
+// saw becomes guards, and a failed guard leaves the trace through a stub that
+// resumes run() at the guarded instruction. A side exit taken often is
+// recorded from in turn, its stub is patched to jump to the side trace, which
+// ends by jumping back into the loop's root trace.
+// NOTE: traces work on the VM's own stack and frames, an inlined call fills
+// in its frame as call() does, so nothing needs rebuilding on the way out
+
+#define TRACE_EXIT_THRESHOLD 10 // side exits taken before recording from one
+#define TRACE_ATTEMPTS 3        // aborted recordings before giving up on one
+#define TRACE_MAX_OPS 1000
+#define TRACE_MAX_DEPTH 4       // frames a trace may call above its loop's
+#define TRACE_SLOTS 512         // stack slots of a frame with tracked types
+
+// One recorded instruction and what it found when it ran
+typedef struct {
+  uint8_t *ip;
+  uint8_t opcode;      // ip[0] when recorded, quickening may rewrite it
+  int height;          // slots in use in its frame before it ran
+  bool falsey;         // OP_JUMP_IF_FALSE: the condition, so it jumped
+  ObjFunction *callee; // OP_CALL: the function called
+  Value *constants;    // of the chunk it belongs to
+} TraceOp;
+
+typedef struct Trace Trace;
+
+struct TraceExit {
+  Trace *trace;
+  size_t stub; // offset of its stub in trace->code
+  uint8_t *ip;
+  uint32_t hits;
+  int attempts;
+  bool linked; // the stub jumps to a side trace
+};
+
+struct Trace {
+  Trace *next; // LoopTrace.traces
+  uint8_t *code;
+  size_t size;
+  size_t entry; // offset of the code of the first instruction
+  TraceExit *exits;
+  int exitCount;
+  ObjFunction **functions; // inlined, kept alive by markTraces
+  int functionCount;
+};
+
+// Back edge counter and traces of one OP_LOOP, in its chunk's list
+struct LoopTrace {
+  LoopTrace *next;
+  int offset; // of the OP_LOOP
+  uint32_t hotness;
+  int attempts;
+  Trace *root;   // starts at the loop header, NULL until recorded
+  Trace *traces; // the root and its side traces, freed with the chunk
+};
+
+struct Recorder {
+  LoopTrace *loop;
+  TraceExit *exit;  // the exit being extended, NULL for a root trace
+  uint8_t *anchor;  // the OP_LOOP that ends the trace
+  int anchorFrame;  // index of the frame running the loop
+  Obj *owner;       // function holding the loop, NULL for the script
+  TraceOp *ops;
+  int count;
+  int capacity;
+};
+
+// What the trace compiler knows of a stack slot of a frame
+typedef enum { TYPE_UNKNOWN, TYPE_NUMBER, TYPE_BOOL } SlotType;
+
+typedef struct {
+  uint8_t types[TRACE_SLOTS];
+  int16_t from[TRACE_SLOTS]; // local the slot was loaded from, or -1
+  int base; // slot of the caller the frame starts at, see OP_CALL
+} FrameTypes;
+
+typedef struct {
+  Assembler as;
+  FrameTypes frames[TRACE_MAX_DEPTH + 1]; // by depth from the first op's
+  int depth;
+} TraceCompiler;
+
+static void resetFrame(FrameTypes *frame) {
+  memset(frame->types, TYPE_UNKNOWN, sizeof(frame->types));
+  memset(frame->from, 0xff, sizeof(frame->from));
+}
+
+static SlotType slotType(TraceCompiler *tc, int slot) {
+  if (slot < 0 || slot >= TRACE_SLOTS)
+    return TYPE_UNKNOWN;
+  return (SlotType)tc->frames[tc->depth].types[slot];
+}
+
+// A value of type was written to slot, loaded from local or -1
+static void setSlot(TraceCompiler *tc, int slot, SlotType type, int local) {
+  if (slot < 0 || slot >= TRACE_SLOTS)
+    return;
+  tc->frames[tc->depth].types[slot] = (uint8_t)type;
+  tc->frames[tc->depth].from[slot] = (int16_t)local;
+}
+
+// The value in slot passed a number guard, so did the local it came from
+static void provenNumber(TraceCompiler *tc, int slot) {
+  if (slot < 0 || slot >= TRACE_SLOTS)
+    return;
+  FrameTypes *frame = &tc->frames[tc->depth];
+  frame->types[slot] = TYPE_NUMBER;
+  if (frame->from[slot] >= 0)
+    frame->types[frame->from[slot]] = TYPE_NUMBER;
+}
+
+// Sets KNOWN_TOP and KNOWN_SECOND for the count values on top of the stack,
+// which are numbers once the template's guards passed
+static void knownNumbers(TraceCompiler *tc, int height, int count) {
+  tc->as.known = 0;
+  if (slotType(tc, height - 1) == TYPE_NUMBER)
+    tc->as.known |= KNOWN_TOP;
+  if (count == 2 && slotType(tc, height - 2) == TYPE_NUMBER)
+    tc->as.known |= KNOWN_SECOND;
+  for (int i = 1; i <= count; i++)
+    provenNumber(tc, height - i);
+}
+
+static void patch8(Assembler *as, size_t at) {
+  if (!as->failed)
+    as->code[at - 1] = (uint8_t)(as->count - at);
+}
+
+// disp8 of a field of the frame rdx points to (0) or the one below it (-1)
+static uint8_t frameField(int frame, size_t offset) {
+  return (uint8_t)(int8_t)(frame * (int)sizeof(CallFrame) + (int)offset);
+}
+
+// rdx = &vm->frames[vm->frameCount]: mov ecx, [rbx + frameCount];
+// mov rdx, [rbx + frames]; imul rcx, rcx, sizeof(CallFrame); add rdx, rcx
+static void loadFrameTop(Assembler *as) {
+  EMIT(as, 0x8b, 0x8b);
+  emit32(as, (uint32_t)offsetof(VM, frameCount));
+  EMIT(as, 0x48, 0x8b, 0x93);
+  emit32(as, (uint32_t)offsetof(VM, frames));
+  EMIT(as, 0x48, 0x6b, 0xc9, (uint8_t)sizeof(CallFrame));
+  EMIT(as, 0x48, 0x01, 0xca);
+}
+
+// The recorded branch direction is guarded, the other one is an exit
+static void guardBranch(TraceCompiler *tc, TraceOp *op) {
+  Assembler *as = &tc->as;
+  uint8_t *fallthrough = op->ip + 3;
+  uint8_t *target = fallthrough + ((op->ip[1] << 8) | op->ip[2]);
+  loadRax(as, -8);
+  if (slotType(tc, op->height - 1) == TYPE_BOOL) {
+    compareRax(as, FALSE_VAL);
+    exitIf(as, op->falsey ? 0x85 : 0x84, op->falsey ? fallthrough : target);
+  } else if (op->falsey) {
+    compareRax(as, NIL_VAL);
+    EMIT(as, 0x74, 0x00); // je past the guard
+    size_t skip = as->count;
+    compareRax(as, FALSE_VAL);
+    exitIf(as, 0x85, fallthrough);
+    patch8(as, skip);
+  } else {
+    compareRax(as, NIL_VAL);
+    exitIf(as, 0x84, target);
+    compareRax(as, FALSE_VAL);
+    exitIf(as, 0x84, target);
+  }
+}
+
+// Checks the callee is a closure over the recorded function and that call()
+// would find room, then pushes its frame
+static void inlineCall(TraceCompiler *tc, TraceOp *op) {
+  Assembler *as = &tc->as;
+  ObjFunction *function = op->callee;
+  uint32_t calleeDisp = (uint32_t)(-(op->ip[1] + 1) * (int)sizeof(Value));
+  EMIT(as, 0x49, 0x8b, 0x84, 0x24); // mov rax, [r12 + disp32]
+  emit32(as, calleeDisp);
+  EMIT(as, 0x48, 0x89, 0xc1);       // mov rcx, rax
+  EMIT(as, 0x48, 0xbe);             // mov rsi, QNAN | SIGN_BIT
+  emit64(as, QNAN | SIGN_BIT);
+  EMIT(as, 0x48, 0x21, 0xf1);       // and rcx, rsi
+  EMIT(as, 0x48, 0x39, 0xf1);       // cmp rcx, rsi
+  exitIf(as, 0x85, op->ip);
+  EMIT(as, 0x48, 0xf7, 0xd6);       // not rsi
+  EMIT(as, 0x48, 0x21, 0xf0);       // and rax, rsi
+  EMIT(as, 0x83, 0x38, OBJ_CLOSURE); // cmp dword [rax], OBJ_CLOSURE
+  exitIf(as, 0x85, op->ip);
+  movRcx(as, (uint64_t)(uintptr_t)function);
+  EMIT(as, 0x48, 0x39, 0x88); // cmp [rax + disp32], rcx
+  emit32(as, (uint32_t)offsetof(ObjClosure, function));
+  exitIf(as, 0x85, op->ip);
+
+  EMIT(as, 0x8b, 0x8b); // mov ecx, [rbx + disp32]
+  emit32(as, (uint32_t)offsetof(VM, frameCount));
+  EMIT(as, 0x3b, 0x8b); // cmp ecx, [rbx + disp32]
+  emit32(as, (uint32_t)offsetof(VM, frameCapacity));
+  traceExit(as, 0x84, op->ip, false);
+  EMIT(as, 0x48, 0x8b, 0x93); // mov rdx, [rbx + disp32]
+  emit32(as, (uint32_t)offsetof(VM, stackLimit));
+  EMIT(as, 0x4c, 0x29, 0xe2); // sub rdx, r12
+  EMIT(as, 0x48, 0x81, 0xfa); // cmp rdx, imm32
+  emit32(as, (uint32_t)(STACK_HEADROOM * sizeof(Value)));
+  traceExit(as, 0x8c, op->ip, false); // jl
+
+  loadFrameTop(as);
+  EMIT(as, 0x48, 0xbe); // mov rsi, the return address of the caller
+  emit64(as, (uint64_t)(uintptr_t)(op->ip + 2));
+  EMIT(as, 0x48, 0x89, 0x72, frameField(-1, offsetof(CallFrame, ip)));
+  EMIT(as, 0x48, 0x89, 0x42, frameField(0, offsetof(CallFrame, closure)));
+  EMIT(as, 0x48, 0xbe);
+  emit64(as, (uint64_t)(uintptr_t)&function->chunk);
+  EMIT(as, 0x48, 0x89, 0x72, frameField(0, offsetof(CallFrame, chunk)));
+  EMIT(as, 0x48, 0xbe);
+  emit64(as, (uint64_t)(uintptr_t)function->chunk.code);
+  EMIT(as, 0x48, 0x89, 0x72, frameField(0, offsetof(CallFrame, ip)));
+  EMIT(as, 0x4d, 0x8d, 0xac, 0x24); // lea r13, [r12 + disp32]
+  emit32(as, calleeDisp);
+  EMIT(as, 0x4c, 0x89, 0x6a, frameField(0, offsetof(CallFrame, slots)));
+  EMIT(as, 0x49, 0x89, 0xc6); // mov r14, rax
+  EMIT(as, 0xff, 0x83);       // inc dword [rbx + disp32]
+  emit32(as, (uint32_t)offsetof(VM, frameCount));
+}
+
+// Upvalues still open into the frame are left to the OP_RETURN of run()
+static void inlineReturn(TraceCompiler *tc, TraceOp *op) {
+  Assembler *as = &tc->as;
+  EMIT(as, 0x48, 0x8b, 0x83); // mov rax, [rbx + disp32]
+  emit32(as, (uint32_t)offsetof(VM, openUpvalues));
+  EMIT(as, 0x48, 0x85, 0xc0); // test rax, rax
+  EMIT(as, 0x74, 0x00);       // jz past the guard
+  size_t skip = as->count;
+  EMIT(as, 0x4c, 0x39, 0x68, (uint8_t)offsetof(ObjUpvalue, location));
+  traceExit(as, 0x83, op->ip, false); // cmp [rax + disp8], r13; jae
+  patch8(as, skip);
+
+  loadRax(as, -8);
+  EMIT(as, 0x49, 0x89, 0x45, 0x00); // mov [r13], rax
+  EMIT(as, 0x4d, 0x8d, 0x65, 0x08); // lea r12, [r13 + 8]
+  EMIT(as, 0xff, 0x8b);             // dec dword [rbx + disp32]
+  emit32(as, (uint32_t)offsetof(VM, frameCount));
+  loadFrameTop(as);
+  EMIT(as, 0x4c, 0x8b, 0x6a, frameField(-1, offsetof(CallFrame, slots)));
+  EMIT(as, 0x4c, 0x8b, 0x72, frameField(-1, offsetof(CallFrame, closure)));
+}
+
+// A pending collection is left to the safepoint of OP_LOOP in run(), then
+// back to the loop header: the start of the root trace
+static void closeLoop(TraceCompiler *tc, TraceOp *op, Trace *root,
+                      size_t entry) {
+  Assembler *as = &tc->as;
+  EMIT(as, 0x80, 0xbb); // cmp byte [rbx + disp32], 0
+  emit32(as, (uint32_t)offsetof(VM, gcRequested));
+  EMIT(as, 0x00);
+  traceExit(as, 0x85, op->ip, false);
+  if (root == NULL) {
+    EMIT(as, 0xe9);
+    emit32(as, (uint32_t)(entry - (as->count + 4)));
+  } else {
+    movRax(as, (uint64_t)(uintptr_t)(root->code + root->entry));
+    EMIT(as, 0xff, 0xe0); // jmp rax
+  }
+}
+
+static void compileTraceOp(TraceCompiler *tc, TraceOp *op) {
+  Assembler *as = &tc->as;
+  uint8_t *code = op->ip;
+  int height = op->height;
+  as->known = 0;
+  switch (op->opcode) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG: {
+    Value *value = &op->constants[readSlot(code, op->opcode == OP_CONSTANT_LONG)];
+    constant(as, value);
+    setSlot(tc, height,
+            IS_NUMBER(*value) ? TYPE_NUMBER
+                              : IS_BOOL(*value) ? TYPE_BOOL : TYPE_UNKNOWN,
+            -1);
+    break;
+  }
+  case OP_NIL:
+    movRax(as, NIL_VAL);
+    pushRax(as);
+    setSlot(tc, height, TYPE_UNKNOWN, -1);
+    break;
+  case OP_TRUE:
+  case OP_FALSE:
+    movRax(as, op->opcode == OP_TRUE ? TRUE_VAL : FALSE_VAL);
+    pushRax(as);
+    setSlot(tc, height, TYPE_BOOL, -1);
+    break;
+  case OP_POP:
+    dropOne(as);
+    break;
+  case OP_GET_LOCAL:
+    getLocal(as, code[1]);
+    setSlot(tc, height, slotType(tc, code[1]), code[1]);
+    break;
+  case OP_SET_LOCAL: {
+    setLocal(as, code[1]);
+    FrameTypes *frame = &tc->frames[tc->depth];
+    for (int slot = 0; slot < height && slot < TRACE_SLOTS; slot++) {
+      if (frame->from[slot] == code[1])
+        frame->from[slot] = -1;
+    }
+    setSlot(tc, code[1], slotType(tc, height - 1), -1);
+    setSlot(tc, height - 1, slotType(tc, height - 1), code[1]);
+    break;
+  }
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+    getGlobal(as, readSlot(code, op->opcode == OP_GET_GLOBAL_LONG), code);
+    setSlot(tc, height, TYPE_UNKNOWN, -1);
+    break;
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+    if (slotType(tc, height - 1) != TYPE_UNKNOWN)
+      as->known = KNOWN_TOP; // not an object, no barrier needed
+    setGlobal(as, readSlot(code, op->opcode == OP_SET_GLOBAL_LONG), code);
+    break;
+  case OP_GET_UPVALUE:
+    getUpvalue(as, code[1]);
+    setSlot(tc, height, TYPE_UNKNOWN, -1);
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM_NUM:
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM: {
+    static const uint8_t sseOps[] = {
+        [OP_ADD] = 0x58,      [OP_ADD_NUM_NUM] = 0x58,
+        [OP_SUBTRACT] = 0x5c, [OP_SUBTRACT_NUM] = 0x5c,
+        [OP_MULTIPLY] = 0x59, [OP_MULTIPLY_NUM] = 0x59,
+        [OP_DIVIDE] = 0x5e,   [OP_DIVIDE_NUM] = 0x5e,
+    };
+    knownNumbers(tc, height, 2);
+    arithmetic(as, sseOps[op->opcode], code);
+    setSlot(tc, height - 2, TYPE_NUMBER, -1);
+    break;
+  }
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+    knownNumbers(tc, height, 2);
+    comparison(as, op->opcode == OP_LESS || op->opcode == OP_LESS_NUM, code);
+    setSlot(tc, height - 2, TYPE_BOOL, -1);
+    break;
+  case OP_EQUAL:
+    knownNumbers(tc, height, 2);
+    equal(as, code);
+    setSlot(tc, height - 2, TYPE_BOOL, -1);
+    break;
+  case OP_NOT:
+    logicalNot(as);
+    setSlot(tc, height - 1, TYPE_BOOL, -1);
+    break;
+  case OP_NEGATE:
+  case OP_NEGATE_NUM:
+    knownNumbers(tc, height, 1);
+    negate(as, code);
+    setSlot(tc, height - 1, TYPE_NUMBER, -1);
+    break;
+  case OP_JUMP:
+  case OP_LOOP:
+    break; // the trace just goes on where it landed
+  case OP_JUMP_IF_FALSE:
+    guardBranch(tc, op);
+    break;
+  case OP_CALL: {
+    inlineCall(tc, op);
+    // The callee's slots are the caller's callee and arguments
+    int base = height - code[1] - 1;
+    FrameTypes *callee = &tc->frames[tc->depth + 1];
+    resetFrame(callee);
+    callee->base = base;
+    for (int slot = 0; slot <= code[1]; slot++)
+      callee->types[slot] = (uint8_t)slotType(tc, base + slot);
+    tc->depth++;
+    break;
+  }
+  case OP_RETURN: {
+    inlineReturn(tc, op);
+    SlotType result = slotType(tc, height - 1);
+    if (tc->depth == 0) {
+      // A side trace that started in a callee knows nothing of the caller
+      resetFrame(&tc->frames[0]);
+    } else {
+      int base = tc->frames[tc->depth].base;
+      tc->depth--;
+      setSlot(tc, base, result, -1);
+    }
+    break;
+  }
+  }
+  as->known = 0;
+}
+
+static void freeTrace(Trace *trace) {
+  if (trace->code != NULL)
+    munmap(trace->code, trace->size);
+  free(trace->exits);
+  free(trace->functions);
+  free(trace);
+}
+
+static Trace *compileTrace(Recorder *rec) {
+  Trace *trace = (Trace *)calloc(1, sizeof(Trace));
+  TraceCompiler *tc = (TraceCompiler *)calloc(1, sizeof(TraceCompiler));
+  if (trace == NULL || tc == NULL)
+    goto failed;
+  Assembler *as = &tc->as;
+  as->tracing = true;
+  resetFrame(&tc->frames[0]);
+
+  Trace *root = rec->exit == NULL ? NULL : rec->loop->root;
+  // A side trace starts in the registers its parent left, it only needs the
+  // epilogue for its own exits
+  if (root == NULL)
+    entryStub(as);
+  else
+    epilogue(as);
+  trace->entry = as->count;
+  for (int i = 0; i < rec->count - 1; i++)
+    compileTraceOp(tc, &rec->ops[i]);
+  closeLoop(tc, &rec->ops[rec->count - 1], root, trace->entry);
+
+  // Exit stubs: mov rax, exit; mov [rbx + lastExit], rax; mov rax, ip;
+  // jmp epilogue. NOTE: a side exit's stub is later overwritten by the jump
+  // to its side trace, which fits in the first two instructions
+  int sideExits = 0;
+  for (int i = 0; i < as->exitCount; i++) {
+    if (as->pending[i].side)
+      sideExits++;
+  }
+  trace->exits = (TraceExit *)calloc(sideExits + 1, sizeof(TraceExit));
+  if (trace->exits == NULL)
+    goto failed;
+  for (int i = 0; i < as->exitCount; i++) {
+    PendingExit *pending = &as->pending[i];
+    patch32(as, pending->at, (uint32_t)(as->count - (pending->at + 4)));
+    if (pending->side) {
+      TraceExit *exit = &trace->exits[trace->exitCount++];
+      *exit = (TraceExit){trace, as->count, pending->ip, 0, 0, false};
+      movRax(as, (uint64_t)(uintptr_t)exit);
+      EMIT(as, 0x48, 0x89, 0x83); // mov [rbx + disp32], rax
+      emit32(as, (uint32_t)offsetof(VM, lastExit));
+    }
+    movRax(as, (uint64_t)(uintptr_t)pending->ip);
+    EMIT(as, 0xe9);
+    emit32(as, (uint32_t)(as->exitLabel - (as->count + 4)));
+  }
+
+  trace->functions =
+      (ObjFunction **)malloc(sizeof(ObjFunction *) * rec->count);
+  if (trace->functions == NULL)
+    goto failed;
+  for (int i = 0; i < rec->count; i++) {
+    if (rec->ops[i].callee != NULL)
+      trace->functions[trace->functionCount++] = rec->ops[i].callee;
+  }
+  if (as->failed)
+    goto failed;
+  trace->code = mapCode(as);
+  if (trace->code == NULL)
+    goto failed;
+  trace->size = as->count;
+  freeAssembler(as);
+  free(tc);
+  return trace;
+
+failed:
+  if (tc != NULL)
+    freeAssembler(&tc->as);
+  free(tc);
+  if (trace != NULL)
+    freeTrace(trace);
+  return NULL;
+}
+
+// Points the stub of from at the side trace: mov rax, entry; jmp rax
+static bool linkExit(TraceExit *from, Trace *side) {
+  Trace *parent = from->trace;
+  if (mprotect(parent->code, parent->size, PROT_READ | PROT_WRITE) != 0)
+    return false;
+  uint8_t *stub = parent->code + from->stub;
+  uint64_t entry = (uint64_t)(uintptr_t)(side->code + side->entry);
+  stub[0] = 0x48;
+  stub[1] = 0xb8;
+  memcpy(stub + 2, &entry, sizeof(entry));
+  stub[10] = 0xff;
+  stub[11] = 0xe0;
+  // NOTE: the trace can't be left writable, nor half patched
+  if (mprotect(parent->code, parent->size, PROT_READ | PROT_EXEC) != 0)
+    exit(1);
+  from->linked = true;
+  return true;
+}
+
+static void freeRecorder(Recorder *rec) {
+  free(rec->ops);
+  free(rec);
+}
+
+void abortRecording(VM *vm) {
+  Recorder *rec = vm->recorder;
+  if (rec == NULL)
+    return;
+  vm->recorder = NULL;
+  vm->traceStats.aborted++;
+  if (rec->exit != NULL)
+    rec->exit->attempts++;
+  else
+    rec->loop->attempts++;
+  freeRecorder(rec);
+}
+
+static void finishRecording(VM *vm) {
+  Recorder *rec = vm->recorder;
+  Trace *trace = compileTrace(rec);
+  if (trace != NULL && rec->exit != NULL && !linkExit(rec->exit, trace)) {
+    freeTrace(trace);
+    trace = NULL;
+  }
+  if (trace == NULL) {
+    abortRecording(vm);
+    return;
+  }
+  vm->recorder = NULL;
+  LoopTrace *loop = rec->loop;
+  trace->next = loop->traces;
+  loop->traces = trace;
+  for (int i = 0; i < trace->functionCount; i++)
+    writeBarrier(vm, rec->owner, OBJ_VAL(trace->functions[i]));
+  if (rec->exit == NULL) {
+    loop->root = trace;
+    vm->traceStats.rootTraces++;
+  } else {
+    vm->traceStats.sideTraces++;
+  }
+  freeRecorder(rec);
+}
+
+static bool appendOp(Recorder *rec, TraceOp op) {
+  if (rec->count == rec->capacity) {
+    int capacity = rec->capacity < 64 ? 64 : rec->capacity * 2;
+    TraceOp *ops = (TraceOp *)realloc(rec->ops, sizeof(TraceOp) * capacity);
+    if (ops == NULL)
+      return false;
+    rec->ops = ops;
+    rec->capacity = capacity;
+  }
+  rec->ops[rec->count++] = op;
+  return true;
+}
+
+static bool falsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+bool traceRecord(VM *vm, CallFrame *frame, uint8_t *ip) {
+  Recorder *rec = vm->recorder;
+  int depth = (int)(frame - vm->frames) - rec->anchorFrame;
+  Value *top = vm->stackTop;
+  TraceOp op = {ip, ip[0], (int)(top - frame->slots), false, NULL,
+                frame->chunk->constants.values};
+  if (depth < 0 || rec->count == TRACE_MAX_OPS)
+    goto giveUp;
+  switch (ip[0]) {
+  case OP_LOOP:
+    if (ip == rec->anchor && depth == 0) {
+      if (!appendOp(rec, op))
+        goto giveUp;
+      finishRecording(vm);
+      return false;
+    }
+    // Another back edge once per iteration is part of the loop, like the two
+    // of a for loop. Taken twice it is an inner loop, not traced
+    for (int i = 0; i < rec->count; i++) {
+      if (rec->ops[i].ip == ip)
+        goto giveUp;
+    }
+    break;
+  case OP_ADD:
+  case OP_ADD_NUM_NUM:
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUM:
+  case OP_LESS:
+  case OP_LESS_NUM:
+  case OP_GREATER:
+  case OP_GREATER_NUM:
+  case OP_EQUAL:
+    if (!IS_NUMBER(top[-1]) || !IS_NUMBER(top[-2]))
+      goto giveUp;
+    break;
+  case OP_NEGATE:
+  case OP_NEGATE_NUM:
+    if (!IS_NUMBER(top[-1]))
+      goto giveUp;
+    break;
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+    if (IS_OBJ(top[-1]))
+      goto giveUp; // needs the write barrier
+    break;
+  case OP_JUMP_IF_FALSE:
+    op.falsey = falsey(top[-1]);
+    break;
+  case OP_CALL: {
+    Value callee = top[-1 - ip[1]];
+    if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function->arity != ip[1] ||
+        depth == TRACE_MAX_DEPTH)
+      goto giveUp;
+    op.callee = AS_CLOSURE(callee)->function;
+    break;
+  }
+  case OP_RETURN:
+    if (depth == 0)
+      goto giveUp; // leaves the loop
+    break;
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_POP:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+  case OP_GET_UPVALUE:
+  case OP_NOT:
+  case OP_JUMP:
+    break;
+  default:
+    goto giveUp; // strings, objects, upvalue stores and closures
+  }
+  if (!appendOp(rec, op))
+    goto giveUp;
+  return true;
+
+giveUp:
+  abortRecording(vm);
+  return false;
+}
+
+static LoopTrace *findLoop(Chunk *chunk, int offset) {
+  for (LoopTrace *loop = chunk->loopTraces; loop != NULL; loop = loop->next) {
+    if (loop->offset == offset)
+      return loop;
+  }
+  LoopTrace *loop = (LoopTrace *)calloc(1, sizeof(LoopTrace));
+  if (loop == NULL)
+    return NULL;
+  loop->offset = offset;
+  loop->next = chunk->loopTraces;
+  chunk->loopTraces = loop;
+  return loop;
+}
+
+static void startRecording(VM *vm, LoopTrace *loop, TraceExit *exit,
+                           int anchorFrame) {
+  Recorder *rec = (Recorder *)calloc(1, sizeof(Recorder));
+  if (rec == NULL)
+    return;
+  CallFrame *anchor = &vm->frames[anchorFrame];
+  rec->loop = loop;
+  rec->exit = exit;
+  rec->anchor = anchor->chunk->code + loop->offset;
+  rec->anchorFrame = anchorFrame;
+  rec->owner =
+      anchor->closure == NULL ? NULL : (Obj *)anchor->closure->function;
+  vm->recorder = rec;
+}
+
+uint8_t *traceLoop(VM *vm, CallFrame *frame, uint8_t *loop, uint8_t *ip) {
+  LoopTrace *trace = findLoop(frame->chunk, (int)(loop - frame->chunk->code));
+  if (trace == NULL)
+    return ip;
+  int anchorFrame = (int)(frame - vm->frames);
+  Trace *root = trace->root;
+  if (root == NULL) {
+    if (trace->attempts < TRACE_ATTEMPTS &&
+        ++trace->hotness >= vm->traceThreshold) {
+      trace->hotness = 0;
+      startRecording(vm, trace, NULL, anchorFrame);
+    }
+    return ip;
+  }
+
+  vm->lastExit = NULL;
+  ip = ((JitEntry)(void *)root->code)(vm, frame->slots, frame->closure,
+                                      root->code + root->entry);
+  TraceExit *exit = vm->lastExit;
+  if (exit != NULL) {
+    vm->traceStats.sideExits++;
+    if (!exit->linked && exit->attempts < TRACE_ATTEMPTS &&
+        ++exit->hits >= TRACE_EXIT_THRESHOLD) {
+      exit->hits = 0;
+      startRecording(vm, trace, exit, anchorFrame);
+    }
+  }
+  return ip;
+}
+
+void markTraces(VM *vm, LoopTrace *loops) {
+  for (LoopTrace *loop = loops; loop != NULL; loop = loop->next) {
+    for (Trace *trace = loop->traces; trace != NULL; trace = trace->next) {
+      for (int i = 0; i < trace->functionCount; i++)
+        markObject(vm, (Obj *)trace->functions[i]);
+    }
+  }
+}
+
+void markRecorder(VM *vm) {
+  Recorder *rec = vm->recorder;
+  if (rec == NULL)
+    return;
+  markObject(vm, rec->owner);
+  for (int i = 0; i < rec->count; i++)
+    markObject(vm, (Obj *)rec->ops[i].callee);
+}
+
+void freeLoopTraces(LoopTrace *loops) {
+  while (loops != NULL) {
+    LoopTrace *next = loops->next;
+    while (loops->traces != NULL) {
+      Trace *trace = loops->traces;
+      loops->traces = trace->next;
+      freeTrace(trace);
+    }
+    free(loops);
+    loops = next;
+  }
+}
+
+#else
+
+
+bool jitAvailable(void) { return false; }
+
+void jitCompile(ObjFunction *function) { function->hotness = 0; }
+
+uint8_t *jitRun(VM *vm, CallFrame *frame, uint8_t *ip) { return ip; }
+
+void freeJitCode(JitCode *jit) {}
+
+uint8_t *traceLoop(VM *vm, CallFrame *frame, uint8_t *loop, uint8_t *ip) {
+  return ip;
+}
+
+bool traceRecord(VM *vm, CallFrame *frame, uint8_t *ip) { return false; }
+
+void abortRecording(VM *vm) {}
+
+void markTraces(VM *vm, LoopTrace *loops) {}
+
+void markRecorder(VM *vm) {}
+
+void freeLoopTraces(LoopTrace *loops) {}
+
+#endif
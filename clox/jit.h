@@ -0,0 +1,51 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// The machine code templates are x86-64 and treat every value as a NaN boxed
+// 64 bit word, other builds run everything in the interpreter
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+#define JIT_AVAILABLE
+#endif
+
+// Calls plus loop back edges after which a function is compiled, see
+// --jit-threshold
+#define JIT_THRESHOLD 1000
+
+// Back edges of a loop after which its hot path is recorded, see
+// --tracing-threshold
+#define TRACE_THRESHOLD 50
+
+typedef struct JitCode JitCode;
+typedef struct LoopTrace LoopTrace;
+typedef struct Recorder Recorder;
+typedef struct TraceExit TraceExit;
+
+bool jitAvailable(void);
+// Compiles the function to machine code, on failure it stays interpreted and
+// counts up to the threshold again
+void jitCompile(ObjFunction *function);
+// Runs the machine code of the frame's function from ip, an instruction
+// boundary, and returns the ip of the first instruction left to run()
+uint8_t *jitRun(VM *vm, CallFrame *frame, uint8_t *ip);
+void freeJitCode(JitCode *code);
+
+// Tracing JIT. OP_LOOP calls traceLoop once it has jumped back to the loop
+// header ip, loop being the OP_LOOP itself. It runs the loop's trace if there
+// is one and returns the ip run() goes on from, otherwise it counts the back
+// edge and may start recording into vm->recorder
+uint8_t *traceLoop(VM *vm, CallFrame *frame, uint8_t *loop, uint8_t *ip);
+// Called by run() before each instruction while vm->recorder is set, returns
+// false once the recording is over, compiled or aborted
+bool traceRecord(VM *vm, CallFrame *frame, uint8_t *ip);
+void abortRecording(VM *vm);
+// Functions inlined into the traces of a chunk, or into the recording, are
+// kept alive by them
+void markTraces(VM *vm, LoopTrace *loops);
+void markRecorder(VM *vm);
+void freeLoopTraces(LoopTrace *loops);
+
+#endif
@@ -1,5 +1,12 @@
+#include "aot.h"
+#include "bytecode.h"
+#include "cache.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "memory.h"
+#include "table.h"
 #include "vm.h"
 #include "chunk.h"
 #include <stdio.h>
@@ -34,11 +41,7 @@ static char* readFile(const char* path){
   return buffer;
 }
 
-static void runfile(const char *path, VM *vm) {
-  char* source = readFile(path);
-  InterpretResult result = interpret(vm, source);
-  free(source);
-
+static void exitOnError(InterpretResult result) {
   if (result == INTERPRET_COMPILE_ERROR) {
     exit(65); // Compilation error
   } else if (result == INTERPRET_RUNTIME_ERROR) {
@@ -46,6 +49,65 @@ static void runfile(const char *path, VM *vm) {
   }
 }
 
+// Runs a .loxc file produced by --compile, the code is executed straight
+// from the mapping without going through the scanner and compiler
+static void runBytecode(const char *path, VM *vm) {
+  MappedFile file;
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!loadBytecode(vm, path, &file, &chunk)) {
+    fprintf(stderr, "Could not load bytecode file %s.\n", path);
+    exit(74);
+  }
+  InterpretResult result = interpretChunk(vm, &chunk);
+  freeChunk(&chunk);
+  unmapBytecode(&file);
+  exitOnError(result);
+}
+
+static void runfile(const char *path, VM *vm, bool useCache) {
+  if (isBytecodeFile(path)) {
+    runBytecode(path, vm);
+    return;
+  }
+  char* source = readFile(path);
+  InterpretResult result =
+      useCache ? interpretCached(vm, source) : interpret(vm, source);
+  free(source);
+  exitOnError(result);
+}
+
+static void compileFile(const char *path, const char *output, VM *vm) {
+  char *source = readFile(path);
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!compile(vm, source, &chunk)) {
+    exit(65);
+  }
+  if (!saveBytecode(vm, &chunk, output)) {
+    fprintf(stderr, "Could not write bytecode file %s.\n", output);
+    exit(74);
+  }
+  freeChunk(&chunk);
+  free(source);
+}
+
+// Writes the script translated to C to stdout, see aot.h
+static void emitCFile(const char *path, VM *vm) {
+  char *source = readFile(path);
+  Chunk chunk;
+  initChunk(&chunk);
+  if (!compile(vm, source, &chunk)) {
+    exit(65);
+  }
+  if (!emitC(vm, &chunk, path, stdout)) {
+    fprintf(stderr, "Could not write the C program for %s.\n", path);
+    exit(74);
+  }
+  freeChunk(&chunk);
+  free(source);
+}
+
 static void repl(VM *vm) {
   char line[1024];
   for (;;){
@@ -65,18 +127,219 @@ static void repl(VM *vm) {
   }
 }
 
+// Occupancy of the intern table, to size it for large scripts
+static void printStringStats(VM *vm) {
+  TableStats stats;
+  tableStats(&vm->strings, &stats);
+  fprintf(stderr,
+          "strings: %zu interned, %zu tombstones, capacity %zu, load %.2f\n",
+          stats.live, stats.tombstones, stats.capacity, stats.loadFactor);
+  fprintf(stderr, "strings: probe length mean %.2f, max %zu\n",
+          stats.meanProbe, stats.maxProbe);
+}
+
+static double percent(size_t part, size_t whole) {
+  return whole > 0 ? 100.0 * part / whole : 0;
+}
+
+// Hit rates of the property inline caches, a low one points at sites that see
+// instances of many shapes
+static void printICStats(VM *vm) {
+  ICStats *stats = &vm->icStats;
+  size_t gets = stats->getHits + stats->getMisses;
+  size_t sets = stats->setHits + stats->setMisses;
+  fprintf(stderr, "ic: get %zu hits, %zu misses, %.1f%% hit rate\n",
+          stats->getHits, stats->getMisses, percent(stats->getHits, gets));
+  fprintf(stderr, "ic: set %zu hits, %zu misses, %.1f%% hit rate\n",
+          stats->setHits, stats->setMisses, percent(stats->setHits, sets));
+  size_t invokes = stats->invokeHits + stats->invokeMisses +
+                   stats->megamorphicHits + stats->megamorphicMisses;
+  fprintf(stderr,
+          "ic: invoke %zu hits, %zu misses, %.1f%% hit rate\n",
+          stats->invokeHits, stats->invokeMisses,
+          percent(stats->invokeHits, invokes));
+  fprintf(stderr,
+          "ic: invoke megamorphic %zu hits, %zu misses\n",
+          stats->megamorphicHits, stats->megamorphicMisses);
+}
+
+// How many sites each quickened form took over and gave back, see QUICKEN
+static void printQuickenStats(VM *vm) {
+  static const struct {
+    OpCode op;
+    const char *name;
+  } forms[] = {
+      {OP_ADD_NUM_NUM, "OP_ADD_NUM_NUM"},   {OP_ADD_STR_STR, "OP_ADD_STR_STR"},
+      {OP_SUBTRACT_NUM, "OP_SUBTRACT_NUM"}, {OP_MULTIPLY_NUM, "OP_MULTIPLY_NUM"},
+      {OP_DIVIDE_NUM, "OP_DIVIDE_NUM"},     {OP_GREATER_NUM, "OP_GREATER_NUM"},
+      {OP_LESS_NUM, "OP_LESS_NUM"},         {OP_NEGATE_NUM, "OP_NEGATE_NUM"},
+  };
+  QuickenStats *stats = &vm->quickenStats;
+  for (size_t i = 0; i < sizeof(forms) / sizeof(forms[0]); i++) {
+    fprintf(stderr, "quicken: %-16s %zu specialized, %zu despecialized\n",
+            forms[i].name, stats->quickened[forms[i].op],
+            stats->despecialized[forms[i].op]);
+  }
+}
+
+// Traces the tracing JIT compiled and how often they were left early
+static void printTraceStats(VM *vm) {
+  TraceStats *stats = &vm->traceStats;
+  fprintf(stderr, "jit: %zu root traces, %zu side traces, %zu aborted\n",
+          stats->rootTraces, stats->sideTraces, stats->aborted);
+  fprintf(stderr, "jit: %zu side exits\n", stats->sideExits);
+}
+
+static void printVMStats(VM *vm) {
+  fprintf(stderr, "vm: %zu stack instructions, %zu register instructions\n",
+          vm->vmStats.stackInstructions, vm->vmStats.registerInstructions);
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: clox [--trace] [--no-cache] [--gc-stats] [--string-stats]\n"
+                  "            [--ic-stats] [--quicken-stats] [--no-tail-calls]\n"
+                  "            [--no-quicken] [--jit] [--jit-threshold=N]\n"
+                  "            [--tracing-jit] [--tracing-threshold=N] [--jit-stats]\n"
+                  "            [--register-vm] [--vm-stats]\n"
+                  "            [--gc=mark-sweep|generational|incremental]\n"
+                  "            [--gc-pause-us=N] [path]\n"
+                  "       clox --compile path [-o output.loxc]\n"
+                  "       clox --emit-c path > program.c\n");
+  exit(64);
+}
+
 int main(int argc, const char *argv[]) {
   VM vm;
   initVM(&vm);
 
-  if (argc == 1) {
+  const char *path = NULL;
+  const char *output = NULL;
+  bool compileOnly = false;
+  bool emitSource = false;
+  bool useCache = true;
+  bool gcStats = false;
+  bool stringStats = false;
+  bool icStats = false;
+  bool quickenStats = false;
+  bool traceStats = false;
+  bool vmStats = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--trace") == 0) {
+      vm.trace = true;
+    } else if (strcmp(argv[i], "--no-cache") == 0) {
+      useCache = false;
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      gcStats = true;
+    } else if (strcmp(argv[i], "--string-stats") == 0) {
+      stringStats = true;
+    } else if (strcmp(argv[i], "--ic-stats") == 0) {
+      icStats = true;
+    } else if (strcmp(argv[i], "--quicken-stats") == 0) {
+      quickenStats = true;
+    } else if (strcmp(argv[i], "--no-quicken") == 0) {
+      vm.quicken = false;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      vm.jit = true;
+    } else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+      char *end;
+      long threshold = strtol(argv[i] + 16, &end, 10);
+      if (*end != '\0' || threshold <= 0)
+        usage();
+      vm.jit = true;
+      vm.jitThreshold = (uint32_t)threshold;
+    } else if (strcmp(argv[i], "--tracing-jit") == 0) {
+      vm.tracing = true;
+    } else if (strncmp(argv[i], "--tracing-threshold=", 20) == 0) {
+      char *end;
+      long threshold = strtol(argv[i] + 20, &end, 10);
+      if (*end != '\0' || threshold <= 0)
+        usage();
+      vm.tracing = true;
+      vm.traceThreshold = (uint32_t)threshold;
+    } else if (strcmp(argv[i], "--jit-stats") == 0) {
+      traceStats = true;
+    } else if (strcmp(argv[i], "--register-vm") == 0) {
+      vm.registers = true;
+    } else if (strcmp(argv[i], "--vm-stats") == 0) {
+      vmStats = true;
+      vm.countInstructions = true;
+    } else if (strcmp(argv[i], "--no-tail-calls") == 0) {
+      vm.tailCalls = false;
+    } else if (strcmp(argv[i], "--gc=generational") == 0) {
+      setGCMode(&vm, GC_GENERATIONAL);
+    } else if (strcmp(argv[i], "--gc=incremental") == 0) {
+      setGCMode(&vm, GC_INCREMENTAL);
+    } else if (strncmp(argv[i], "--gc-pause-us=", 14) == 0) {
+      char *end;
+      long pause = strtol(argv[i] + 14, &end, 10);
+      if (*end != '\0' || pause <= 0)
+        usage();
+      setGCMode(&vm, GC_INCREMENTAL);
+      setGCPause(&vm, (uint64_t)pause);
+    } else if (strcmp(argv[i], "--gc=mark-sweep") == 0) {
+      setGCMode(&vm, GC_MARK_SWEEP);
+    } else if (strcmp(argv[i], "--compile") == 0) {
+      compileOnly = true;
+    } else if (strcmp(argv[i], "--emit-c") == 0) {
+      emitSource = true;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage();
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if ((vm.jit || vm.tracing) && !jitAvailable()) {
+    fprintf(stderr, "The JIT needs x86-64 Linux and a NaN boxing build.\n");
+    exit(64);
+  }
+  // NOTE: machine code runs whole stretches of a function without going
+  // through run(), those instructions would be missing from the trace
+  if (vm.trace && (vm.jit || vm.tracing)) {
+    fprintf(stderr, "--trace runs without the JITs.\n");
+    exit(64);
+  }
+  if (vm.registers && (vm.jit || vm.tracing || vm.trace)) {
+    fprintf(stderr, "The register VM runs without --trace and the JITs.\n");
+    exit(64);
+  }
+
+  if (compileOnly) {
+    if (path == NULL)
+      usage();
+    char defaultOutput[4096];
+    if (output == NULL) {
+      // foo.lox -> foo.loxc
+      snprintf(defaultOutput, sizeof(defaultOutput), "%s%s", path,
+               strlen(path) > 4 && strcmp(path + strlen(path) - 4, ".lox") == 0
+                   ? "c"
+                   : ".loxc");
+      output = defaultOutput;
+    }
+    compileFile(path, output, &vm);
+  } else if (emitSource) {
+    if (path == NULL)
+      usage();
+    emitCFile(path, &vm);
+  } else if (path == NULL) {
     repl(&vm);
-  } else if (argc == 2) {
-    runfile(argv[1], &vm);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    runfile(path, &vm, useCache);
   }
+  if (gcStats)
+    printGCStats(&vm);
+  if (stringStats)
+    printStringStats(&vm);
+  if (icStats)
+    printICStats(&vm);
+  if (quickenStats)
+    printQuickenStats(&vm);
+  if (traceStats)
+    printTraceStats(&vm);
+  if (vmStats)
+    printVMStats(&vm);
   freeVM(&vm);
   return 0;
 }
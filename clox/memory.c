@@ -1,7 +1,75 @@
 #include "memory.h"
+#include "compiler.h"
+#include "jit.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_STEP_BYTES (16 * 1024)
+#define GC_DEFAULT_PAUSE_US 500
+#define NURSERY_SIZE (256 * 1024)
+// Bigger objects skip the nursery, copying them on promotion costs more than
+// a young collection saves
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 16)
+
+// NOTE: reallocate is called from places that know nothing about the VM
+// (chunks, tables, value arrays), so the VM that owns the heap is bound here
+// by initVM and accounting/collection goes through it
+static VM *heapOwner = NULL;
+
+static void gcStep(VM *vm);
+static void freeDeadYoungOwners(VM *vm);
+static bool nurseryExhausted(VM *vm);
+static void collectInPlace(VM *vm);
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  VM *vm = heapOwner;
+  if (vm != NULL) {
+    vm->bytesAllocated += newSize - oldSize;
+    if (newSize > oldSize) {
+#ifdef DEBUG_STRESS_GC
+      bool overThreshold = true;
+#else
+      bool overThreshold = vm->bytesAllocated > vm->nextGC;
+#endif
+      // NOTE: the generational collector moves objects, so it only runs at
+      // safepoints of the interpreter loop where every live object is held
+      // by a root, never under a C local in the middle of an allocation.
+      // Code that fills the nursery and never reaches one (a long script
+      // with no loops or calls) spills into the old space, which is then
+      // collected in place, see collectInPlace
+      if (vm->gcMode == GC_INCREMENTAL) {
+        // NOTE: once a cycle is running it advances by one bounded step for
+        // every GC_STEP_BYTES the program allocates
+        if (vm->gcPhase != GC_IDLE) {
+          vm->gcDebt += newSize - oldSize;
+          vm->cycleAllocated += newSize - oldSize;
+        }
+        if ((vm->gcPhase == GC_IDLE && overThreshold) ||
+            vm->gcDebt >= GC_STEP_BYTES) {
+          gcStep(vm);
+        }
+#ifdef DEBUG_STRESS_GC
+        else {
+          gcStep(vm);
+        }
+#endif
+      } else if (overThreshold && vm->gcMode == GC_GENERATIONAL) {
+        if (nurseryExhausted(vm))
+          collectInPlace(vm);
+        vm->gcRequested = true;
+      } else if (overThreshold) {
+        collectGarbage(vm);
+      }
+    }
+  }
+
   if (newSize == 0) {
     free(pointer);
     return NULL;
@@ -12,3 +80,720 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   }
   return result;
 }
+
+void initGC(VM *vm) {
+  vm->bytesAllocated = 0;
+  vm->nextGC = GC_INITIAL_THRESHOLD;
+  vm->grayStack = NULL;
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->gcStats = (GCStats){0};
+  vm->gcMode = GC_MARK_SWEEP;
+  vm->gcPhase = GC_IDLE;
+  vm->markBit = true;
+  vm->sweepLink = NULL;
+  vm->gcDebt = 0;
+  vm->cycleAllocated = 0;
+  vm->gcPauseNs = GC_DEFAULT_PAUSE_US * 1000u;
+  vm->gcRequested = false;
+  vm->nursery = NULL;
+  vm->nurseryTop = NULL;
+  vm->nurseryEnd = NULL;
+  vm->remembered = NULL;
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->youngOwners = NULL;
+  vm->youngOwnerCount = 0;
+  vm->youngOwnerCapacity = 0;
+  heapOwner = vm;
+}
+
+// Must be called before the first object is allocated
+void setGCMode(VM *vm, GCMode mode) {
+  vm->gcMode = mode;
+  if (mode == GC_GENERATIONAL && vm->nursery == NULL) {
+    vm->nursery = (uint8_t *)malloc(NURSERY_SIZE);
+    if (vm->nursery == NULL)
+      exit(1);
+    vm->nurseryTop = vm->nursery;
+    vm->nurseryEnd = vm->nursery + NURSERY_SIZE;
+  }
+}
+
+// Longest a single incremental step may run, in microseconds
+void setGCPause(VM *vm, uint64_t microseconds) {
+  vm->gcPauseNs = microseconds * 1000u;
+}
+
+void freeGC(VM *vm) {
+  // NOTE: the gray stack is allocated with plain realloc, growing it must not
+  // trigger a collection in the middle of one
+  free(vm->grayStack);
+  vm->grayStack = NULL;
+  vm->grayCapacity = 0;
+  // NOTE: apart from the tracked owners, young objects own nothing outside
+  // their own bytes, dropping the nursery releases all of them at once
+  freeDeadYoungOwners(vm);
+  free(vm->youngOwners);
+  vm->youngOwners = NULL;
+  vm->youngOwnerCapacity = 0;
+  free(vm->nursery);
+  vm->nursery = vm->nurseryTop = vm->nurseryEnd = NULL;
+  free(vm->remembered);
+  vm->remembered = NULL;
+  vm->rememberedCapacity = 0;
+  if (heapOwner == vm)
+    heapOwner = NULL;
+}
+
+static void pushGray(VM *vm, Obj *object) {
+  if (vm->grayCapacity < vm->grayCount + 1) {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    vm->grayStack =
+        (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
+    if (vm->grayStack == NULL)
+      exit(1);
+  }
+  vm->grayStack[vm->grayCount++] = object;
+}
+
+// Tri-color marking: white objects have a stale mark, gray ones are marked and
+// still on the gray stack, black ones are marked and have been scanned
+void markObject(VM *vm, Obj *object) {
+  if (object == NULL || object->mark == vm->markBit)
+    return;
+  object->mark = vm->markBit;
+  pushGray(vm, object);
+}
+
+void markValue(VM *vm, Value value) {
+  if (IS_OBJ(value))
+    markObject(vm, AS_OBJ(value));
+}
+
+void markArray(VM *vm, ValueArray *array) {
+  for (size_t i = 0; i < array->count; i++) {
+    markValue(vm, array->values[i]);
+  }
+}
+
+static void markInvokeCaches(VM *vm, Chunk *chunk) {
+  for (size_t i = 0; i < chunk->invokeCacheCount; i++) {
+    InvokeEntry *entries = chunk->invokeCaches[i].entries;
+    for (int j = 0; j < INVOKE_CACHE_ENTRIES; j++) {
+      markObject(vm, (Obj *)entries[j].klass);
+      markObject(vm, (Obj *)entries[j].method);
+    }
+  }
+}
+
+static void markTable(VM *vm, Table *table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    markObject(vm, (Obj *)entry->key);
+    markValue(vm, entry->value);
+  }
+}
+
+// New objects survive the cycle that is running. While marking they start
+// gray, whatever they are built from is traced even if no root holds it.
+// NOTE: strings reference nothing so they start black, a loop building
+// strings would otherwise spend every step blackening its own temporaries
+void markNewObject(VM *vm, Obj *object) {
+  object->mark = vm->markBit;
+  if (vm->gcPhase == GC_MARKING && object->type != OBJ_STRING)
+    pushGray(vm, object);
+}
+
+// Marks everything the object references, the object itself is already marked
+static void blackenObject(VM *vm, Obj *object) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    markValue(vm, bound->receiver);
+    markObject(vm, (Obj *)bound->method);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    markObject(vm, (Obj *)klass->name);
+    markTable(vm, &klass->methods);
+    break; // NOTE: the initializer is in the method table as well
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    markObject(vm, (Obj *)instance->klass);
+    markObject(vm, (Obj *)instance->shape);
+    for (int i = 0; i < instance->shape->fieldCount; i++) {
+      markValue(vm, instance->fields[i]);
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    markObject(vm, (Obj *)shape->parent);
+    markObject(vm, (Obj *)shape->name);
+    markTable(vm, &shape->transitions);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    markObject(vm, (Obj *)closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      markObject(vm, (Obj *)closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    markObject(vm, (Obj *)function->name);
+    markArray(vm, &function->chunk.constants);
+    markInvokeCaches(vm, &function->chunk);
+    markTraces(vm, function->chunk.loopTraces);
+    break;
+  }
+  case OBJ_UPVALUE:
+    markValue(vm, ((ObjUpvalue *)object)->closed);
+    break;
+  case OBJ_STRING:
+    break; // NOTE: strings reference nothing
+  }
+}
+
+// Roots that change without a write barrier, small enough to be scanned in one
+// go. An incremental cycle scans them again before it starts sweeping
+static void markMutableRoots(VM *vm) {
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+    markValue(vm, *slot);
+  }
+  for (int i = 0; i < vm->frameCount; i++) {
+    markObject(vm, (Obj *)vm->frames[i].closure);
+  }
+  for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL;
+       upvalue = upvalue->nextOpen) {
+    markObject(vm, (Obj *)upvalue);
+  }
+  markObject(vm, (Obj *)vm->rootShape);
+  // NOTE: the script's call sites fill their caches without an owner to
+  // barrier, they are rescanned with the stack
+  if (vm->chunk != NULL) {
+    markInvokeCaches(vm, vm->chunk);
+    markTraces(vm, vm->chunk->loopTraces);
+  }
+  markRecorder(vm);
+  markCompilerRoots(vm);
+}
+
+static uint64_t monotonicNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// NOTE: reading the clock costs about as much as scanning a few objects, the
+// incremental steps only look at it every CHECK_DEADLINE_EVERY objects
+#define CHECK_DEADLINE_EVERY 64
+// A step does at least one unit of work (an object or root scanned, an object
+// swept) per this many bytes allocated since the last step, otherwise a small
+// budget lets the program allocate faster than a cycle can finish
+#define GC_BYTES_PER_WORK 8
+
+// Work done by the current step. A deadline of 0 never passes
+typedef struct {
+  uint64_t deadline;
+  size_t work;
+  size_t minWork;
+} StepBudget;
+
+static bool outOfBudget(StepBudget *budget) {
+  budget->work++;
+  return budget->deadline != 0 && budget->work >= budget->minWork &&
+         budget->work % CHECK_DEADLINE_EVERY == 0 &&
+         monotonicNs() >= budget->deadline;
+}
+
+// The globals and the constants of the running chunk can hold thousands of
+// objects, so they are scanned in slices like the gray stack. The global
+// arrays only grow, and stores into them go through writeBarrier, so the
+// cursor never restarts. The slot table holds the same names as globalNames.
+// Only a different chunk needs a restart. Returns true once both are fully
+// scanned
+static bool scanRootArrays(VM *vm, StepBudget *budget) {
+  while (vm->scanGlobals < vm->globalValues.count) {
+    size_t slot = vm->scanGlobals++;
+    markValue(vm, vm->globalNames.values[slot]);
+    markValue(vm, vm->globalValues.values[slot]);
+    if (outOfBudget(budget))
+      return false;
+  }
+
+  if (vm->scanChunk != vm->chunk) {
+    vm->scanChunk = vm->chunk;
+    vm->scanConstants = 0;
+  }
+  if (vm->chunk == NULL)
+    return true;
+  ValueArray *constants = &vm->chunk->constants;
+  while (vm->scanConstants < constants->count) {
+    markValue(vm, constants->values[vm->scanConstants++]);
+    if (outOfBudget(budget))
+      return false;
+  }
+  return true;
+}
+
+// Scans gray objects and root slices until none are left or the budget runs
+// out, returns true when marking has nothing left to do
+static bool traceReferences(VM *vm, StepBudget *budget) {
+  for (;;) {
+    while (vm->grayCount > 0) {
+      Obj *object = vm->grayStack[--vm->grayCount];
+      blackenObject(vm, object);
+      if (outOfBudget(budget))
+        return false;
+    }
+    if (!scanRootArrays(vm, budget))
+      return false;
+    if (vm->grayCount == 0)
+      return true;
+  }
+}
+
+// Frees unmarked objects until the end of the list or the budget runs out,
+// returns true once the whole list was swept.
+// NOTE: marks are never reset, the next cycle flips markBit instead, so an
+// object allocated while the sweep is running (always with the current
+// markBit) survives it no matter where the sweep is
+static bool sweep(VM *vm, StepBudget *budget) {
+  while (*vm->sweepLink != NULL) {
+    Obj *object = *vm->sweepLink;
+    if (object->mark == vm->markBit) {
+      vm->sweepLink = &object->next;
+    } else {
+      *vm->sweepLink = object->next;
+      vm->gcStats.bytesFreed += objectSize(object);
+      if (object->type == OBJ_STRING) // NOTE: the intern table is weak
+        tableDelete(&vm->strings, (ObjString *)object);
+      freeObject(object);
+    }
+    if (outOfBudget(budget))
+      return *vm->sweepLink == NULL;
+  }
+  return true;
+}
+
+static void beginCycle(VM *vm) {
+  vm->markBit = !vm->markBit; // NOTE: every object is white again
+  vm->gcPhase = GC_MARKING;
+  vm->cycleAllocated = 0;
+  vm->scanGlobals = 0;
+  vm->scanChunk = NULL;
+  vm->scanConstants = 0;
+  markMutableRoots(vm);
+}
+
+// The shared method cache is not traced, entries for objects about to be
+// swept must not survive the cycle
+static void clearMethodCache(VM *vm) {
+  memset(vm->methodCache, 0, sizeof(vm->methodCache));
+}
+
+static void finishMarking(VM *vm) {
+  clearMethodCache(vm);
+  markMutableRoots(vm);
+  traceReferences(vm, &(StepBudget){0});
+  vm->gcPhase = GC_SWEEPING;
+  vm->sweepLink = &vm->objects;
+}
+
+static void endCycle(VM *vm) {
+  vm->gcPhase = GC_IDLE;
+  vm->sweepLink = NULL;
+  vm->gcStats.collections++;
+  // The next collection happens once the live heap has doubled, so the cost
+  // of a collection stays proportional to what was allocated since the last.
+  // NOTE: what an incremental cycle let the program allocate is not part of
+  // the live estimate, otherwise a collector that falls behind would keep
+  // pushing the next cycle further away
+  size_t live = vm->bytesAllocated - vm->cycleAllocated;
+  vm->nextGC = live * GC_HEAP_GROW_FACTOR;
+  if (vm->nextGC < GC_INITIAL_THRESHOLD)
+    vm->nextGC = GC_INITIAL_THRESHOLD;
+}
+
+static void recordPause(GCStats *stats, uint64_t pause) {
+  stats->pauses++;
+  stats->totalPauseNs += pause;
+  if (pause > stats->maxPauseNs)
+    stats->maxPauseNs = pause;
+  int bucket = 0;
+  for (uint64_t us = pause / 1000; us > 0 && bucket < GC_PAUSE_BUCKETS - 1;
+       us >>= 1) {
+    bucket++;
+  }
+  stats->pauseHistogram[bucket]++;
+}
+
+// One bounded slice of an incremental cycle, starts a cycle when idle
+static void gcStep(VM *vm) {
+  uint64_t start = monotonicNs();
+  StepBudget budget = {.deadline = start + vm->gcPauseNs,
+                       .minWork = vm->gcDebt / GC_BYTES_PER_WORK};
+  vm->gcDebt = 0;
+
+  if (vm->gcPhase == GC_IDLE)
+    beginCycle(vm);
+  if (vm->gcPhase == GC_MARKING && traceReferences(vm, &budget))
+    finishMarking(vm);
+  if (vm->gcPhase == GC_SWEEPING && sweep(vm, &budget))
+    endCycle(vm);
+
+  recordPause(&vm->gcStats, monotonicNs() - start);
+}
+
+// Stop the world collection, also finishes an incremental cycle in progress
+void collectGarbage(VM *vm) {
+  uint64_t start = monotonicNs();
+
+  if (vm->gcPhase == GC_IDLE) {
+    beginCycle(vm);
+    traceReferences(vm, &(StepBudget){0});
+  }
+  if (vm->gcPhase == GC_MARKING)
+    finishMarking(vm);
+  sweep(vm, &(StepBudget){0});
+  endCycle(vm);
+
+  recordPause(&vm->gcStats, monotonicNs() - start);
+}
+
+// Bump allocates size bytes in the nursery. Returns NULL outside generational
+// mode, for big objects, or when the nursery is full, the caller then falls
+// back to the old space. Young objects are not on the objects list
+Obj *allocateYoung(VM *vm, size_t size) {
+  if (vm->gcMode != GC_GENERATIONAL || size > NURSERY_MAX_OBJECT)
+    return NULL;
+  size = (size + 7) & ~(size_t)7; // keep every object 8 byte aligned
+#ifdef DEBUG_STRESS_GC
+  vm->gcRequested = true;
+#endif
+  if ((size_t)(vm->nurseryEnd - vm->nurseryTop) < size) {
+    vm->gcRequested = true;
+    return NULL;
+  }
+  Obj *object = (Obj *)vm->nurseryTop;
+  vm->nurseryTop += size;
+  return object;
+}
+
+// True once objects no longer fit in the nursery and go to the old space.
+// NOTE: collectYoung empties the nursery before it copies the survivors, so
+// its own allocations never see it exhausted
+static bool nurseryExhausted(VM *vm) {
+  return (size_t)(vm->nurseryEnd - vm->nurseryTop) < NURSERY_MAX_OBJECT;
+}
+
+// Slow path of writeBarrier, object is old and now references a young one
+void rememberObject(VM *vm, Obj *object) {
+  if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+    vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+    vm->remembered = (Obj **)realloc(vm->remembered,
+                                     sizeof(Obj *) * vm->rememberedCapacity);
+    if (vm->remembered == NULL)
+      exit(1);
+  }
+  object->isRemembered = true;
+  vm->remembered[vm->rememberedCount++] = object;
+}
+
+// Remembers a young object that owns memory outside the nursery, an instance
+// with a field array. A minor collection frees the arrays of those that died,
+// a promoted copy takes over the array of its original
+void trackYoungOwner(VM *vm, Obj *object) {
+  if (vm->youngOwnerCapacity < vm->youngOwnerCount + 1) {
+    vm->youngOwnerCapacity = GROW_CAPACITY(vm->youngOwnerCapacity);
+    vm->youngOwners = (Obj **)realloc(vm->youngOwners,
+                                      sizeof(Obj *) * vm->youngOwnerCapacity);
+    if (vm->youngOwners == NULL)
+      exit(1);
+  }
+  vm->youngOwners[vm->youngOwnerCount++] = object;
+}
+
+// NOTE: a young object that was not copied has no forwarding pointer
+static void freeDeadYoungOwners(VM *vm) {
+  for (int i = 0; i < vm->youngOwnerCount; i++) {
+    Obj *object = vm->youngOwners[i];
+    if (object->next == NULL)
+      freeOwnedMemory(object);
+  }
+  vm->youngOwnerCount = 0;
+}
+
+// Copies a surviving young object to the old space, returns its new address.
+// NOTE: young objects are never on the objects list, so their next field is
+// free to hold the forwarding pointer once they have been copied
+static Obj *promoteObject(VM *vm, Obj *object) {
+  if (object == NULL || !isYoung(vm, object))
+    return object;
+  if (object->next != NULL)
+    return object->next;
+
+  size_t size = objectSize(object);
+  Obj *copy = (Obj *)reallocate(NULL, 0, size);
+  memcpy(copy, object, size);
+  copy->next = vm->objects;
+  vm->objects = copy;
+  object->next = copy;
+  vm->gcStats.bytesPromoted += size;
+
+  // The copy may still reference young objects, scan it once the roots are done
+  pushGray(vm, copy);
+  return copy;
+}
+
+static void promoteValue(VM *vm, Value *slot) {
+  if (IS_OBJ(*slot))
+    *slot = OBJ_VAL(promoteObject(vm, AS_OBJ(*slot)));
+}
+
+static void promoteArray(VM *vm, ValueArray *array) {
+  for (size_t i = 0; i < array->count; i++) {
+    promoteValue(vm, &array->values[i]);
+  }
+}
+
+static void promoteInvokeCaches(VM *vm, Chunk *chunk) {
+  for (size_t i = 0; i < chunk->invokeCacheCount; i++) {
+    InvokeEntry *entries = chunk->invokeCaches[i].entries;
+    for (int j = 0; j < INVOKE_CACHE_ENTRIES; j++) {
+      entries[j].method =
+          (ObjClosure *)promoteObject(vm, (Obj *)entries[j].method);
+    }
+  }
+}
+
+static void promoteTable(VM *vm, Table *table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    // NOTE: a moved key keeps its cached hash, so it stays in the same bucket
+    entry->key = (ObjString *)promoteObject(vm, (Obj *)entry->key);
+    promoteValue(vm, &entry->value);
+  }
+}
+
+// Updates the references an old object holds into the nursery
+static void promoteChildren(VM *vm, Obj *object) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    promoteValue(vm, &bound->receiver);
+    bound->method = (ObjClosure *)promoteObject(vm, (Obj *)bound->method);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    klass->name = (ObjString *)promoteObject(vm, (Obj *)klass->name);
+    promoteTable(vm, &klass->methods);
+    promoteValue(vm, &klass->initializer);
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    for (int i = 0; i < instance->shape->fieldCount; i++) {
+      promoteValue(vm, &instance->fields[i]);
+    }
+    break; // NOTE: the class and the shape are never young
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    shape->name = (ObjString *)promoteObject(vm, (Obj *)shape->name);
+    promoteTable(vm, &shape->transitions);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      closure->upvalues[i] =
+          (ObjUpvalue *)promoteObject(vm, (Obj *)closure->upvalues[i]);
+    }
+    break; // NOTE: the function is never young
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    function->name = (ObjString *)promoteObject(vm, (Obj *)function->name);
+    promoteArray(vm, &function->chunk.constants);
+    promoteInvokeCaches(vm, &function->chunk);
+    break;
+  }
+  case OBJ_UPVALUE: {
+    ObjUpvalue *upvalue = (ObjUpvalue *)object;
+    // NOTE: a closed upvalue points at its own closed field, if that is in
+    // the nursery the upvalue was just copied out of it
+    if (isYoung(vm, (Obj *)upvalue->location))
+      upvalue->location = &upvalue->closed;
+    promoteValue(vm, &upvalue->closed);
+    upvalue->nextOpen =
+        (ObjUpvalue *)promoteObject(vm, (Obj *)upvalue->nextOpen);
+    break;
+  }
+  case OBJ_STRING:
+    break; // NOTE: strings reference nothing
+  }
+}
+
+// The intern table is weak, its young strings either moved to the old space
+// or died. NOTE: the nursery is a run of objects laid end to end up to top, a
+// copied object keeps its header and length, only next was overwritten
+static void updateYoungStrings(VM *vm, uint8_t *top) {
+  uint8_t *cursor = vm->nursery;
+  while (cursor < top) {
+    Obj *object = (Obj *)cursor;
+    cursor += (objectSize(object) + 7) & ~(size_t)7;
+    if (object->type != OBJ_STRING)
+      continue;
+    tableDelete(&vm->strings, (ObjString *)object);
+    if (object->next != NULL)
+      tableSet(&vm->strings, (ObjString *)object->next, NIL_VAL);
+  }
+}
+
+// Minor collection: copies the young objects reachable from the roots and the
+// remembered set to the old space, then empties the nursery. Only the
+// survivors are touched, so the cost does not depend on the size of the heap
+static void collectYoung(VM *vm) {
+  uint64_t start = monotonicNs();
+  size_t promotedBefore = vm->gcStats.bytesPromoted;
+  uint8_t *top = vm->nurseryTop;
+  vm->nurseryTop = vm->nursery;
+
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+    promoteValue(vm, slot);
+  }
+  for (int i = 0; i < vm->frameCount; i++) {
+    CallFrame *frame = &vm->frames[i];
+    frame->closure = (ObjClosure *)promoteObject(vm, (Obj *)frame->closure);
+  }
+  // NOTE: old upvalues on the list are not scanned, so every link is a root
+  for (ObjUpvalue **link = &vm->openUpvalues; *link != NULL;
+       link = &(*link)->nextOpen) {
+    *link = (ObjUpvalue *)promoteObject(vm, (Obj *)*link);
+  }
+  promoteTable(vm, &vm->globalSlots);
+  promoteArray(vm, &vm->globalNames);
+  promoteArray(vm, &vm->globalValues);
+  if (vm->chunk != NULL) {
+    promoteArray(vm, &vm->chunk->constants);
+    promoteInvokeCaches(vm, vm->chunk);
+  }
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    vm->remembered[i]->isRemembered = false;
+    promoteChildren(vm, vm->remembered[i]);
+  }
+  vm->rememberedCount = 0;
+  while (vm->grayCount > 0) {
+    promoteChildren(vm, vm->grayStack[--vm->grayCount]);
+  }
+
+  updateYoungStrings(vm, top);
+  freeDeadYoungOwners(vm);
+  clearMethodCache(vm);
+
+  size_t used = (size_t)(top - vm->nursery);
+  size_t promoted = vm->gcStats.bytesPromoted - promotedBefore;
+
+  uint64_t pause = monotonicNs() - start;
+  GCStats *stats = &vm->gcStats;
+  stats->minorCollections++;
+  stats->bytesReclaimed += used > promoted ? used - promoted : 0;
+  stats->minorPauseNs += pause;
+  if (pause > stats->maxMinorPauseNs)
+    stats->maxMinorPauseNs = pause;
+}
+
+// Called by run() on backward jumps once an allocation asked for a
+// collection. A major collection always follows a minor one, so it never has
+// to look inside the nursery
+void collectAtSafepoint(VM *vm) {
+  vm->gcRequested = false;
+  if (vm->gcMode != GC_GENERATIONAL) {
+    collectGarbage(vm);
+    return;
+  }
+  collectYoung(vm);
+#ifdef DEBUG_STRESS_GC
+  collectGarbage(vm);
+#else
+  if (vm->bytesAllocated > vm->nextGC)
+    collectGarbage(vm);
+#endif
+}
+
+// Major collection in the middle of an allocation, for code that exhausted the
+// nursery without reaching a safepoint. Nothing moves, so like the mark-sweep
+// mode it only relies on the allocating code keeping its objects rooted.
+// Young objects are traced but never swept, and the remembered objects stay
+// alive: the next minor collection still has to scan them
+static void collectInPlace(VM *vm) {
+  uint64_t start = monotonicNs();
+
+  beginCycle(vm);
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    markObject(vm, vm->remembered[i]);
+  }
+  finishMarking(vm);
+  sweep(vm, &(StepBudget){0});
+  endCycle(vm);
+
+  recordPause(&vm->gcStats, monotonicNs() - start);
+}
+
+// Upper bound of the bucket holding the given fraction of the pauses
+static uint64_t pausePercentile(GCStats *stats, double fraction) {
+  size_t seen = 0;
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    seen += stats->pauseHistogram[i];
+    if (seen > 0 && seen >= fraction * stats->pauses)
+      return (uint64_t)1 << i;
+  }
+  return (uint64_t)1 << (GC_PAUSE_BUCKETS - 1);
+}
+
+void printGCStats(VM *vm) {
+  GCStats *stats = &vm->gcStats;
+  double total = stats->totalPauseNs / 1e6;
+  double mean = stats->pauses > 0 ? total / stats->pauses : 0;
+  fprintf(stderr, "gc: %zu collections, %zu bytes freed, %zu bytes live\n",
+          stats->collections, stats->bytesFreed, vm->bytesAllocated);
+  fprintf(stderr,
+          "gc: %zu pauses, total %.3f ms, max %.3f ms, mean %.3f ms\n",
+          stats->pauses, total, stats->maxPauseNs / 1e6, mean);
+  if (stats->pauses > 0) {
+    fprintf(stderr, "gc: pause p50 < %llu us, p90 < %llu us, p99 < %llu us\n",
+            (unsigned long long)pausePercentile(stats, 0.50),
+            (unsigned long long)pausePercentile(stats, 0.90),
+            (unsigned long long)pausePercentile(stats, 0.99));
+    fprintf(stderr, "gc: pause histogram");
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+      if (stats->pauseHistogram[i] > 0)
+        fprintf(stderr, " <%lluus:%zu", (unsigned long long)1 << i,
+                stats->pauseHistogram[i]);
+    }
+    fprintf(stderr, "\n");
+  }
+  if (vm->gcMode != GC_GENERATIONAL)
+    return;
+
+  double minorTotal = stats->minorPauseNs / 1e6;
+  double minorMean = stats->minorCollections > 0
+                         ? minorTotal / stats->minorCollections
+                         : 0;
+  fprintf(stderr,
+          "gc minor: %zu collections, %zu bytes promoted, %zu bytes "
+          "reclaimed\n",
+          stats->minorCollections, stats->bytesPromoted,
+          stats->bytesReclaimed);
+  fprintf(stderr,
+          "gc minor: pause total %.3f ms, max %.3f ms, mean %.3f ms\n",
+          minorTotal, stats->maxMinorPauseNs / 1e6, minorMean);
+}
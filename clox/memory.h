@@ -2,6 +2,7 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "object.h"
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 #define GROW_ARRAY(type, pointer, oldCount, newCount)                          \
@@ -11,5 +12,52 @@
 #define FREE_ARRAY(type, pointer, oldCount)                                    \
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+typedef enum {
+  GC_MARK_SWEEP,   // every collection traces the whole heap
+  GC_GENERATIONAL, // new objects live in a nursery, see collectYoung
+  GC_INCREMENTAL,  // cycles are split into steps, see gcStep
+} GCMode;
+
+typedef enum {
+  GC_IDLE,
+  GC_MARKING,
+  GC_SWEEPING,
+} GCPhase;
+
+// Pauses are bucketed by powers of two microseconds, bucket i counts the
+// pauses shorter than 2^i us
+#define GC_PAUSE_BUCKETS 24
+
+// Counters reported by --gc-stats
+typedef struct {
+  size_t collections;
+  size_t bytesFreed;
+  size_t pauses; // one per collection, or one per step when incremental
+  uint64_t totalPauseNs;
+  uint64_t maxPauseNs;
+  size_t pauseHistogram[GC_PAUSE_BUCKETS];
+  // Minor collections of the nursery, generational mode only
+  size_t minorCollections;
+  size_t bytesPromoted;
+  size_t bytesReclaimed;
+  uint64_t minorPauseNs;
+  uint64_t maxMinorPauseNs;
+} GCStats;
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void initGC(VM *vm);
+void freeGC(VM *vm);
+void markObject(VM *vm, Obj *object);
+void markValue(VM *vm, Value value);
+void markArray(VM *vm, ValueArray *array);
+void collectGarbage(VM *vm);
+void printGCStats(VM *vm);
+
+void setGCMode(VM *vm, GCMode mode);
+void setGCPause(VM *vm, uint64_t microseconds);
+void markNewObject(VM *vm, Obj *object);
+Obj *allocateYoung(VM *vm, size_t size);
+void rememberObject(VM *vm, Obj *object);
+void trackYoungOwner(VM *vm, Obj *object);
+void collectAtSafepoint(VM *vm);
 #endif
@@ -0,0 +1,299 @@
+#include "object.h"
+#include "jit.h"
+#include "memory.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static Obj *allocateObject(VM *vm, size_t size, ObjType type) {
+  // NOTE: functions, classes and shapes are pretenured. They live as long as
+  // the code, a function's chunk must not move under a running call frame and
+  // inline caches point to shapes
+  bool pretenured =
+      type == OBJ_FUNCTION || type == OBJ_CLASS || type == OBJ_SHAPE;
+  Obj *object = pretenured ? NULL : allocateYoung(vm, size);
+  if (object != NULL) {
+    object->next = NULL; // NOTE: young objects are not on the objects list
+  } else {
+    object = (Obj *)reallocate(NULL, 0, size);
+    object->next = vm->objects;
+    vm->objects = object;
+  }
+  object->type = type;
+  object->isRemembered = false;
+  markNewObject(vm, object);
+  return object;
+}
+
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method) {
+  ObjBoundMethod *bound = (ObjBoundMethod *)allocateObject(
+      vm, sizeof(ObjBoundMethod), OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+ObjClass *newClass(VM *vm, ObjString *name) {
+  ObjClass *klass = (ObjClass *)allocateObject(vm, sizeof(ObjClass), OBJ_CLASS);
+  klass->name = name;
+  initTable(&klass->methods);
+  klass->initializer = NIL_VAL;
+  writeBarrier(vm, (Obj *)klass, OBJ_VAL(name));
+  return klass;
+}
+
+// The caller keeps klass reachable, the root shape may be allocated first
+ObjInstance *newInstance(VM *vm, ObjClass *klass) {
+  // NOTE: created with the first instance rather than in initVM, setGCMode
+  // has to run before anything is allocated
+  if (vm->rootShape == NULL)
+    vm->rootShape = newShape(vm, NULL, NULL);
+  ObjInstance *instance =
+      (ObjInstance *)allocateObject(vm, sizeof(ObjInstance), OBJ_INSTANCE);
+  instance->klass = klass;
+  instance->shape = vm->rootShape;
+  instance->capacity = 0;
+  instance->fields = NULL;
+  return instance;
+}
+
+ObjShape *newShape(VM *vm, ObjShape *parent, ObjString *name) {
+  ObjShape *shape = (ObjShape *)allocateObject(vm, sizeof(ObjShape), OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  initTable(&shape->transitions);
+  if (name != NULL)
+    writeBarrier(vm, (Obj *)shape, OBJ_VAL(name));
+  return shape;
+}
+
+// Returns the shape of an instance of shape once it gets the field name,
+// reusing the child created by the first instance that took this path. The
+// caller keeps name reachable
+ObjShape *shapeTransition(VM *vm, ObjShape *shape, ObjString *name) {
+  Value child;
+  if (tableGet(&shape->transitions, name, &child))
+    return (ObjShape *)AS_OBJ(child);
+
+  ObjShape *next = newShape(vm, shape, name);
+  pushVM(vm, OBJ_VAL(next)); // NOTE: reachable while the table grows
+  tableSet(&shape->transitions, name, OBJ_VAL(next));
+  writeBarrier(vm, (Obj *)shape, OBJ_VAL(name));
+  writeBarrier(vm, (Obj *)shape, OBJ_VAL(next));
+  popVM(vm);
+  return next;
+}
+
+// Slot of the field called name in instances of shape, -1 when they don't
+// have it. NOTE: walks up the tree, only inline cache misses pay for it
+int shapeSlot(ObjShape *shape, ObjString *name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name)
+      return shape->fieldCount - 1;
+  }
+  return -1;
+}
+
+// Moves the instance to next, a child of its shape, growing the field array
+// when it is full. The new field starts nil, the caller stores its value.
+// The caller keeps the instance reachable
+void addField(VM *vm, ObjInstance *instance, ObjShape *next) {
+  if (next->fieldCount > instance->capacity) {
+    if (instance->fields == NULL && isYoung(vm, (Obj *)instance))
+      trackYoungOwner(vm, (Obj *)instance);
+    // NOTE: the shape changes last, a collection while the array grows must
+    // only read the fields that already exist
+    int capacity = GROW_CAPACITY(instance->capacity);
+    instance->fields =
+        GROW_ARRAY(Value, instance->fields, instance->capacity, capacity);
+    instance->capacity = capacity;
+  }
+  instance->fields[next->fieldCount - 1] = NIL_VAL;
+  instance->shape = next;
+}
+
+ObjFunction *newFunction(VM *vm) {
+  ObjFunction *function =
+      (ObjFunction *)allocateObject(vm, sizeof(ObjFunction), OBJ_FUNCTION);
+  function->arity = 0;
+  function->upvalueCount = 0;
+  function->name = NULL;
+  function->hotness = 0;
+  function->jit = NULL;
+  initChunk(&function->chunk);
+  return function;
+}
+
+// The upvalues start NULL, the caller fills them right away
+ObjClosure *newClosure(VM *vm, ObjFunction *function) {
+  size_t size =
+      sizeof(ObjClosure) + sizeof(ObjUpvalue *) * function->upvalueCount;
+  ObjClosure *closure = (ObjClosure *)allocateObject(vm, size, OBJ_CLOSURE);
+  closure->function = function;
+  closure->upvalueCount = function->upvalueCount;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    closure->upvalues[i] = NULL;
+  }
+  return closure;
+}
+
+ObjUpvalue *newUpvalue(VM *vm, Value *slot) {
+  ObjUpvalue *upvalue =
+      (ObjUpvalue *)allocateObject(vm, sizeof(ObjUpvalue), OBJ_UPVALUE);
+  upvalue->location = slot;
+  upvalue->closed = NIL_VAL;
+  upvalue->nextOpen = NULL;
+  return upvalue;
+}
+
+// Creates a string that is not interned yet and adds it to vm->strings
+static ObjString *allocateString(VM *vm, const char *chars, int length,
+                                 uint32_t hash) {
+  ObjString *string = (ObjString *)allocateObject(
+      vm, sizeof(ObjString) + length + 1, OBJ_STRING);
+  string->length = length;
+  string->hash = hash;
+  memcpy(string->chars, chars, length);
+  string->chars[length] = '\0';
+  // NOTE: reachable while the intern table grows, it is weak and not a root
+  pushVM(vm, OBJ_VAL(string));
+  tableSet(&vm->strings, string, NIL_VAL);
+  popVM(vm);
+  return string;
+}
+
+// FNV-1a
+uint32_t hashString(const char *key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// Returns the one string object holding these characters, so equal strings
+// compare by pointer and their hash is computed once
+ObjString *copyString(VM *vm, const char *chars, int length) {
+  uint32_t hash = hashString(chars, length);
+  ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
+  if (interned != NULL) {
+    // NOTE: an incremental sweep may not have reached a dead string yet,
+    // marking it keeps it alive now that it is in use again. Strings
+    // reference nothing so they can be made black at any time
+    interned->obj.mark = vm->markBit;
+    return interned;
+  }
+  return allocateString(vm, chars, length, hash);
+}
+
+ObjString *concatenateStrings(VM *vm, ObjString *a, ObjString *b) {
+  int length = a->length + b->length;
+  // Build the characters first, the result is often interned already
+  char buffer[256];
+  char *chars = length <= (int)sizeof(buffer) ? buffer : malloc(length);
+  if (chars == NULL)
+    exit(1);
+  memcpy(chars, a->chars, a->length);
+  memcpy(chars + a->length, b->chars, b->length);
+  ObjString *string = copyString(vm, chars, length);
+  if (chars != buffer)
+    free(chars);
+  return string;
+}
+
+// Bytes owned by the object itself, what a minor collection has to copy
+size_t objectSize(Obj *object) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD:
+    return sizeof(ObjBoundMethod);
+  case OBJ_CLASS:
+    return sizeof(ObjClass);
+  case OBJ_INSTANCE:
+    return sizeof(ObjInstance);
+  case OBJ_SHAPE:
+    return sizeof(ObjShape);
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure) +
+           sizeof(ObjUpvalue *) * ((ObjClosure *)object)->upvalueCount;
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunction);
+  case OBJ_STRING:
+    return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+  case OBJ_UPVALUE:
+    return sizeof(ObjUpvalue);
+  }
+  return 0; // unreachable
+}
+
+// Frees the arrays the object owns outside its own bytes
+void freeOwnedMemory(Obj *object) {
+  switch (object->type) {
+  case OBJ_CLASS:
+    freeTable(&((ObjClass *)object)->methods);
+    break;
+  case OBJ_FUNCTION:
+    freeChunk(&((ObjFunction *)object)->chunk);
+    freeJitCode(((ObjFunction *)object)->jit);
+    break;
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    FREE_ARRAY(Value, instance->fields, instance->capacity);
+    break;
+  }
+  case OBJ_SHAPE:
+    freeTable(&((ObjShape *)object)->transitions);
+    break;
+  case OBJ_BOUND_METHOD:
+  case OBJ_CLOSURE:
+  case OBJ_STRING:
+  case OBJ_UPVALUE:
+    break;
+  }
+}
+
+void freeObject(Obj *object) {
+  freeOwnedMemory(object);
+  reallocate(object, objectSize(object), 0);
+}
+
+static void printFunction(ObjFunction *function) {
+  if (function->name == NULL) {
+    printf("<script>");
+    return;
+  }
+  printf("<fn %s>", function->name->chars);
+}
+
+void printObject(Value value) {
+  switch (OBJ_TYPE(value)) {
+  case OBJ_BOUND_METHOD:
+    printFunction(AS_BOUND_METHOD(value)->method->function);
+    break;
+  case OBJ_CLASS:
+    printf("%s", AS_CLASS(value)->name->chars);
+    break;
+  case OBJ_INSTANCE:
+    printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+    break;
+  case OBJ_SHAPE:
+    printf("shape"); // NOTE: never reaches Lox code
+    break;
+  case OBJ_CLOSURE:
+    printFunction(AS_CLOSURE(value)->function);
+    break;
+  case OBJ_FUNCTION:
+    printFunction(AS_FUNCTION(value));
+    break;
+  case OBJ_UPVALUE:
+    printf("upvalue"); // NOTE: never reaches Lox code
+    break;
+  case OBJ_STRING:
+    printf("%s", AS_CSTRING(value));
+    break;
+  }
+}
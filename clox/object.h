@@ -0,0 +1,147 @@
+#ifndef clox_object_h
+#define clox_object_h
+
+#include "chunk.h"
+#include "common.h"
+#include "table.h"
+#include "value.h"
+
+typedef struct VM VM;
+
+#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_STRING(value) isObjType(value, OBJ_STRING)
+
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
+#define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+#define AS_STRING(value) ((ObjString *)AS_OBJ(value))
+#define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+
+typedef enum {
+  OBJ_BOUND_METHOD,
+  OBJ_CLASS,
+  OBJ_CLOSURE,
+  OBJ_FUNCTION,
+  OBJ_INSTANCE,
+  OBJ_SHAPE,
+  OBJ_STRING,
+  OBJ_UPVALUE,
+} ObjType;
+
+// Header shared by every heap allocated value, the concrete objects embed it
+// as their first field so an ObjString* can be safely cast to an Obj*
+struct Obj {
+  ObjType type;
+  bool mark; // reached in the current cycle when equal to vm->markBit
+  bool isRemembered; // in the remembered set, see writeBarrier
+  struct Obj *next; // intrusive list of every object owned by the VM
+};
+
+struct ObjString {
+  Obj obj;
+  int length;
+  uint32_t hash;
+  char chars[]; // NOTE: flexible array, the characters live right after the
+                // header so a string is a single allocation
+};
+
+// Compiled code of a function. NOTE: functions are never young, call frames
+// keep pointers to their chunk and it owns arrays outside the object
+typedef struct {
+  Obj obj;
+  int arity;
+  int upvalueCount;
+  Chunk chunk;
+  ObjString *name;
+  uint32_t hotness;    // calls and loop back edges, counted with --jit
+  struct JitCode *jit; // machine code, NULL until hot, see jit.c
+} ObjFunction;
+
+// A captured variable. While open it points to the stack slot of the
+// variable, closing it copies the value into closed and points there
+typedef struct ObjUpvalue {
+  Obj obj;
+  Value *location;
+  Value closed;
+  struct ObjUpvalue *nextOpen; // vm->openUpvalues, sorted by stack slot
+} ObjUpvalue;
+
+// A function together with the variables it captured, what Lox code calls
+typedef struct ObjClosure {
+  Obj obj;
+  ObjFunction *function;
+  int upvalueCount;
+  ObjUpvalue *upvalues[]; // NOTE: flexible array, filled by OP_CLOSURE
+} ObjClosure;
+
+// Hidden class of instances: which fields they have and the slot of each in
+// their field array. Instances that got the same fields in the same order
+// share a shape, so a (shape, slot) pair cached by an instruction holds for
+// all of them. Adding a field follows a transition to a child shape, the
+// shapes form a tree rooted at vm->rootShape.
+// NOTE: shapes are never young and, being reachable from the root through the
+// transitions, never freed. Inline caches point to them without tracing them
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape *parent; // NULL for the root, the shape without fields
+  ObjString *name;         // the field this shape adds to its parent
+  int fieldCount;          // the slot of name is fieldCount - 1
+  Table transitions;       // field name -> the child shape adding it
+} ObjShape;
+
+// NOTE: classes are never young, they own their method table
+typedef struct ObjClass {
+  Obj obj;
+  ObjString *name;
+  Table methods;     // name -> closure
+  Value initializer; // the init method, nil when the class has none
+} ObjClass;
+
+// Fields live in a flat array laid out by the shape, the names are only in
+// the shape. A young instance owns its array too, see trackYoungOwner
+typedef struct {
+  Obj obj;
+  ObjClass *klass;
+  ObjShape *shape;
+  int capacity;
+  Value *fields;
+} ObjInstance;
+
+// A method read off an instance, calling it passes the instance as this
+typedef struct {
+  Obj obj;
+  Value receiver;
+  ObjClosure *method;
+} ObjBoundMethod;
+
+ObjBoundMethod *newBoundMethod(VM *vm, Value receiver, ObjClosure *method);
+ObjClass *newClass(VM *vm, ObjString *name);
+ObjInstance *newInstance(VM *vm, ObjClass *klass);
+ObjShape *newShape(VM *vm, ObjShape *parent, ObjString *name);
+ObjShape *shapeTransition(VM *vm, ObjShape *shape, ObjString *name);
+int shapeSlot(ObjShape *shape, ObjString *name);
+void addField(VM *vm, ObjInstance *instance, ObjShape *next);
+ObjFunction *newFunction(VM *vm);
+ObjClosure *newClosure(VM *vm, ObjFunction *function);
+ObjUpvalue *newUpvalue(VM *vm, Value *slot);
+ObjString *copyString(VM *vm, const char *chars, int length);
+ObjString *concatenateStrings(VM *vm, ObjString *a, ObjString *b);
+uint32_t hashString(const char *key, int length);
+void freeOwnedMemory(Obj *object);
+void freeObject(Obj *object);
+size_t objectSize(Obj *object);
+void printObject(Value value);
+
+static inline bool isObjType(Value value, ObjType type) {
+  return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+#endif
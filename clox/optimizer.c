@@ -0,0 +1,382 @@
+#include "optimizer.h"
+#include "chunk.h"
+#include "common.h"
+#include "memory.h"
+#include "value.h"
+#include <stdlib.h>
+
+// Decoded view of one instruction, the pass works on these and only writes
+// bytecode back at the end so removing instructions never shifts offsets
+// while we still need them
+typedef struct {
+  int offset; // in the original code
+  int line;
+  int length; // in bytes, rewrites can change it
+  uint8_t op;
+  int operand; // constant/slot operand, or the original jump target offset
+  bool isTarget; // some jump lands here, patterns must not swallow it
+  bool dead;
+} Instr;
+
+typedef struct {
+  Chunk *chunk;
+  Instr *instrs;
+  int count;
+} Peephole;
+
+// Instructions whose operands are copied through untouched, e.g. the upvalue
+// pairs of OP_CLOSURE make its length vary and the property and invoke
+// instructions carry a cache index after their constant
+static bool isOpaque(uint8_t op) {
+  switch (op) {
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG:
+  case OP_GET_PROPERTY:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG:
+  case OP_INVOKE:
+  case OP_INVOKE_LONG:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool isJump(uint8_t op) {
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP;
+}
+
+static void decode(Peephole *peephole) {
+  Chunk *chunk = peephole->chunk;
+  peephole->instrs = malloc(sizeof(Instr) * (chunk->count + 1));
+  if (peephole->instrs == NULL)
+    exit(1);
+  peephole->count = 0;
+
+  size_t run = 0;
+  for (int offset = 0; offset < (int)chunk->count;) {
+    Instr *instr = &peephole->instrs[peephole->count++];
+    int length = instructionLength(chunk, offset);
+    // Walk the line runs alongside the code instead of searching each time
+    while (run + 1 < chunk->lineCount && chunk->lines[run + 1].offset <= offset)
+      run++;
+    instr->offset = offset;
+    instr->line = chunk->lines[run].line;
+    instr->length = length;
+    instr->op = chunk->code[offset];
+    instr->isTarget = false;
+    instr->dead = false;
+    instr->operand = 0;
+    if (isOpaque(instr->op)) {
+      // The operand bytes are read back from the original code by emit
+    } else if (length == 2) {
+      instr->operand = chunk->code[offset + 1];
+    } else if (length == 4) {
+      instr->operand = (chunk->code[offset + 1] << 16) |
+                       (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    } else if (isJump(instr->op)) {
+      int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+      instr->operand =
+          instr->op == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+    }
+    offset += length;
+  }
+}
+
+// Index of the first instruction at or after the original offset, a jump to
+// a removed instruction lands on whatever followed it
+static int indexAt(Peephole *peephole, int offset) {
+  int low = 0, high = peephole->count;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (peephole->instrs[mid].offset < offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static int liveIndexAt(Peephole *peephole, int offset) {
+  int index = indexAt(peephole, offset);
+  while (index < peephole->count && peephole->instrs[index].dead) {
+    index++;
+  }
+  return index;
+}
+
+static void markTargets(Peephole *peephole) {
+  for (int i = 0; i < peephole->count; i++) {
+    peephole->instrs[i].isTarget = false;
+  }
+  for (int i = 0; i < peephole->count; i++) {
+    Instr *instr = &peephole->instrs[i];
+    if (instr->dead || !isJump(instr->op))
+      continue;
+    int target = liveIndexAt(peephole, instr->operand);
+    if (target < peephole->count)
+      peephole->instrs[target].isTarget = true;
+  }
+}
+
+static int nextLive(Peephole *peephole, int index) {
+  do {
+    index++;
+  } while (index < peephole->count && peephole->instrs[index].dead);
+  return index;
+}
+
+static bool isNumberConstant(Peephole *peephole, Instr *instr) {
+  return (instr->op == OP_CONSTANT || instr->op == OP_CONSTANT_LONG) &&
+         IS_NUMBER(peephole->chunk->constants.values[instr->operand]);
+}
+
+static double numberOf(Peephole *peephole, Instr *instr) {
+  return AS_NUMBER(peephole->chunk->constants.values[instr->operand]);
+}
+
+// Turns instr into a push of value, returns false if the pool is full or the
+// push would take more than room, the bytes of the instructions it replaces.
+// NOTE: the compiler checked its jumps and loop bodies against the code as
+// written, a fold must never make it longer
+static bool replaceWithConstant(Peephole *peephole, Instr *instr, Value value,
+                                int room) {
+  if (IS_BOOL(value)) {
+    instr->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+    instr->length = 1;
+    return true;
+  }
+  size_t constant = addConstant(peephole->chunk, value);
+  if (constant > MAX_LONG_CONSTANT)
+    return false;
+  bool isShort = constant <= MAX_SHORT_CONSTANT;
+  if ((isShort ? 2 : 4) > room)
+    return false;
+  instr->op = isShort ? OP_CONSTANT : OP_CONSTANT_LONG;
+  instr->length = isShort ? 2 : 4;
+  instr->operand = (int)constant;
+  return true;
+}
+
+static bool foldBinary(Peephole *peephole, Instr *a, Instr *b, Instr *op) {
+  if (!isNumberConstant(peephole, a) || !isNumberConstant(peephole, b))
+    return false;
+  double x = numberOf(peephole, a);
+  double y = numberOf(peephole, b);
+  Value result;
+  switch (op->op) {
+  case OP_ADD:
+    result = NUMBER_VAL(x + y);
+    break;
+  case OP_SUBTRACT:
+    result = NUMBER_VAL(x - y);
+    break;
+  case OP_MULTIPLY:
+    result = NUMBER_VAL(x * y);
+    break;
+  case OP_DIVIDE:
+    result = NUMBER_VAL(x / y);
+    break;
+  case OP_GREATER:
+    result = BOOL_VAL(x > y);
+    break;
+  case OP_LESS:
+    result = BOOL_VAL(x < y);
+    break;
+  case OP_EQUAL:
+    result = BOOL_VAL(x == y);
+    break;
+  default:
+    return false;
+  }
+  return replaceWithConstant(peephole, a, result,
+                             a->length + b->length + op->length);
+}
+
+static bool isPurePush(uint8_t op) {
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+    return true;
+  default:
+    return false; // OP_GET_GLOBAL can fail, it has to run
+  }
+}
+
+// One sweep of the local patterns, returns true if anything changed
+static bool rewrite(Peephole *peephole) {
+  bool changed = false;
+  Instr *instrs = peephole->instrs;
+  for (int i = 0; i < peephole->count; i++) {
+    if (instrs[i].dead)
+      continue;
+    int j = nextLive(peephole, i);
+    if (j >= peephole->count || instrs[j].isTarget)
+      continue;
+    Instr *a = &instrs[i];
+    Instr *b = &instrs[j];
+
+    // CONSTANT x, NEGATE -> CONSTANT -x
+    if (b->op == OP_NEGATE && isNumberConstant(peephole, a)) {
+      if (replaceWithConstant(peephole, a, NUMBER_VAL(-numberOf(peephole, a)),
+                              a->length + b->length)) {
+        b->dead = true;
+        changed = true;
+      }
+      continue;
+    }
+
+    // TRUE/FALSE/NIL, NOT -> FALSE/TRUE
+    if (b->op == OP_NOT &&
+        (a->op == OP_TRUE || a->op == OP_FALSE || a->op == OP_NIL)) {
+      a->op = a->op == OP_TRUE ? OP_FALSE : OP_TRUE;
+      b->dead = true;
+      changed = true;
+      continue;
+    }
+
+    // push, POP -> nothing
+    if (b->op == OP_POP && isPurePush(a->op)) {
+      a->dead = true;
+      b->dead = true;
+      changed = true;
+      continue;
+    }
+
+    // CONSTANT x, CONSTANT y, op -> CONSTANT (x op y)
+    int k = nextLive(peephole, j);
+    if (k >= peephole->count || instrs[k].isTarget)
+      continue;
+    if (foldBinary(peephole, a, b, &instrs[k])) {
+      b->dead = true;
+      instrs[k].dead = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Point jumps that land on an unconditional jump at its final destination.
+// A JUMP_IF_FALSE that lands on another JUMP_IF_FALSE can skip it too, the
+// condition is still on the stack and is just as falsey the second time
+static void threadJumps(Peephole *peephole) {
+  for (int i = 0; i < peephole->count; i++) {
+    Instr *instr = &peephole->instrs[i];
+    if (instr->dead || (instr->op != OP_JUMP && instr->op != OP_JUMP_IF_FALSE))
+      continue;
+
+    // Bounded so a jump cycle can't hang the compiler
+    for (int hops = 0; hops < 16; hops++) {
+      int target = liveIndexAt(peephole, instr->operand);
+      if (target >= peephole->count)
+        break;
+      Instr *next = &peephole->instrs[target];
+      bool threads = next->op == OP_JUMP ||
+                     (instr->op == OP_JUMP_IF_FALSE && next->op == instr->op);
+      if (!threads || next == instr || next->operand <= instr->offset ||
+          next->operand - (instr->offset + 3) > UINT16_MAX)
+        break;
+      instr->operand = next->operand;
+    }
+  }
+}
+
+// A call whose result is returned right away is a tail call, the callee can
+// take over the frame of the caller. NOTE: separate from rewrite, the RETURN
+// may be a jump target (return a or f();) and only the call changes
+static void markTailCalls(Peephole *peephole) {
+  for (int i = 0; i < peephole->count; i++) {
+    Instr *instr = &peephole->instrs[i];
+    if (instr->dead || instr->op != OP_CALL)
+      continue;
+    int next = nextLive(peephole, i);
+    if (next < peephole->count && peephole->instrs[next].op == OP_RETURN)
+      instr->op = OP_TAIL_CALL;
+  }
+}
+
+// Writes the surviving instructions back, remapping jump targets to the new
+// offsets and rebuilding the line table alongside the code. If a jump no
+// longer fits in 16 bits the chunk is left as it was
+static void emit(Peephole *peephole) {
+  Chunk *chunk = peephole->chunk;
+  int *newOffsets = malloc(sizeof(int) * (peephole->count + 1));
+  if (newOffsets == NULL)
+    exit(1);
+  int offset = 0;
+  for (int i = 0; i < peephole->count; i++) {
+    newOffsets[i] = offset;
+    Instr *instr = &peephole->instrs[i];
+    if (!instr->dead)
+      offset += instr->length;
+  }
+  newOffsets[peephole->count] = offset;
+
+  Chunk out;
+  initChunk(&out);
+  for (int i = 0; i < peephole->count; i++) {
+    Instr *instr = &peephole->instrs[i];
+    if (instr->dead)
+      continue;
+    writeChunk(&out, instr->op, instr->line);
+    if (isOpaque(instr->op)) {
+      for (int byte = 1; byte < instr->length; byte++) {
+        writeChunk(&out, chunk->code[instr->offset + byte], instr->line);
+      }
+    } else if (isJump(instr->op)) {
+      int target = newOffsets[liveIndexAt(peephole, instr->operand)];
+      int jump = instr->op == OP_LOOP ? newOffsets[i] + 3 - target
+                                      : target - (newOffsets[i] + 3);
+      if (jump < 0 || jump > UINT16_MAX) {
+        free(newOffsets);
+        freeChunk(&out);
+        return;
+      }
+      writeChunk(&out, (jump >> 8) & 0xff, instr->line);
+      writeChunk(&out, jump & 0xff, instr->line);
+    } else if (instr->length == 2) {
+      writeChunk(&out, (uint8_t)instr->operand, instr->line);
+    } else if (instr->length == 4) {
+      writeChunk(&out, (instr->operand >> 16) & 0xff, instr->line);
+      writeChunk(&out, (instr->operand >> 8) & 0xff, instr->line);
+      writeChunk(&out, instr->operand & 0xff, instr->line);
+    }
+  }
+  free(newOffsets);
+
+  // Keep the constant pool, swap in the new code and lines
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  chunk->code = out.code;
+  chunk->count = out.count;
+  chunk->capacity = out.capacity;
+  chunk->lines = out.lines;
+  chunk->lineCount = out.lineCount;
+  chunk->lineCapacity = out.lineCapacity;
+  freeValueArray(&out.constants);
+}
+
+void optimizeChunk(Chunk *chunk) {
+  if (chunk->count == 0)
+    return;
+  Peephole peephole;
+  peephole.chunk = chunk;
+  decode(&peephole);
+
+  // Folding can expose new patterns, e.g. 1 + 2 * 3 folds inside out. Jump
+  // targets are recomputed every sweep since removed instructions hand their
+  // incoming jumps over to the next live one
+  do {
+    markTargets(&peephole);
+  } while (rewrite(&peephole));
+  threadJumps(&peephole);
+  markTailCalls(&peephole);
+  emit(&peephole);
+  free(peephole.instrs);
+}
@@ -0,0 +1,10 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// Peephole pass over a finished chunk: folds constant arithmetic, drops
+// useless push/pop pairs and threads jumps. Rewrites code and lines in place
+void optimizeChunk(Chunk *chunk);
+
+#endif
@@ -0,0 +1,1036 @@
+#include "regvm.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Where the value of one stack slot is while the register code runs. Only
+// values the stack VM would have copied are kept out of their own slot, the
+// result of an instruction always lands in its slot
+typedef enum {
+  VALUE_HOME,     // in its own slot
+  VALUE_SLOT,     // in slot index, a local it is a copy of
+  VALUE_CONSTANT, // K[index]
+  VALUE_NIL,
+  VALUE_TRUE,
+  VALUE_FALSE,
+  VALUE_DEAD, // a condition a fused test consumed, popped next
+} ValueKind;
+
+typedef struct {
+  uint8_t kind;
+  int32_t index;
+} StackValue;
+
+// One value to put back into its slot before run() takes over
+typedef struct {
+  uint8_t slot;
+  StackValue value;
+} RegMove;
+
+// The way out of one instruction to run(), which runs the stack instruction
+// at offset with depth slots in use
+typedef struct {
+  int offset;
+  int depth;
+  int firstMove;
+  int moveCount;
+} RegExit;
+
+struct RegCode {
+  RegInstr *code; // NULL for a chunk left to the stack VM
+  int *exits;     // index in exitList by pc, -1 for instructions that stay
+  RegExit *exitList;
+  RegMove *moves;
+  int *entries; // pc by bytecode offset, -1 where run() keeps going itself
+};
+
+// Translation.
+// NOTE: plain realloc like the JIT, translating runs from a call and must
+// not start a collection
+
+// An operand to fill in with the pc of a bytecode offset at the end
+typedef struct {
+  int pc;
+  int target;
+} Fixup;
+
+// Instructions run() comes back into the register code through after it ran
+// a stack instruction whose register form is gone, a comparison fused into
+// its jump or a result stored straight into a local. They redo what the rest
+// of that form did and jump back
+typedef struct {
+  int offset;
+  RegInstr code[3];
+  int count;
+  int target; // bytecode offset of the branch in code, if any
+  int resume; // pc
+} Stub;
+
+typedef struct {
+  Chunk *chunk;
+  RegInstr *code;
+  int *exits;
+  int count;
+  int capacity;
+  RegExit *exitList;
+  int exitCount;
+  int exitCapacity;
+  RegMove *moves;
+  int moveCount;
+  int moveCapacity;
+  Fixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+  Stub *stubs;
+  int stubCount;
+  int stubCapacity;
+  bool *labels;  // jump targets, by bytecode offset
+  bool *loops;   // the labels OP_LOOP jumps back to
+  int *depths;   // stack depth at each label, -1 until it is known
+  int *pcs;      // pc of each bytecode offset, -1 in dead code
+  bool *entries; // offsets run() may come back at
+  StackValue stack[UINT8_COUNT];
+  int depth;
+  bool live; // the current instruction is reachable
+  // Depth at the last OP_JUMP. A for loop's increment is only reached by the
+  // OP_LOOP at the end of the body, further on: it starts at the depth the
+  // jump over it left, which the OP_LOOP then checks
+  int jumpDepth;
+  // The last instruction, if it computed the value on top of the stack and
+  // nothing was emitted since. A comparison and the OP_NOT of it are
+  // remembered to be fused into the jump using them
+  int resultPc;
+  int comparePc;
+  int compareNext; // bytecode offset after the comparison
+  bool negated;
+  bool failed;
+} Translator;
+
+static void *growArray(void *array, int *capacity, size_t size) {
+  *capacity = *capacity < 8 ? 8 : *capacity * 2;
+  array = realloc(array, size * *capacity);
+  if (array == NULL)
+    exit(1);
+  return array;
+}
+
+static int emit(Translator *t, uint8_t op, int a, int b, int c, int32_t x) {
+  if (t->count == t->capacity) {
+    int capacity = t->capacity;
+    t->code = (RegInstr *)growArray(t->code, &capacity, sizeof(RegInstr));
+    t->exits = (int *)realloc(t->exits, sizeof(int) * capacity);
+    if (t->exits == NULL)
+      exit(1);
+    t->capacity = capacity;
+  }
+  t->code[t->count] = (RegInstr){op, (uint8_t)a, (uint8_t)b, (uint8_t)c, x};
+  t->exits[t->count] = -1;
+  t->resultPc = -1;
+  t->comparePc = -1;
+  return t->count++;
+}
+
+static void addFixup(Translator *t, int pc, int target) {
+  if (t->fixupCount == t->fixupCapacity)
+    t->fixups =
+        (Fixup *)growArray(t->fixups, &t->fixupCapacity, sizeof(Fixup));
+  t->fixups[t->fixupCount++] = (Fixup){pc, target};
+}
+
+static Stub *addStub(Translator *t, int offset) {
+  if (t->stubCount == t->stubCapacity)
+    t->stubs = (Stub *)growArray(t->stubs, &t->stubCapacity, sizeof(Stub));
+  Stub *stub = &t->stubs[t->stubCount++];
+  stub->offset = offset;
+  stub->count = 0;
+  stub->target = -1;
+  stub->resume = t->count;
+  t->entries[offset] = false;
+  return stub;
+}
+
+// Records how run() takes over at the stack instruction at offset, with the
+// stack as it is now, and gives it to the instruction at pc
+static void addExit(Translator *t, int pc, int offset) {
+  if (t->exitCount == t->exitCapacity)
+    t->exitList = (RegExit *)growArray(t->exitList, &t->exitCapacity,
+                                       sizeof(RegExit));
+  RegExit *exit = &t->exitList[t->exitCount];
+  exit->offset = offset;
+  exit->depth = t->depth;
+  exit->firstMove = t->moveCount;
+  exit->moveCount = 0;
+  for (int slot = 0; slot < t->depth; slot++) {
+    if (t->stack[slot].kind == VALUE_HOME)
+      continue;
+    if (t->moveCount == t->moveCapacity)
+      t->moves = (RegMove *)growArray(t->moves, &t->moveCapacity,
+                                      sizeof(RegMove));
+    t->moves[t->moveCount++] = (RegMove){(uint8_t)slot, t->stack[slot]};
+    exit->moveCount++;
+  }
+  t->exits[pc] = t->exitCount++;
+}
+
+// Sets slot to value
+static void load(Translator *t, int slot, StackValue value) {
+  switch (value.kind) {
+  case VALUE_HOME:
+    break;
+  case VALUE_SLOT:
+    if (value.index != slot)
+      emit(t, REG_MOVE, slot, value.index, 0, 0);
+    break;
+  case VALUE_CONSTANT:
+    emit(t, REG_LOADK, slot, 0, 0, value.index);
+    break;
+  case VALUE_NIL:
+    emit(t, REG_NIL, slot, 0, 0, 0);
+    break;
+  case VALUE_TRUE:
+    emit(t, REG_TRUE, slot, 0, 0, 0);
+    break;
+  case VALUE_FALSE:
+    emit(t, REG_FALSE, slot, 0, 0, 0);
+    break;
+  default:
+    t->failed = true;
+    break;
+  }
+}
+
+static void materialize(Translator *t, int slot) {
+  if (t->stack[slot].kind == VALUE_HOME)
+    return;
+  load(t, slot, t->stack[slot]);
+  t->stack[slot].kind = VALUE_HOME;
+}
+
+// Every value into its own slot, as the stack VM has them
+static void flush(Translator *t) {
+  for (int slot = 0; slot < t->depth; slot++)
+    materialize(t, slot);
+}
+
+// A register holding the value of slot
+static int reg(Translator *t, int slot) {
+  if (t->stack[slot].kind == VALUE_SLOT)
+    return t->stack[slot].index;
+  materialize(t, slot);
+  return slot;
+}
+
+static void push(Translator *t, uint8_t kind, int32_t index) {
+  if (t->depth >= UINT8_MAX - 1) {
+    t->failed = true;
+    return;
+  }
+  t->stack[t->depth++] = (StackValue){kind, index};
+}
+
+static void setLabelDepth(Translator *t, int target) {
+  if (t->depths[target] == -1)
+    t->depths[target] = t->depth;
+  else if (t->depths[target] != t->depth)
+    t->failed = true;
+}
+
+static void jump(Translator *t, uint8_t op, int b, int target) {
+  int pc = emit(t, op, 0, b, 0, 0);
+  addFixup(t, pc, target);
+  setLabelDepth(t, target);
+}
+
+static int readSlot(uint8_t *code, bool isLong) {
+  return isLong ? (code[1] << 16) | (code[2] << 8) | code[3] : code[1];
+}
+
+// The register forms of the arithmetic and comparison instructions
+static const struct {
+  uint8_t op;
+  uint8_t opK;
+  uint8_t flipped;  // the form with the operands swapped, for a constant on
+                    // the left
+  bool guarded;     // leaves to run() for anything but two numbers
+} binaryForms[] = {
+    [OP_ADD] = {REG_ADD, REG_ADDK, REG_ADDK, true},
+    [OP_SUBTRACT] = {REG_SUBTRACT, REG_SUBTRACTK, 0, true},
+    [OP_MULTIPLY] = {REG_MULTIPLY, REG_MULTIPLYK, REG_MULTIPLYK, true},
+    [OP_DIVIDE] = {REG_DIVIDE, REG_DIVIDEK, 0, true},
+    [OP_GREATER] = {REG_GREATER, REG_GREATERK, REG_LESSK, true},
+    [OP_LESS] = {REG_LESS, REG_LESSK, REG_GREATERK, true},
+    [OP_EQUAL] = {REG_EQUAL, REG_EQUALK, REG_EQUALK, false},
+};
+
+static void binary(Translator *t, uint8_t op, int offset, int next) {
+  StackValue left = t->stack[t->depth - 2];
+  StackValue right = t->stack[t->depth - 1];
+  int pc;
+  if (right.kind == VALUE_CONSTANT) {
+    int b = reg(t, t->depth - 2);
+    pc = emit(t, binaryForms[op].opK, t->depth - 2, b, 0, right.index);
+  } else if (left.kind == VALUE_CONSTANT && binaryForms[op].flipped != 0) {
+    int b = reg(t, t->depth - 1);
+    pc = emit(t, binaryForms[op].flipped, t->depth - 2, b, 0, left.index);
+  } else {
+    int b = reg(t, t->depth - 2);
+    int c = reg(t, t->depth - 1);
+    pc = emit(t, binaryForms[op].op, t->depth - 2, b, c, 0);
+  }
+  if (binaryForms[op].guarded) {
+    addExit(t, pc, offset);
+    t->entries[next] = true;
+  }
+  t->depth -= 2;
+  push(t, VALUE_HOME, 0);
+  t->resultPc = pc;
+  if (op == OP_GREATER || op == OP_LESS || op == OP_EQUAL) {
+    t->comparePc = pc;
+    t->compareNext = next;
+    t->negated = false;
+  }
+}
+
+// OP_JUMP_IF_FALSE where both ways start with the OP_POP of the condition,
+// as in if and while statements. The condition is not stored, and a
+// comparison computing it becomes a test of the jump
+static bool fuseJump(Translator *t, int offset, int target) {
+  Chunk *chunk = t->chunk;
+  int next = offset + 3;
+  if (t->labels[offset] || t->labels[next] || chunk->code[next] != OP_POP ||
+      chunk->code[target] != OP_POP)
+    return false;
+  int top = t->depth - 1;
+  for (int slot = 0; slot < top; slot++) {
+    if (t->stack[slot].kind != VALUE_HOME)
+      return false;
+  }
+
+  int pc = t->comparePc;
+  RegInstr *compare = pc >= 0 ? &t->code[pc] : NULL;
+  bool fusable = compare != NULL && compare->a == top &&
+                 (compare->op < REG_GREATERK || compare->x <= UINT8_MAX);
+  if (!fusable) {
+    jump(t, REG_JUMP_IF_FALSE, reg(t, top), target);
+  } else {
+    bool negated = t->negated;
+    if (negated)
+      t->count--; // the OP_NOT
+    switch (compare->op) {
+    case REG_GREATER:
+      compare->op = REG_TEST_GREATER;
+      break;
+    case REG_LESS:
+      compare->op = REG_TEST_LESS;
+      break;
+    case REG_EQUAL:
+      compare->op = REG_TEST_EQUAL;
+      break;
+    case REG_GREATERK:
+      compare->op = REG_TEST_GREATERK;
+      break;
+    case REG_LESSK:
+      compare->op = REG_TEST_LESSK;
+      break;
+    default:
+      compare->op = REG_TEST_EQUALK;
+      break;
+    }
+    if (compare->op >= REG_TEST_GREATERK)
+      compare->c = (uint8_t)compare->x;
+    compare->a = negated;
+    addFixup(t, pc, target);
+    setLabelDepth(t, target);
+    t->resultPc = t->comparePc = -1;
+    // A comparison that failed its guard was run by run(), which comes back
+    // for the rest with the result in its slot
+    if (t->entries[t->compareNext]) {
+      Stub *stub = addStub(t, t->compareNext);
+      if (negated)
+        stub->code[stub->count++] = (RegInstr){REG_NOT, top, top, 0, 0};
+      stub->code[stub->count++] = (RegInstr){REG_JUMP_IF_FALSE, 0, top, 0, 0};
+      stub->target = target;
+    }
+  }
+  t->stack[top].kind = VALUE_DEAD;
+  return true;
+}
+
+// OP_SET_LOCAL right after the instruction computing its value: that
+// instruction stores into the local instead
+static bool storeResult(Translator *t, int slot, int offset) {
+  int top = t->depth - 1;
+  if (t->resultPc < 0 || t->code[t->resultPc].a != top || slot == top)
+    return false;
+  t->code[t->resultPc].a = (uint8_t)slot;
+  t->stack[top] = (StackValue){VALUE_SLOT, slot};
+  if (t->entries[offset]) {
+    Stub *stub = addStub(t, offset);
+    stub->code[stub->count++] = (RegInstr){REG_MOVE, slot, top, 0, 0};
+  }
+  return true;
+}
+
+static void setLocal(Translator *t, int slot, int offset) {
+  // Copies of the old value keep it
+  for (int i = 0; i < t->depth; i++) {
+    if (t->stack[i].kind == VALUE_SLOT && t->stack[i].index == slot)
+      materialize(t, i);
+  }
+  if (!storeResult(t, slot, offset)) {
+    StackValue value = t->stack[t->depth - 1];
+    load(t, slot, value.kind == VALUE_HOME
+                      ? (StackValue){VALUE_SLOT, t->depth - 1}
+                      : value);
+  }
+  t->stack[slot].kind = VALUE_HOME;
+}
+
+// Slots an instruction left to run() pushes, less the ones it pops
+static int stackEffect(uint8_t *code) {
+  switch (code[0]) {
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -code[1];
+  case OP_INVOKE:
+    return -code[2];
+  case OP_INVOKE_LONG:
+    return -code[4];
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG:
+  case OP_CLASS:
+  case OP_CLASS_LONG:
+    return 1;
+  case OP_METHOD:
+  case OP_METHOD_LONG:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG:
+  case OP_CLOSE_UPVALUE:
+    return -1;
+  default:
+    return 0;
+  }
+}
+
+static uint8_t genericOp(uint8_t op) {
+  switch (op) {
+  case OP_ADD_NUM_NUM:
+  case OP_ADD_STR_STR:
+    return OP_ADD;
+  case OP_SUBTRACT_NUM:
+    return OP_SUBTRACT;
+  case OP_MULTIPLY_NUM:
+    return OP_MULTIPLY;
+  case OP_DIVIDE_NUM:
+    return OP_DIVIDE;
+  case OP_GREATER_NUM:
+    return OP_GREATER;
+  case OP_LESS_NUM:
+    return OP_LESS;
+  case OP_NEGATE_NUM:
+    return OP_NEGATE;
+  default:
+    return op;
+  }
+}
+
+static void translateInstruction(Translator *t, int offset) {
+  uint8_t *code = t->chunk->code + offset;
+  int next = offset + instructionLength(t->chunk, offset);
+  uint8_t op = genericOp(code[0]);
+  int top = t->depth - 1;
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+    push(t, VALUE_CONSTANT, readSlot(code, op == OP_CONSTANT_LONG));
+    break;
+  case OP_NIL:
+    push(t, VALUE_NIL, 0);
+    break;
+  case OP_TRUE:
+    push(t, VALUE_TRUE, 0);
+    break;
+  case OP_FALSE:
+    push(t, VALUE_FALSE, 0);
+    break;
+  case OP_POP:
+    t->depth--;
+    t->resultPc = t->comparePc = -1;
+    break;
+  case OP_GET_LOCAL:
+    materialize(t, code[1]);
+    push(t, VALUE_SLOT, code[1]);
+    break;
+  case OP_SET_LOCAL:
+    setLocal(t, code[1], offset);
+    break;
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+    emit(t, REG_DEFINE_GLOBAL, 0, reg(t, top), 0,
+         readSlot(code, op == OP_DEFINE_GLOBAL_LONG));
+    t->depth--;
+    break;
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG: {
+    int pc = emit(t, REG_GET_GLOBAL, t->depth, 0, 0,
+                  readSlot(code, op == OP_GET_GLOBAL_LONG));
+    addExit(t, pc, offset);
+    push(t, VALUE_HOME, 0);
+    t->resultPc = pc;
+    break;
+  }
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG: {
+    int pc = emit(t, REG_SET_GLOBAL, 0, reg(t, top), 0,
+                  readSlot(code, op == OP_SET_GLOBAL_LONG));
+    addExit(t, pc, offset);
+    break;
+  }
+  case OP_GET_UPVALUE:
+    t->resultPc = emit(t, REG_GET_UPVALUE, t->depth, code[1], 0, 0);
+    push(t, VALUE_HOME, 0);
+    break;
+  case OP_SET_UPVALUE:
+    emit(t, REG_SET_UPVALUE, 0, reg(t, top), code[1], 0);
+    break;
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_EQUAL:
+    binary(t, op, offset, next);
+    break;
+  case OP_NOT: {
+    bool ofCompare = t->comparePc >= 0 && t->comparePc == t->count - 1 &&
+                     t->code[t->comparePc].a == top && !t->negated;
+    int comparePc = t->comparePc;
+    t->resultPc = emit(t, REG_NOT, top, reg(t, top), 0, 0);
+    t->stack[top].kind = VALUE_HOME;
+    if (ofCompare) {
+      t->comparePc = comparePc;
+      t->negated = true;
+    }
+    break;
+  }
+  case OP_NEGATE: {
+    int pc = emit(t, REG_NEGATE, top, reg(t, top), 0, 0);
+    addExit(t, pc, offset);
+    t->entries[next] = true;
+    t->stack[top].kind = VALUE_HOME;
+    t->resultPc = pc;
+    break;
+  }
+  case OP_PRINT:
+    emit(t, REG_PRINT, 0, reg(t, top), 0, 0);
+    t->depth--;
+    break;
+  case OP_JUMP:
+    flush(t);
+    jump(t, REG_JUMP, 0, next + ((code[1] << 8) | code[2]));
+    t->jumpDepth = t->depth;
+    t->live = false;
+    break;
+  case OP_JUMP_IF_FALSE: {
+    int target = next + ((code[1] << 8) | code[2]);
+    if (!fuseJump(t, offset, target)) {
+      flush(t);
+      jump(t, REG_JUMP_IF_FALSE, top, target);
+    }
+    break;
+  }
+  case OP_LOOP: {
+    int target = next - ((code[1] << 8) | code[2]);
+    flush(t);
+    if (t->pcs[target] < 0 || t->depths[target] != t->depth) {
+      t->failed = true;
+      break;
+    }
+    emit(t, REG_LOOP, t->depth, 0, 0, t->pcs[target]);
+    t->live = false;
+    break;
+  }
+  case OP_CALL: {
+    flush(t);
+    int base = t->depth - 1 - code[1];
+    int pc = emit(t, REG_CALL, base, code[1], 0, offset);
+    addExit(t, pc, offset);
+    t->depth = base + 1;
+    t->entries[next] = true;
+    break;
+  }
+  case OP_RETURN: {
+    int pc = emit(t, REG_RETURN, 0, reg(t, top), 0, 0);
+    addExit(t, pc, offset);
+    t->live = false;
+    break;
+  }
+  default: {
+    flush(t);
+    int pc = emit(t, REG_EXIT, 0, 0, 0, 0);
+    addExit(t, pc, offset);
+    t->depth += stackEffect(code);
+    if (t->depth < 0 || t->depth >= UINT8_MAX - 1)
+      t->failed = true;
+    for (int slot = 0; slot < t->depth; slot++)
+      t->stack[slot].kind = VALUE_HOME;
+    t->entries[next] = true;
+    break;
+  }
+  }
+}
+
+static void freeTranslator(Translator *t) {
+  free(t->fixups);
+  free(t->stubs);
+  free(t->labels);
+  free(t->loops);
+  free(t->depths);
+  free(t->pcs);
+  free(t->entries);
+}
+
+static RegCode *translate(Chunk *chunk, int depth) {
+  RegCode *result = (RegCode *)calloc(1, sizeof(RegCode));
+  Translator t;
+  memset(&t, 0, sizeof(t));
+  t.chunk = chunk;
+  size_t count = chunk->count + 1;
+  t.labels = (bool *)calloc(count, sizeof(bool));
+  t.loops = (bool *)calloc(count, sizeof(bool));
+  t.depths = (int *)malloc(sizeof(int) * count);
+  t.pcs = (int *)malloc(sizeof(int) * count);
+  t.entries = (bool *)calloc(count, sizeof(bool));
+  if (result == NULL || t.labels == NULL || t.loops == NULL ||
+      t.depths == NULL ||
+      t.pcs == NULL || t.entries == NULL)
+    exit(1);
+  for (size_t i = 0; i < count; i++)
+    t.depths[i] = t.pcs[i] = -1;
+  for (int offset = 0; offset < (int)chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t *code = chunk->code + offset;
+    int distance = (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE ||
+                    code[0] == OP_LOOP)
+                       ? (code[1] << 8) | code[2]
+                       : 0;
+    if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE)
+      t.labels[offset + 3 + distance] = true;
+    else if (code[0] == OP_LOOP)
+      t.labels[offset + 3 - distance] = t.loops[offset + 3 - distance] = true;
+  }
+
+  // Frames start with the callee and its arguments in place
+  for (int slot = 0; slot < depth; slot++)
+    t.stack[slot].kind = VALUE_HOME;
+  t.depth = depth;
+  t.live = true;
+  t.jumpDepth = -1;
+  t.entries[0] = true;
+  t.resultPc = t.comparePc = -1;
+  for (int offset = 0; offset < (int)chunk->count && !t.failed;
+       offset += instructionLength(chunk, offset)) {
+    if (t.labels[offset]) {
+      t.resultPc = t.comparePc = -1;
+      if (t.live) {
+        flush(&t);
+        setLabelDepth(&t, offset);
+      } else if (t.depths[offset] >= 0 ||
+                 (t.loops[offset] && t.jumpDepth >= 0)) {
+        if (t.depths[offset] < 0)
+          t.depths[offset] = t.jumpDepth;
+        t.live = true;
+        t.depth = t.depths[offset];
+        for (int slot = 0; slot < t.depth; slot++)
+          t.stack[slot].kind = VALUE_HOME;
+      }
+    }
+    if (!t.live)
+      continue;
+    t.pcs[offset] = t.count;
+    translateInstruction(&t, offset);
+  }
+
+  for (int i = 0; i < t.fixupCount && !t.failed; i++) {
+    int pc = t.pcs[t.fixups[i].target];
+    t.failed = pc < 0;
+    t.code[t.fixups[i].pc].x = pc;
+  }
+  result->entries = (int *)malloc(sizeof(int) * count);
+  if (result->entries == NULL)
+    exit(1);
+  for (size_t i = 0; i < count; i++)
+    result->entries[i] = t.entries[i] ? t.pcs[i] : -1;
+  for (int i = 0; i < t.stubCount && !t.failed; i++) {
+    Stub *stub = &t.stubs[i];
+    result->entries[stub->offset] = t.count;
+    for (int j = 0; j < stub->count; j++) {
+      RegInstr *instr = &stub->code[j];
+      int pc = emit(&t, instr->op, instr->a, instr->b, instr->c, instr->x);
+      if (instr->op == REG_JUMP_IF_FALSE)
+        t.code[pc].x = t.pcs[stub->target];
+    }
+    emit(&t, REG_JUMP, 0, 0, 0, stub->resume);
+  }
+  freeTranslator(&t);
+
+  if (t.failed) {
+    free(t.code);
+    free(t.exits);
+    free(t.exitList);
+    free(t.moves);
+    free(result->entries);
+    result->entries = NULL;
+    return result;
+  }
+  result->code = t.code;
+  result->exits = t.exits;
+  result->exitList = t.exitList;
+  result->moves = t.moves;
+  return result;
+}
+
+// The register form of the frame's chunk, translated on first use. NULL
+// where it is left to the stack VM
+static RegCode *registerCode(CallFrame *frame) {
+  Chunk *chunk = frame->chunk;
+  if (chunk->regCode == NULL) {
+    int depth =
+        frame->closure == NULL ? 0 : frame->closure->function->arity + 1;
+    chunk->regCode = translate(chunk, depth);
+  }
+  return chunk->regCode->code == NULL ? NULL : chunk->regCode;
+}
+
+void freeRegCode(RegCode *code) {
+  if (code == NULL)
+    return;
+  free(code->code);
+  free(code->exits);
+  free(code->exitList);
+  free(code->moves);
+  free(code->entries);
+  free(code);
+}
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+uint8_t *registerRun(VM *vm, uint8_t *ip) {
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  RegCode *code = registerCode(frame);
+  int entry = code == NULL ? -1 : code->entries[ip - frame->chunk->code];
+  if (entry < 0)
+    return ip;
+  RegInstr *pc = code->code + entry;
+  RegInstr *instr;
+  Value *slots = frame->slots;
+  Value *constants = frame->chunk->constants.values;
+
+#define R(index) slots[index]
+#define K(index) constants[index]
+// Anything but two numbers is left to run(), for strings or the type error
+#define BINARY(valueType, op, right)                                           \
+  do {                                                                         \
+    Value b = R(instr->b);                                                     \
+    Value c = right;                                                           \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c))                                        \
+      goto leave;                                                              \
+    R(instr->a) = valueType(AS_NUMBER(b) op AS_NUMBER(c));                     \
+    DISPATCH();                                                                \
+  } while (false)
+#define TEST(op, right)                                                        \
+  do {                                                                         \
+    Value b = R(instr->b);                                                     \
+    Value c = right;                                                           \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c))                                        \
+      goto leave;                                                              \
+    if ((AS_NUMBER(b) op AS_NUMBER(c)) == instr->a)                            \
+      pc = code->code + instr->x;                                              \
+    DISPATCH();                                                                \
+  } while (false)
+
+#ifdef COMPUTED_GOTO
+  static void *dispatchTable[] = {
+      [REG_MOVE] = &&reg_MOVE,
+      [REG_LOADK] = &&reg_LOADK,
+      [REG_NIL] = &&reg_NIL,
+      [REG_TRUE] = &&reg_TRUE,
+      [REG_FALSE] = &&reg_FALSE,
+      [REG_GET_GLOBAL] = &&reg_GET_GLOBAL,
+      [REG_SET_GLOBAL] = &&reg_SET_GLOBAL,
+      [REG_DEFINE_GLOBAL] = &&reg_DEFINE_GLOBAL,
+      [REG_GET_UPVALUE] = &&reg_GET_UPVALUE,
+      [REG_SET_UPVALUE] = &&reg_SET_UPVALUE,
+      [REG_ADD] = &&reg_ADD,
+      [REG_SUBTRACT] = &&reg_SUBTRACT,
+      [REG_MULTIPLY] = &&reg_MULTIPLY,
+      [REG_DIVIDE] = &&reg_DIVIDE,
+      [REG_GREATER] = &&reg_GREATER,
+      [REG_LESS] = &&reg_LESS,
+      [REG_EQUAL] = &&reg_EQUAL,
+      [REG_ADDK] = &&reg_ADDK,
+      [REG_SUBTRACTK] = &&reg_SUBTRACTK,
+      [REG_MULTIPLYK] = &&reg_MULTIPLYK,
+      [REG_DIVIDEK] = &&reg_DIVIDEK,
+      [REG_GREATERK] = &&reg_GREATERK,
+      [REG_LESSK] = &&reg_LESSK,
+      [REG_EQUALK] = &&reg_EQUALK,
+      [REG_NOT] = &&reg_NOT,
+      [REG_NEGATE] = &&reg_NEGATE,
+      [REG_PRINT] = &&reg_PRINT,
+      [REG_JUMP] = &&reg_JUMP,
+      [REG_JUMP_IF_FALSE] = &&reg_JUMP_IF_FALSE,
+      [REG_TEST_GREATER] = &&reg_TEST_GREATER,
+      [REG_TEST_LESS] = &&reg_TEST_LESS,
+      [REG_TEST_EQUAL] = &&reg_TEST_EQUAL,
+      [REG_TEST_GREATERK] = &&reg_TEST_GREATERK,
+      [REG_TEST_LESSK] = &&reg_TEST_LESSK,
+      [REG_TEST_EQUALK] = &&reg_TEST_EQUALK,
+      [REG_LOOP] = &&reg_LOOP,
+      [REG_CALL] = &&reg_CALL,
+      [REG_RETURN] = &&reg_RETURN,
+      [REG_EXIT] = &&reg_EXIT,
+  };
+  // Same shape, every instruction is counted first, see --vm-stats
+  static void *countTable[] = {
+      [0 ... sizeof(dispatchTable) / sizeof(dispatchTable[0]) - 1] =
+          &&countInstruction,
+  };
+  void **table = vm->countInstructions ? countTable : dispatchTable;
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) reg_##name
+#define DISPATCH() goto *table[(instr = pc++)->op]
+#else
+  bool count = vm->countInstructions;
+
+#define INTERPRET_LOOP                                                         \
+  loop:                                                                        \
+  instr = pc++;                                                                \
+  if (count)                                                                   \
+    vm->vmStats.registerInstructions++;                                        \
+  switch (instr->op)
+#define CASE(name) case REG_##name
+#define DISPATCH() goto loop
+#endif
+
+  INTERPRET_LOOP {
+#ifdef COMPUTED_GOTO
+  countInstruction:
+    vm->vmStats.registerInstructions++;
+    goto *dispatchTable[instr->op];
+#endif
+    CASE(MOVE) : {
+      R(instr->a) = R(instr->b);
+      DISPATCH();
+    }
+    CASE(LOADK) : {
+      R(instr->a) = K(instr->x);
+      DISPATCH();
+    }
+    CASE(NIL) : {
+      R(instr->a) = NIL_VAL;
+      DISPATCH();
+    }
+    CASE(TRUE) : {
+      R(instr->a) = BOOL_VAL(true);
+      DISPATCH();
+    }
+    CASE(FALSE) : {
+      R(instr->a) = BOOL_VAL(false);
+      DISPATCH();
+    }
+    // An undefined global is reported by run()
+    CASE(GET_GLOBAL) : {
+      Value value = vm->globalValues.values[instr->x];
+      if (IS_UNDEFINED(value))
+        goto leave;
+      R(instr->a) = value;
+      DISPATCH();
+    }
+    CASE(SET_GLOBAL) : {
+      if (IS_UNDEFINED(vm->globalValues.values[instr->x]))
+        goto leave;
+      vm->globalValues.values[instr->x] = R(instr->b);
+      writeBarrier(vm, NULL, R(instr->b));
+      DISPATCH();
+    }
+    CASE(DEFINE_GLOBAL) : {
+      vm->globalValues.values[instr->x] = R(instr->b);
+      writeBarrier(vm, NULL, R(instr->b));
+      DISPATCH();
+    }
+    CASE(GET_UPVALUE) : {
+      R(instr->a) = *frame->closure->upvalues[instr->b]->location;
+      DISPATCH();
+    }
+    CASE(SET_UPVALUE) : {
+      ObjUpvalue *upvalue = frame->closure->upvalues[instr->c];
+      *upvalue->location = R(instr->b);
+      writeBarrier(vm, (Obj *)upvalue, R(instr->b));
+      DISPATCH();
+    }
+    CASE(ADD) : BINARY(NUMBER_VAL, +, R(instr->c));
+    CASE(SUBTRACT) : BINARY(NUMBER_VAL, -, R(instr->c));
+    CASE(MULTIPLY) : BINARY(NUMBER_VAL, *, R(instr->c));
+    CASE(DIVIDE) : BINARY(NUMBER_VAL, /, R(instr->c));
+    CASE(GREATER) : BINARY(BOOL_VAL, >, R(instr->c));
+    CASE(LESS) : BINARY(BOOL_VAL, <, R(instr->c));
+    CASE(EQUAL) : {
+      R(instr->a) = BOOL_VAL(valuesEqual(R(instr->b), R(instr->c)));
+      DISPATCH();
+    }
+    CASE(ADDK) : BINARY(NUMBER_VAL, +, K(instr->x));
+    CASE(SUBTRACTK) : BINARY(NUMBER_VAL, -, K(instr->x));
+    CASE(MULTIPLYK) : BINARY(NUMBER_VAL, *, K(instr->x));
+    CASE(DIVIDEK) : BINARY(NUMBER_VAL, /, K(instr->x));
+    CASE(GREATERK) : BINARY(BOOL_VAL, >, K(instr->x));
+    CASE(LESSK) : BINARY(BOOL_VAL, <, K(instr->x));
+    CASE(EQUALK) : {
+      R(instr->a) = BOOL_VAL(valuesEqual(R(instr->b), K(instr->x)));
+      DISPATCH();
+    }
+    CASE(NOT) : {
+      R(instr->a) = BOOL_VAL(isFalsey(R(instr->b)));
+      DISPATCH();
+    }
+    CASE(NEGATE) : {
+      if (!IS_NUMBER(R(instr->b)))
+        goto leave;
+      R(instr->a) = NUMBER_VAL(-AS_NUMBER(R(instr->b)));
+      DISPATCH();
+    }
+    CASE(PRINT) : {
+      printValue(R(instr->b));
+      printf("\n");
+      DISPATCH();
+    }
+    CASE(JUMP) : {
+      pc = code->code + instr->x;
+      DISPATCH();
+    }
+    CASE(JUMP_IF_FALSE) : {
+      if (isFalsey(R(instr->b)))
+        pc = code->code + instr->x;
+      DISPATCH();
+    }
+    CASE(TEST_GREATER) : TEST(>, R(instr->c));
+    CASE(TEST_LESS) : TEST(<, R(instr->c));
+    CASE(TEST_EQUAL) : {
+      if (valuesEqual(R(instr->b), R(instr->c)) == instr->a)
+        pc = code->code + instr->x;
+      DISPATCH();
+    }
+    CASE(TEST_GREATERK) : TEST(>, K(instr->c));
+    CASE(TEST_LESSK) : TEST(<, K(instr->c));
+    CASE(TEST_EQUALK) : {
+      if (valuesEqual(R(instr->b), K(instr->c)) == instr->a)
+        pc = code->code + instr->x;
+      DISPATCH();
+    }
+    CASE(LOOP) : {
+      pc = code->code + instr->x;
+      // NOTE: safepoint, every value is in its slot at a back edge
+      if (vm->gcRequested) {
+        vm->stackTop = slots + instr->a;
+        collectAtSafepoint(vm);
+      }
+      DISPATCH();
+    }
+    // Calls of closures with the right argument count, everything else and
+    // the errors are left to run()
+    CASE(CALL) : {
+      Value callee = R(instr->a);
+      int argCount = instr->b;
+      if (!IS_CLOSURE(callee) ||
+          AS_CLOSURE(callee)->function->arity != argCount ||
+          vm->frameCount == vm->frameCapacity ||
+          vm->stackLimit - (slots + instr->a + argCount + 1) <
+              STACK_HEADROOM)
+        goto leave;
+      frame->ip = frame->chunk->code + instr->x + 2;
+      ObjClosure *closure = AS_CLOSURE(callee);
+      frame = &vm->frames[vm->frameCount++];
+      frame->closure = closure;
+      frame->chunk = &closure->function->chunk;
+      frame->ip = frame->chunk->code;
+      frame->slots = slots + instr->a;
+      slots = frame->slots;
+      vm->stackTop = slots + argCount + 1;
+      // NOTE: safepoint, like OP_CALL in run()
+      if (vm->gcRequested)
+        collectAtSafepoint(vm);
+      code = registerCode(frame);
+      if (code == NULL)
+        return frame->ip;
+      pc = code->code;
+      constants = frame->chunk->constants.values;
+      DISPATCH();
+    }
+    // The script's return, and returns that have upvalues to close, are
+    // left to run()
+    CASE(RETURN) : {
+      if (frame->closure == NULL ||
+          (vm->openUpvalues != NULL && vm->openUpvalues->location >= slots))
+        goto leave;
+      slots[0] = R(instr->b);
+      vm->stackTop = slots + 1;
+      vm->frameCount--;
+      frame = &vm->frames[vm->frameCount - 1];
+      code = registerCode(frame);
+      entry = code == NULL ? -1 : code->entries[frame->ip - frame->chunk->code];
+      if (entry < 0)
+        return frame->ip;
+      pc = code->code + entry;
+      slots = frame->slots;
+      constants = frame->chunk->constants.values;
+      DISPATCH();
+    }
+    CASE(EXIT) : goto leave;
+  }
+
+leave: {
+  // Every value back into its slot, then run() takes the instruction
+  RegExit *exit = &code->exitList[code->exits[instr - code->code]];
+  for (int i = 0; i < exit->moveCount; i++) {
+    RegMove *move = &code->moves[exit->firstMove + i];
+    Value value;
+    switch (move->value.kind) {
+    case VALUE_SLOT:
+      value = R(move->value.index);
+      break;
+    case VALUE_CONSTANT:
+      value = K(move->value.index);
+      break;
+    case VALUE_NIL:
+      value = NIL_VAL;
+      break;
+    case VALUE_TRUE:
+      value = BOOL_VAL(true);
+      break;
+    default:
+      value = BOOL_VAL(false);
+      break;
+    }
+    R(move->slot) = value;
+  }
+  vm->stackTop = slots + exit->depth;
+  return frame->chunk->code + exit->offset;
+}
+
+#undef R
+#undef K
+#undef BINARY
+#undef TEST
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
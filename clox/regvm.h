@@ -0,0 +1,84 @@
+#ifndef clox_regvm_h
+#define clox_regvm_h
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+// Register VM, see --register-vm. A chunk is translated on its first run to
+// three address instructions that read and write frame slots directly: the
+// locals, and the temporaries the stack VM would have pushed above them, are
+// all registers. Copies the stack VM makes (a local pushed only to be added,
+// a constant pushed only to be compared) are folded into the operands of the
+// instruction using them.
+//
+// Instructions with no register form (closures, classes, properties, tail
+// calls), and register instructions whose type guard fails, are left to
+// run(). The values the register code kept out of their stack slots are put
+// back first, so run() finds the stack as it would have built it.
+typedef enum {
+  REG_MOVE,          // R[a] = R[b]
+  REG_LOADK,         // R[a] = K[x]
+  REG_NIL,           // R[a] = nil
+  REG_TRUE,          // R[a] = true
+  REG_FALSE,         // R[a] = false
+  REG_GET_GLOBAL,    // R[a] = global x
+  REG_SET_GLOBAL,    // global x = R[b]
+  REG_DEFINE_GLOBAL, // global x = R[b], even if undefined
+  REG_GET_UPVALUE,   // R[a] = upvalue b
+  REG_SET_UPVALUE,   // upvalue c = R[b]
+  REG_ADD,           // R[a] = R[b] + R[c], and so on
+  REG_SUBTRACT,
+  REG_MULTIPLY,
+  REG_DIVIDE,
+  REG_GREATER,
+  REG_LESS,
+  REG_EQUAL,
+  REG_ADDK, // R[a] = R[b] + K[x], and so on
+  REG_SUBTRACTK,
+  REG_MULTIPLYK,
+  REG_DIVIDEK,
+  REG_GREATERK,
+  REG_LESSK,
+  REG_EQUALK,
+  REG_NOT,    // R[a] = !R[b]
+  REG_NEGATE, // R[a] = -R[b]
+  REG_PRINT,  // print R[b]
+  REG_JUMP,   // pc = x
+  REG_JUMP_IF_FALSE, // if R[b] is falsey, pc = x
+  // Comparison fused with the OP_JUMP_IF_FALSE using it: if the comparison
+  // of R[b] and R[c] is a (0 or 1), pc = x. a is 1 where the comparison was
+  // negated with OP_NOT first
+  REG_TEST_GREATER,
+  REG_TEST_LESS,
+  REG_TEST_EQUAL,
+  // Same against K[c], for constants with an 8 bit index
+  REG_TEST_GREATERK,
+  REG_TEST_LESSK,
+  REG_TEST_EQUALK,
+  REG_LOOP,   // pc = x, a safepoint with a slots in use
+  REG_CALL,   // calls R[a] with the b registers above it as arguments
+  REG_RETURN, // returns R[b]
+  REG_EXIT,   // leaves the instruction to run()
+} RegOp;
+
+// Registers are frame slots, so a function using more than 255 of them is
+// left to the stack VM
+typedef struct {
+  uint8_t op;
+  uint8_t a;
+  uint8_t b;
+  uint8_t c;
+  int32_t x;
+} RegInstr;
+
+typedef struct RegCode RegCode;
+
+// Runs the register form of the top frame from ip, an instruction boundary of
+// its chunk, until an instruction it leaves to run(). Calls and returns
+// between functions that have a register form stay in here. Returns the ip
+// run() goes on from in what is then the top frame
+uint8_t *registerRun(VM *vm, uint8_t *ip);
+void freeRegCode(RegCode *code);
+
+#endif
@@ -89,7 +89,109 @@ static void skipWhitespace(Scanner *scanner) {
   }
 }
 
+static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+static bool isAlpha(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static TokenType checkKeyword(Scanner *scanner, int start, int length,
+                              const char *rest, TokenType type) {
+  if (scanner->current - scanner->start == start + length &&
+      memcmp(scanner->start + start, rest, length) == 0) {
+    return type;
+  }
+  return TOKEN_IDENTIFIER;
+}
+
+// NOTE: a small hand written trie, we switch on the first letter (and the
+// second one when several keywords share it) and then compare the rest
+static TokenType identifierType(Scanner *scanner) {
+  switch (scanner->start[0]) {
+  case 'a':
+    return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
+  case 'c':
+    return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+  case 'e':
+    return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
+  case 'f':
+    if (scanner->current - scanner->start > 1) {
+      switch (scanner->start[1]) {
+      case 'a':
+        return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+      case 'o':
+        return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
+      case 'u':
+        return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
+      }
+    }
+    break;
+  case 'i':
+    return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
+  case 'n':
+    return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
+  case 'o':
+    return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
+  case 'p':
+    return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+  case 'r':
+    return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+  case 's':
+    return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
+  case 't':
+    if (scanner->current - scanner->start > 1) {
+      switch (scanner->start[1]) {
+      case 'h':
+        return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
+      case 'r':
+        return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
+      }
+    }
+    break;
+  case 'v':
+    return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
+  case 'w':
+    return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
+  }
+  return TOKEN_IDENTIFIER;
+}
+
+static Token identifier(Scanner *scanner) {
+  while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) {
+    advance(scanner);
+  }
+  return makeToken(scanner, identifierType(scanner));
+}
+
+static Token number(Scanner *scanner) {
+  while (isDigit(peek(scanner))) {
+    advance(scanner);
+  }
+  // Look for a fractional part, the dot must be followed by a digit
+  if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+    advance(scanner); // Consume the '.'
+    while (isDigit(peek(scanner))) {
+      advance(scanner);
+    }
+  }
+  return makeToken(scanner, TOKEN_NUMBER);
+}
+
+static Token string(Scanner *scanner) {
+  while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+    if (peek(scanner) == '\n')
+      scanner->line++;
+    advance(scanner);
+  }
+  if (isAtEnd(scanner)) {
+    return errorToken(scanner, "Unterminated string.");
+  }
+  advance(scanner); // Consume the closing '"'
+  return makeToken(scanner, TOKEN_STRING);
+}
+
 Token scanToken(Scanner *scanner) {
+  skipWhitespace(scanner);
   scanner->start = scanner->current;
 
   if (isAtEnd(scanner)) {
@@ -97,6 +199,12 @@ Token scanToken(Scanner *scanner) {
   }
 
   char c = advance(scanner);
+  if (isAlpha(c)) {
+    return identifier(scanner);
+  }
+  if (isDigit(c)) {
+    return number(scanner);
+  }
   switch (c) {
   case '(':
     return makeToken(scanner, TOKEN_LEFT_PAREN);
@@ -132,7 +240,9 @@ Token scanToken(Scanner *scanner) {
   case '<':
     return makeToken(scanner,
                      match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-
-    return errorToken(scanner, "Unexpected character");
+  case '"':
+    return string(scanner);
   }
+
+  return errorToken(scanner, "Unexpected character.");
 }
@@ -0,0 +1,152 @@
+#include "table.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include <string.h>
+
+#define TABLE_MAX_LOAD 0.75
+
+void initTable(Table *table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+}
+
+void freeTable(Table *table) {
+  FREE_ARRAY(Entry, table->entries, table->capacity);
+  initTable(table);
+}
+
+// Returns the bucket holding key, or the bucket where it should be inserted
+// (reusing the first tombstone found on the way)
+static Entry *findEntry(Entry *entries, size_t capacity, ObjString *key) {
+  // NOTE: capacity is always a power of two so the modulo is a mask
+  size_t index = key->hash & (capacity - 1);
+  Entry *tombstone = NULL;
+  for (;;) {
+    Entry *entry = &entries[index];
+    if (entry->key == NULL) {
+      if (IS_NIL(entry->value)) {
+        return tombstone != NULL ? tombstone : entry;
+      } else if (tombstone == NULL) {
+        tombstone = entry;
+      }
+    } else if (entry->key == key) { // NOTE: keys are interned, see copyString
+      return entry;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void adjustCapacity(Table *table, size_t capacity) {
+  Entry *entries = GROW_ARRAY(Entry, NULL, 0, capacity);
+  for (size_t i = 0; i < capacity; i++) {
+    entries[i].key = NULL;
+    entries[i].value = NIL_VAL;
+  }
+
+  // Tombstones are not copied over so the count is rebuilt from scratch
+  table->count = 0;
+  for (size_t i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (entry->key == NULL)
+      continue;
+    Entry *dest = findEntry(entries, capacity, entry->key);
+    dest->key = entry->key;
+    dest->value = entry->value;
+    table->count++;
+  }
+
+  FREE_ARRAY(Entry, table->entries, table->capacity);
+  table->entries = entries;
+  table->capacity = capacity;
+}
+
+bool tableGet(Table *table, ObjString *key, Value *value) {
+  if (table->count == 0)
+    return false;
+  Entry *entry = findEntry(table->entries, table->capacity, key);
+  if (entry->key == NULL)
+    return false;
+  *value = entry->value;
+  return true;
+}
+
+// Returns true when key was not already in the table
+bool tableSet(Table *table, ObjString *key, Value value) {
+  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+    adjustCapacity(table, GROW_CAPACITY(table->capacity));
+  }
+  Entry *entry = findEntry(table->entries, table->capacity, key);
+  bool isNewKey = entry->key == NULL;
+  if (isNewKey && IS_NIL(entry->value)) // reused tombstones are already counted
+    table->count++;
+  entry->key = key;
+  entry->value = value;
+  return isNewKey;
+}
+
+bool tableDelete(Table *table, ObjString *key) {
+  if (table->count == 0)
+    return false;
+  Entry *entry = findEntry(table->entries, table->capacity, key);
+  if (entry->key == NULL)
+    return false;
+  entry->key = NULL;
+  entry->value = BOOL_VAL(true);
+  return true;
+}
+
+// Looks a string up by content, used to intern strings before they exist as
+// objects. Every other lookup compares keys by pointer
+ObjString *tableFindString(Table *table, const char *chars, int length,
+                           uint32_t hash) {
+  if (table->count == 0)
+    return NULL;
+  size_t index = hash & (table->capacity - 1);
+  for (;;) {
+    Entry *entry = &table->entries[index];
+    if (entry->key == NULL) {
+      if (IS_NIL(entry->value))
+        return NULL; // NOTE: empty bucket, tombstones keep the probe going
+    } else if (entry->key->length == length && entry->key->hash == hash &&
+               memcmp(entry->key->chars, chars, length) == 0) {
+      return entry->key;
+    }
+    index = (index + 1) & (table->capacity - 1);
+  }
+}
+
+// Occupancy and probe lengths, a probe length of 1 means the key sits in its
+// home bucket
+void tableStats(Table *table, TableStats *stats) {
+  *stats = (TableStats){.capacity = table->capacity};
+  size_t totalProbes = 0;
+  for (size_t i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (entry->key == NULL) {
+      if (!IS_NIL(entry->value))
+        stats->tombstones++;
+      continue;
+    }
+    size_t home = entry->key->hash & (table->capacity - 1);
+    size_t probes = ((i - home) & (table->capacity - 1)) + 1;
+    stats->live++;
+    totalProbes += probes;
+    if (probes > stats->maxProbe)
+      stats->maxProbe = probes;
+  }
+  if (table->capacity > 0)
+    stats->loadFactor = (double)table->count / table->capacity;
+  if (stats->live > 0)
+    stats->meanProbe = (double)totalProbes / stats->live;
+}
+
+void tableAddAll(Table *from, Table *to) {
+  for (size_t i = 0; i < from->capacity; i++) {
+    Entry *entry = &from->entries[i];
+    if (entry->key != NULL) {
+      tableSet(to, entry->key, entry->value);
+    }
+  }
+}
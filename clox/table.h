@@ -0,0 +1,37 @@
+#ifndef clox_table_h
+#define clox_table_h
+
+#include "common.h"
+#include "value.h"
+
+typedef struct {
+  ObjString *key; // NULL for empty buckets and tombstones
+  Value value;    // tombstones are a NULL key with a true value
+} Entry;
+
+// Open addressing hash table with linear probing, keyed by strings
+typedef struct {
+  size_t count; // live entries plus tombstones
+  size_t capacity;
+  Entry *entries;
+} Table;
+
+typedef struct {
+  size_t live;
+  size_t tombstones;
+  size_t capacity;
+  double loadFactor; // live entries plus tombstones over capacity
+  double meanProbe;
+  size_t maxProbe;
+} TableStats;
+
+void initTable(Table *table);
+void freeTable(Table *table);
+bool tableGet(Table *table, ObjString *key, Value *value);
+bool tableSet(Table *table, ObjString *key, Value value);
+bool tableDelete(Table *table, ObjString *key);
+void tableAddAll(Table *from, Table *to);
+ObjString *tableFindString(Table *table, const char *chars, int length,
+                           uint32_t hash);
+void tableStats(Table *table, TableStats *stats);
+#endif
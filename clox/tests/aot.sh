@@ -0,0 +1,47 @@
+#!/bin/sh
+# Correctness of --emit-c: translates every script to C, builds it against
+# the runtime and compares the program's stdout, stderr and exit status
+# against the interpreter's.
+#
+#   sh tests/aot.sh [script.lox...]
+#
+# Without arguments the scripts under benches/ are used.
+set -u
+
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 $(find . -maxdepth 1 -name '*.c') -o "$OUT/clox" || exit 1
+# The runtime is built once and linked into every program
+mkdir "$OUT/runtime"
+for source in $(find . -maxdepth 1 -name '*.c' ! -name main.c); do
+  $CC -O2 -c "$source" -o "$OUT/runtime/$(basename "$source" .c).o" || exit 1
+done
+
+if [ "$#" -eq 0 ]; then
+  set -- benches/*.lox
+fi
+
+failed=0
+for script in "$@"; do
+  "$OUT/clox" --no-cache "$script" >"$OUT/interpreter.out" 2>&1
+  echo "exit $?" >>"$OUT/interpreter.out"
+  if ! "$OUT/clox" --emit-c "$script" >"$OUT/program.c" ||
+    ! $CC -O2 -I . "$OUT/program.c" "$OUT"/runtime/*.o -o "$OUT/program" -lm; then
+    echo "FAIL $script does not build"
+    failed=1
+    continue
+  fi
+  "$OUT/program" >"$OUT/native.out" 2>&1
+  echo "exit $?" >>"$OUT/native.out"
+  if cmp -s "$OUT/interpreter.out" "$OUT/native.out"; then
+    echo "ok   $script"
+  else
+    echo "FAIL $script"
+    diff "$OUT/interpreter.out" "$OUT/native.out" | head -20
+    failed=1
+  fi
+done
+exit $failed
@@ -0,0 +1,102 @@
+#include "../bytecode.h"
+#include "../compiler.h"
+#include "../vm.h"
+#include "tests.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Loads size bytes of image into a fresh VM, from a copy since the loaded
+// chunk borrows and may patch its code
+static bool loads(const uint8_t *image, size_t size) {
+  uint8_t *copy = malloc(size == 0 ? 1 : size);
+  assert(copy != NULL);
+  memcpy(copy, image, size);
+  VM vm;
+  initVM(&vm);
+  Chunk chunk;
+  initChunk(&chunk);
+  bool loaded = readBytecode(&vm, copy, size, &chunk);
+  if (loaded)
+    freeChunk(&chunk);
+  freeVM(&vm);
+  free(copy);
+  return loaded;
+}
+
+// The script's code inside the image
+static uint8_t *scriptCode(uint8_t *image, uint32_t *length) {
+  BytecodeHeader header;
+  memcpy(&header, image, sizeof(header));
+  ChunkRecord record;
+  memcpy(&record, image + header.chunkOffset, sizeof(record));
+  *length = record.codeLength;
+  return image + record.codeOffset;
+}
+
+// Sets the code byte at offset, loads, and puts the byte back
+static bool loadsWith(uint8_t *image, size_t size, int offset, uint8_t byte) {
+  uint32_t length;
+  uint8_t *code = scriptCode(image, &length);
+  assert(offset < (int)length);
+  uint8_t saved = code[offset];
+  code[offset] = byte;
+  bool loaded = loads(image, size);
+  code[offset] = saved;
+  return loaded;
+}
+
+static void test_bytecode_rejects_damage() {
+  VM vm;
+  initVM(&vm);
+  Chunk chunk;
+  initChunk(&chunk);
+  // 0: OP_CONSTANT 0, 2: OP_DEFINE_GLOBAL 0, 4: OP_GET_GLOBAL 0,
+  // 6: OP_JUMP_IF_FALSE to 14, 9: OP_POP, 10: OP_GET_GLOBAL 0, 12: OP_PRINT,
+  // 13: OP_JUMP to 17, 16: OP_POP, 17: OP_NIL, 18: OP_RETURN
+  assert(compile(&vm, "var a = 1; if (a) print a;", &chunk));
+  size_t size;
+  uint8_t *image = encodeBytecode(&vm, &chunk, &size);
+  freeChunk(&chunk);
+  freeVM(&vm);
+  uint32_t length;
+  uint8_t *code = scriptCode(image, &length);
+  assert(length == 19);
+  assert(code[6] == OP_JUMP_IF_FALSE && code[13] == OP_JUMP);
+  assert(loads(image, size));
+
+  // Truncated anywhere
+  assert(!loads(image, 0));
+  assert(!loads(image, sizeof(BytecodeHeader) - 1));
+  assert(!loads(image, sizeof(BytecodeHeader)));
+  assert(!loads(image, size / 2));
+  assert(!loads(image, size - 1));
+
+  // Unknown opcode, and a quickened one no file holds
+  assert(!loadsWith(image, size, 9, 0xff));
+  assert(!loadsWith(image, size, 9, OP_ADD_NUM_NUM));
+  // Constant and global indices out of range
+  assert(!loadsWith(image, size, 1, 200));
+  assert(!loadsWith(image, size, 5, 1));
+  // The last instruction's operand past the end of the code
+  assert(!loadsWith(image, size, 18, OP_CONSTANT));
+  // Jumps past the code, to its very end and into an operand
+  assert(!loadsWith(image, size, 8, 0xff));
+  assert(!loadsWith(image, size, 15, 3));
+  assert(!loadsWith(image, size, 8, 5));
+  // A loop back out of the code, from 6 to 9 - 20
+  code[6] = OP_LOOP;
+  assert(!loadsWith(image, size, 8, 20));
+  code[6] = OP_JUMP_IF_FALSE;
+  // Upvalues in the script, which has none
+  assert(!loadsWith(image, size, 4, OP_GET_UPVALUE));
+  // Each damaged byte was restored
+  assert(loads(image, size));
+  free(image);
+}
+
+void runBytecodeTests(void) {
+  test_bytecode_rejects_damage();
+  printf("✅ Bytecode tests passed.\n");
+}
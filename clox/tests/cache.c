@@ -0,0 +1,185 @@
+#include "../bytecode.h"
+#include "../cache.h"
+#include "../object.h"
+#include "../vm.h"
+#include "tests.h"
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_DIR "cache"
+
+// Runs source in a fresh VM through the cache, returns the global a
+static double runCached(const char *source) {
+  VM vm;
+  initVM(&vm);
+  assert(interpretCached(&vm, source) == INTERPRET_OK);
+  int slot = globalSlot(&vm, copyString(&vm, "a", 1));
+  Value a = vm.globalValues.values[slot];
+  assert(IS_NUMBER(a));
+  freeVM(&vm);
+  return AS_NUMBER(a);
+}
+
+// The one entry in the cache, asserting there is exactly one
+static void onlyEntry(char *path, size_t size) {
+  DIR *dir = opendir(CACHE_DIR);
+  assert(dir != NULL);
+  int count = 0;
+  struct dirent *item;
+  while ((item = readdir(dir)) != NULL) {
+    if (item->d_name[0] == '.')
+      continue;
+    snprintf(path, size, "%s/%s", CACHE_DIR, item->d_name);
+    count++;
+  }
+  closedir(dir);
+  assert(count == 1);
+}
+
+static int entryCount(void) {
+  DIR *dir = opendir(CACHE_DIR);
+  assert(dir != NULL);
+  int count = 0;
+  struct dirent *item;
+  while ((item = readdir(dir)) != NULL)
+    count += item->d_name[0] != '.';
+  closedir(dir);
+  return count;
+}
+
+static void setMtime(const char *path, time_t seconds) {
+  struct timespec times[2] = {{seconds, 0}, {seconds, 0}};
+  assert(utimensat(AT_FDCWD, path, times, 0) == 0);
+}
+
+static time_t mtimeOf(const char *path) {
+  struct stat info;
+  assert(stat(path, &info) == 0);
+  return info.st_mtime;
+}
+
+static void emptyCache(void) {
+  DIR *dir = opendir(CACHE_DIR);
+  assert(dir != NULL);
+  char path[512];
+  struct dirent *item;
+  while ((item = readdir(dir)) != NULL) {
+    if (item->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, item->d_name);
+    unlink(path);
+  }
+  closedir(dir);
+}
+
+// A hit must refresh the entry's mtime, also with a relative cache directory
+static void test_cache_hit_refreshes_entry() {
+  assert(runCached("var a = 1;") == 1);
+  char path[512];
+  onlyEntry(path, sizeof(path));
+  setMtime(path, 1000);
+  assert(runCached("var a = 1;") == 1);
+  assert(mtimeOf(path) > 1000);
+  emptyCache();
+}
+
+// A new entry past CACHE_MAX_ENTRIES evicts the least recently used ones
+static void test_cache_evicts_oldest() {
+  char path[512];
+  for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+    snprintf(path, sizeof(path), "%s/%016x-1.loxc", CACHE_DIR, i);
+    FILE *file = fopen(path, "wb");
+    assert(file != NULL);
+    fclose(file);
+    setMtime(path, 1000 + i);
+  }
+  assert(runCached("var a = 2;") == 2);
+  assert(entryCount() == CACHE_MAX_ENTRIES);
+  snprintf(path, sizeof(path), "%s/%016x-1.loxc", CACHE_DIR, 0);
+  assert(access(path, F_OK) != 0);
+  snprintf(path, sizeof(path), "%s/%016x-1.loxc", CACHE_DIR, 1);
+  assert(access(path, F_OK) == 0);
+  emptyCache();
+}
+
+static size_t readFile(const char *path, uint8_t *bytes, size_t size) {
+  FILE *file = fopen(path, "rb");
+  assert(file != NULL);
+  size_t length = fread(bytes, 1, size, file);
+  fclose(file);
+  return length;
+}
+
+static void writeFile(const char *path, const uint8_t *bytes, size_t size) {
+  FILE *file = fopen(path, "wb");
+  assert(file != NULL);
+  assert(fwrite(bytes, 1, size, file) == size);
+  fclose(file);
+}
+
+// A damaged entry must not run: the script is compiled again and the entry
+// rewritten
+static void test_cache_replaces_damaged_entry() {
+  assert(runCached("var a = 3;") == 3);
+  char path[512];
+  onlyEntry(path, sizeof(path));
+  uint8_t good[4096], bytes[4096];
+  size_t size = readFile(path, good, sizeof(good));
+  assert(size > sizeof(BytecodeHeader) && size < sizeof(good));
+
+  // The operand of the script's first OP_CONSTANT, past the constant pool
+  memcpy(bytes, good, size);
+  BytecodeHeader header;
+  memcpy(&header, bytes, sizeof(header));
+  ChunkRecord record;
+  memcpy(&record, bytes + header.chunkOffset, sizeof(record));
+  assert(bytes[record.codeOffset] == OP_CONSTANT);
+  bytes[record.codeOffset + 1] = 200;
+  writeFile(path, bytes, size);
+  assert(runCached("var a = 3;") == 3);
+  assert(readFile(path, bytes, sizeof(bytes)) == size);
+  assert(memcmp(bytes, good, size) == 0);
+
+  // Truncated, and not bytecode at all
+  writeFile(path, good, size / 2);
+  assert(runCached("var a = 3;") == 3);
+  assert(readFile(path, bytes, sizeof(bytes)) == size);
+  writeFile(path, (const uint8_t *)"print \"foreign\";", 16);
+  assert(runCached("var a = 3;") == 3);
+  assert(readFile(path, bytes, sizeof(bytes)) == size);
+  assert(memcmp(bytes, good, size) == 0);
+  emptyCache();
+}
+
+void runCacheTests(void) {
+  // Everything happens in a scratch directory, the cache relative to it
+  char scratch[] = "/tmp/clox-cache-test-XXXXXX";
+  assert(mkdtemp(scratch) != NULL);
+  char cwd[4096];
+  assert(getcwd(cwd, sizeof(cwd)) != NULL);
+  assert(chdir(scratch) == 0);
+  const char *saved = getenv("CLOX_CACHE_DIR");
+  char *savedCopy = saved == NULL ? NULL : strdup(saved);
+  setenv("CLOX_CACHE_DIR", CACHE_DIR, 1);
+
+  test_cache_hit_refreshes_entry();
+  test_cache_evicts_oldest();
+  test_cache_replaces_damaged_entry();
+
+  if (savedCopy == NULL) {
+    unsetenv("CLOX_CACHE_DIR");
+  } else {
+    setenv("CLOX_CACHE_DIR", savedCopy, 1);
+    free(savedCopy);
+  }
+  rmdir(CACHE_DIR);
+  assert(chdir(cwd) == 0);
+  rmdir(scratch);
+  printf("✅ Cache tests passed.\n");
+}
@@ -0,0 +1,120 @@
+#include "../chunk.h"
+#include "../compiler.h"
+#include "../vm.h"
+#include "tests.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Writes count bytes compiled from line
+static void writeLine(Chunk *chunk, int count, int line) {
+  for (int i = 0; i < count; i++)
+    writeChunk(chunk, OP_NIL, line);
+}
+
+static void test_chunk_line_runs() {
+  Chunk chunk;
+  initChunk(&chunk);
+  // Lines can go back, e.g. the closing parts of a multi line expression
+  writeLine(&chunk, 3, 1);  // 0..2
+  writeLine(&chunk, 1, 2);  // 3
+  writeLine(&chunk, 6, 5);  // 4..9
+  writeLine(&chunk, 1, 3);  // 10
+  writeLine(&chunk, 2, 1);  // 11..12
+  assert(chunk.lineCount == 5);
+
+  const int firsts[] = {0, 3, 4, 10, 11};
+  const int lasts[] = {2, 3, 9, 10, 12};
+  const int lines[] = {1, 2, 5, 3, 1};
+  for (int run = 0; run < 5; run++) {
+    assert(chunk.lines[run].offset == firsts[run]);
+    assert(getLine(&chunk, firsts[run]) == lines[run]);
+    assert(getLine(&chunk, lasts[run]) == lines[run]);
+  }
+  freeChunk(&chunk);
+}
+
+static void test_chunk_single_run() {
+  Chunk chunk;
+  initChunk(&chunk);
+  assert(getLine(&chunk, 0) == 0);
+  writeLine(&chunk, 100, 7);
+  assert(chunk.lineCount == 1);
+  assert(getLine(&chunk, 0) == 7);
+  assert(getLine(&chunk, 50) == 7);
+  assert(getLine(&chunk, 99) == 7);
+  freeChunk(&chunk);
+}
+
+static void test_chunk_constant_dedup() {
+  Chunk chunk;
+  initChunk(&chunk);
+  // Enough distinct constants to grow the index several times
+  for (int i = 0; i < 300; i++)
+    assert(addConstant(&chunk, NUMBER_VAL(i)) == (size_t)i);
+  for (int i = 0; i < 300; i += 7)
+    assert(addConstant(&chunk, NUMBER_VAL(i)) == (size_t)i);
+  assert(chunk.constants.count == 300);
+
+  // Same bits, same slot: 0 and -0 differ, NaN finds itself
+  size_t zero = addConstant(&chunk, NUMBER_VAL(0.0));
+  size_t negativeZero = addConstant(&chunk, NUMBER_VAL(-0.0));
+  size_t nan = addConstant(&chunk, NUMBER_VAL(NAN));
+  assert(zero == 0);
+  assert(negativeZero == 300);
+  assert(nan == 301);
+  assert(addConstant(&chunk, NUMBER_VAL(-0.0)) == negativeZero);
+  assert(addConstant(&chunk, NUMBER_VAL(NAN)) == nan);
+  assert(addConstant(&chunk, NIL_VAL) == 302);
+  assert(addConstant(&chunk, NIL_VAL) == 302);
+  assert(chunk.constants.count == 303);
+  freeChunk(&chunk);
+}
+
+// print 0; print 1; ... print 299; print 5;
+static void test_chunk_long_constants() {
+  char *source = malloc(301 * 16);
+  assert(source != NULL);
+  size_t length = 0;
+  for (int i = 0; i < 300; i++)
+    length += sprintf(source + length, "print %d;\n", i);
+  sprintf(source + length, "print 5;\n");
+
+  VM vm;
+  initVM(&vm);
+  Chunk chunk;
+  initChunk(&chunk);
+  assert(compile(&vm, source, &chunk));
+  int offset = 0;
+  for (int i = 0; i < 300; i++) {
+    // Indices past 255 take the 24 bit form
+    if (i <= MAX_SHORT_CONSTANT) {
+      assert(chunk.code[offset] == OP_CONSTANT);
+      assert(chunk.code[offset + 1] == i);
+    } else {
+      assert(chunk.code[offset] == OP_CONSTANT_LONG);
+      int index = (chunk.code[offset + 1] << 16) |
+                  (chunk.code[offset + 2] << 8) | chunk.code[offset + 3];
+      assert(index == i);
+    }
+    offset += instructionLength(&chunk, offset);
+    assert(chunk.code[offset++] == OP_PRINT);
+  }
+  // The repeated literal reuses its short slot
+  assert(chunk.code[offset] == OP_CONSTANT);
+  assert(chunk.code[offset + 1] == 5);
+  assert(chunk.constants.count == 300);
+  freeChunk(&chunk);
+  freeVM(&vm);
+  free(source);
+}
+
+void runChunkTests(void) {
+  test_chunk_line_runs();
+  test_chunk_single_run();
+  test_chunk_constant_dedup();
+  test_chunk_long_constants();
+  printf("✅ Chunk tests passed.\n");
+}
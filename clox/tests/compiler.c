@@ -0,0 +1,134 @@
+#include "../compiler.h"
+#include "../vm.h"
+#include "tests.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Compiles source with a fresh VM, so global slots start at 0, and checks the
+// script's code byte for byte
+static void expectCode(const char *source, const uint8_t *expected,
+                       size_t count) {
+  VM vm;
+  initVM(&vm);
+  Chunk chunk;
+  initChunk(&chunk);
+  assert(compile(&vm, source, &chunk));
+  assert(chunk.count == count);
+  assert(memcmp(chunk.code, expected, count) == 0);
+  freeChunk(&chunk);
+  freeVM(&vm);
+}
+
+// Compiles source, which must fail, and checks what it reported on stderr
+static void expectErrors(const char *source, const char *expected) {
+  FILE *errors = tmpfile();
+  assert(errors != NULL);
+  fflush(stderr);
+  int saved = dup(fileno(stderr));
+  dup2(fileno(errors), fileno(stderr));
+
+  VM vm;
+  initVM(&vm);
+  Chunk chunk;
+  initChunk(&chunk);
+  bool compiled = compile(&vm, source, &chunk);
+  freeChunk(&chunk);
+  freeVM(&vm);
+
+  fflush(stderr);
+  dup2(saved, fileno(stderr));
+  close(saved);
+  char reported[256];
+  rewind(errors);
+  size_t length = fread(reported, 1, sizeof(reported) - 1, errors);
+  reported[length] = '\0';
+  fclose(errors);
+  assert(!compiled);
+  assert(strcmp(reported, expected) == 0);
+}
+
+static void test_compiler_globals() {
+  const uint8_t code[] = {
+      OP_CONSTANT,   0, OP_DEFINE_GLOBAL, 0,      OP_GET_GLOBAL, 0,
+      OP_CONSTANT,   1, OP_ADD,           OP_PRINT, OP_NIL,      OP_RETURN,
+  };
+  expectCode("var a = 1; print a + 2;", code, sizeof(code));
+}
+
+static void test_compiler_locals() {
+  const uint8_t code[] = {
+      OP_CONSTANT,  0, OP_GET_LOCAL, 0,      OP_CONSTANT, 1,
+      OP_MULTIPLY,  OP_GET_LOCAL,    1,      OP_PRINT,    OP_POP,
+      OP_POP,       OP_NIL,          OP_RETURN,
+  };
+  expectCode("{ var a = 1; var b = a * 3; print b; }", code, sizeof(code));
+}
+
+static void test_compiler_jumps() {
+  // Offsets count from the byte after the operand, OP_LOOP's backwards
+  // clang-format off
+  const uint8_t code[] = {
+      OP_CONSTANT, 0,
+      OP_DEFINE_GLOBAL, 0,
+      OP_GET_GLOBAL, 0,         // 4: if (x)
+      OP_JUMP_IF_FALSE, 0, 7,   // to 16
+      OP_POP,
+      OP_CONSTANT, 0,
+      OP_PRINT,
+      OP_JUMP, 0, 4,            // to 20
+      OP_POP,                   // 16: else
+      OP_CONSTANT, 1,
+      OP_PRINT,
+      OP_GET_GLOBAL, 0,         // 20: while (x < 3)
+      OP_CONSTANT, 2,
+      OP_LESS,
+      OP_JUMP_IF_FALSE, 0, 12,  // to 40
+      OP_POP,
+      OP_GET_GLOBAL, 0,
+      OP_CONSTANT, 0,
+      OP_ADD,
+      OP_SET_GLOBAL, 0,
+      OP_POP,
+      OP_LOOP, 0, 20,           // to 20
+      OP_POP,                   // 40
+      OP_NIL,
+      OP_RETURN,
+  };
+  // clang-format on
+  expectCode("var x = 1;\n"
+             "if (x) print 1; else print 2;\n"
+             "while (x < 3) x = x + 1;",
+             code, sizeof(code));
+}
+
+static void test_compiler_calls() {
+  const uint8_t code[] = {
+      OP_CLOSURE,  0, OP_DEFINE_GLOBAL, 0, OP_GET_GLOBAL, 0, OP_CONSTANT,
+      1,           OP_CALL,             1, OP_PRINT,      OP_NIL,
+      OP_RETURN,
+  };
+  expectCode("fun f(a) { return a; } print f(1);", code, sizeof(code));
+}
+
+static void test_compiler_errors() {
+  expectErrors("print ;", "[line 1] Error at ';': Expect expression.\n");
+  expectErrors("a + b = c;",
+               "[line 1] Error at '=': Invalid assignment target.\n");
+  expectErrors("var a = 1;\nprint a +",
+               "[line 2] Error at end: Expect expression.\n");
+  // Panic mode skips to the next statement, which reports its own error
+  expectErrors("print ;\nvar 1;",
+               "[line 1] Error at ';': Expect expression.\n"
+               "[line 2] Error at '1': Expect variable name.\n");
+}
+
+void runCompilerTests(void) {
+  test_compiler_globals();
+  test_compiler_locals();
+  test_compiler_jumps();
+  test_compiler_calls();
+  test_compiler_errors();
+  printf("✅ Compiler tests passed.\n");
+}
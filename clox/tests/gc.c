@@ -0,0 +1,49 @@
+#include "../memory.h"
+#include "../object.h"
+#include "../vm.h"
+#include "tests.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A script with no loops or calls, so run() never reaches a safepoint: every
+// line builds a string of about a kilobyte that the next one drops
+static char *straightLineScript(int lines) {
+  size_t size = 2048 + (size_t)lines * 32;
+  char *source = malloc(size);
+  assert(source != NULL);
+  size_t length = (size_t)snprintf(source, size, "var b = \"");
+  memset(source + length, 'x', 1000);
+  length += 1000;
+  length += (size_t)snprintf(source + length, size - length, "\";\nvar a;\n");
+  for (int i = 0; i < lines; i++) {
+    length += (size_t)snprintf(source + length, size - length,
+                               "a = b + \"%d\";\n", i);
+  }
+  return source;
+}
+
+static void test_gc_generational_without_safepoints() {
+  char *source = straightLineScript(20000);
+  VM vm;
+  initVM(&vm);
+  setGCMode(&vm, GC_GENERATIONAL);
+  assert(interpret(&vm, source) == INTERPRET_OK);
+  // 20 MB of strings went through the heap, the old space was collected at
+  // the allocations once the nursery was full
+  assert(vm.gcStats.minorCollections == 0);
+  assert(vm.gcStats.collections > 0);
+  assert(vm.bytesAllocated < 8 * 1024 * 1024);
+  int slot = globalSlot(&vm, copyString(&vm, "a", 1));
+  Value a = vm.globalValues.values[slot];
+  assert(IS_STRING(a) && AS_STRING(a)->length == 1005);
+  assert(memcmp(AS_CSTRING(a) + 1000, "19999", 5) == 0);
+  freeVM(&vm);
+  free(source);
+}
+
+void runGCTests(void) {
+  test_gc_generational_without_safepoints();
+  printf("✅ GC tests passed.\n");
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Correctness mode of the JITs: runs every script under the interpreter, under
+# --jit-threshold=1, which compiles each function on its first call, and under
+# --tracing-threshold=2, which records each loop on its second iteration and
+# traces from every side exit taken ten times, then compares stdout, stderr
+# and the exit status against the interpreter's.
+#
+#   sh tests/jit.sh [script.lox...]
+#
+# Without arguments the scripts under benches/ are used.
+set -u
+
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 $(find . -maxdepth 1 -name '*.c') -o "$OUT/clox" || exit 1
+
+if [ "$#" -eq 0 ]; then
+  set -- benches/*.lox
+fi
+
+failed=0
+for script in "$@"; do
+  "$OUT/clox" --no-cache "$script" >"$OUT/interpreter.out" 2>&1
+  echo "exit $?" >>"$OUT/interpreter.out"
+  for mode in --jit-threshold=1 --tracing-threshold=2; do
+    "$OUT/clox" --no-cache "$mode" "$script" >"$OUT/jit.out" 2>&1
+    echo "exit $?" >>"$OUT/jit.out"
+    if cmp -s "$OUT/interpreter.out" "$OUT/jit.out"; then
+      echo "ok   $mode $script"
+    else
+      echo "FAIL $mode $script"
+      diff "$OUT/interpreter.out" "$OUT/jit.out" | head -20
+      failed=1
+    fi
+  done
+done
+exit $failed
@@ -0,0 +1,14 @@
+#include "tests.h"
+
+int main() {
+  runScannerTests();
+  runCompilerTests();
+  runOptimizerTests();
+  runChunkTests();
+  runBytecodeTests();
+  runCacheTests();
+  runGCTests();
+  runTableTests();
+  runVMTests();
+  return 0;
+}
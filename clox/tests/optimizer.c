@@ -0,0 +1,157 @@
+#include "../chunk.h"
+#include "../optimizer.h"
+#include "tests.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static void writeJump(Chunk *chunk, OpCode op, int distance, int line) {
+  writeChunk(chunk, op, line);
+  writeChunk(chunk, (distance >> 8) & 0xff, line);
+  writeChunk(chunk, distance & 0xff, line);
+}
+
+// One instruction of the optimized code: its offset, opcode and line, and
+// for jumps the offset they land on
+typedef struct {
+  int offset;
+  OpCode op;
+  int line;
+  int target;
+} Expected;
+
+static void test_optimizer_folds_threads_and_keeps_lines() {
+  Chunk chunk;
+  initChunk(&chunk);
+  int one = (int)addConstant(&chunk, NUMBER_VAL(1));
+  int two = (int)addConstant(&chunk, NUMBER_VAL(2));
+  writeChunk(&chunk, OP_GET_GLOBAL, 1); // 0, the loop below lands here
+  writeChunk(&chunk, 0, 1);
+  writeChunk(&chunk, OP_PRINT, 1);
+  writeChunk(&chunk, OP_CONSTANT, 2); // 3, 1 + 2 folds to 3
+  writeChunk(&chunk, one, 2);
+  writeChunk(&chunk, OP_CONSTANT, 2);
+  writeChunk(&chunk, two, 2);
+  writeChunk(&chunk, OP_ADD, 2);
+  writeChunk(&chunk, OP_PRINT, 2);
+  writeChunk(&chunk, OP_FALSE, 3);
+  writeJump(&chunk, OP_JUMP_IF_FALSE, 3, 3); // 10, to the jump at 16
+  writeChunk(&chunk, OP_POP, 3);
+  writeChunk(&chunk, OP_NIL, 3);
+  writeChunk(&chunk, OP_PRINT, 3);
+  writeJump(&chunk, OP_JUMP, 4, 4); // 16, to 23
+  writeJump(&chunk, OP_LOOP, 22, 4); // 19, to 0
+  writeChunk(&chunk, OP_POP, 5);
+  writeChunk(&chunk, OP_NIL, 5); // 23
+  writeChunk(&chunk, OP_RETURN, 5);
+
+  optimizeChunk(&chunk);
+
+  // The fold removes 3 bytes, the JUMP_IF_FALSE threads through the JUMP
+  const Expected expected[] = {
+      {0, OP_GET_GLOBAL, 1, -1}, {2, OP_PRINT, 1, -1},
+      {3, OP_CONSTANT, 2, -1},   {5, OP_PRINT, 2, -1},
+      {6, OP_FALSE, 3, -1},      {7, OP_JUMP_IF_FALSE, 3, 20},
+      {10, OP_POP, 3, -1},       {11, OP_NIL, 3, -1},
+      {12, OP_PRINT, 3, -1},     {13, OP_JUMP, 4, 20},
+      {16, OP_LOOP, 4, 0},       {19, OP_POP, 5, -1},
+      {20, OP_NIL, 5, -1},       {21, OP_RETURN, 5, -1},
+  };
+  int count = sizeof(expected) / sizeof(expected[0]);
+  int offset = 0;
+  for (int i = 0; i < count; i++) {
+    const Expected *instr = &expected[i];
+    assert(offset == instr->offset);
+    assert(chunk.code[offset] == instr->op);
+    int length = instructionLength(&chunk, offset);
+    // Every byte of the instruction keeps the line it came from
+    for (int byte = 0; byte < length; byte++)
+      assert(getLine(&chunk, offset + byte) == instr->line);
+    if (instr->target >= 0) {
+      int distance = (chunk.code[offset + 1] << 8) | chunk.code[offset + 2];
+      int target = instr->op == OP_LOOP ? offset + 3 - distance
+                                        : offset + 3 + distance;
+      assert(target == instr->target);
+    }
+    offset += length;
+  }
+  assert(offset == (int)chunk.count);
+  assert(AS_NUMBER(chunk.constants.values[chunk.code[4]]) == 3);
+  freeChunk(&chunk);
+}
+
+// Once the pool is past the short indices a folded value needs the long form,
+// it only replaces instructions at least as long
+static void test_optimizer_never_lengthens_code() {
+  Chunk chunk;
+  initChunk(&chunk);
+  for (int i = 0; i <= MAX_SHORT_CONSTANT; i++)
+    addConstant(&chunk, NUMBER_VAL(i + 0.5));
+  writeChunk(&chunk, OP_CONSTANT, 1); // 0, -7.5 would take 4 bytes
+  writeChunk(&chunk, 7, 1);
+  writeChunk(&chunk, OP_NEGATE, 1);
+  writeChunk(&chunk, OP_PRINT, 1);
+  writeChunk(&chunk, OP_CONSTANT, 2); // 4, 8.5 + 9.5 fits in the 5 bytes
+  writeChunk(&chunk, 8, 2);
+  writeChunk(&chunk, OP_CONSTANT, 2);
+  writeChunk(&chunk, 9, 2);
+  writeChunk(&chunk, OP_ADD, 2);
+  writeChunk(&chunk, OP_PRINT, 2);
+  writeChunk(&chunk, OP_NIL, 2);
+  writeChunk(&chunk, OP_RETURN, 2);
+
+  optimizeChunk(&chunk);
+
+  const uint8_t code[] = {
+      OP_CONSTANT, 7, OP_NEGATE, OP_PRINT, OP_CONSTANT_LONG,
+  };
+  assert(chunk.count == 11);
+  assert(memcmp(chunk.code, code, sizeof(code)) == 0);
+  int folded = (chunk.code[5] << 16) | (chunk.code[6] << 8) | chunk.code[7];
+  assert(AS_NUMBER(chunk.constants.values[folded]) == 18);
+  assert(chunk.code[8] == OP_PRINT && chunk.code[10] == OP_RETURN);
+  freeChunk(&chunk);
+}
+
+static int jumpDistance(Chunk *chunk, int offset) {
+  return (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+// A loop spanning the whole 16 bits and a jump over it, around a fold that
+// removes one byte, are re-encoded against the new offsets
+static void test_optimizer_long_jumps() {
+  Chunk chunk;
+  initChunk(&chunk);
+  int one = (int)addConstant(&chunk, NUMBER_VAL(1));
+  writeChunk(&chunk, OP_NIL, 1);
+  writeChunk(&chunk, OP_POP, 1);
+  writeJump(&chunk, OP_JUMP, UINT16_MAX - 3, 1); // 2, to 65537
+  writeChunk(&chunk, OP_CONSTANT, 1);
+  writeChunk(&chunk, one, 1);
+  writeChunk(&chunk, OP_NEGATE, 1);
+  writeChunk(&chunk, OP_PRINT, 1);
+  while (chunk.count < 2 + UINT16_MAX - 3)
+    writeChunk(&chunk, OP_NIL, 1);
+  writeJump(&chunk, OP_LOOP, UINT16_MAX, 1); // 65534, to 2
+  writeChunk(&chunk, OP_NIL, 1);
+  writeChunk(&chunk, OP_RETURN, 1);
+
+  optimizeChunk(&chunk);
+
+  // NIL, POP goes as well, the jump moves to 0 and the loop still lands on it
+  assert(chunk.code[0] == OP_JUMP);
+  int loop = UINT16_MAX - 4;
+  assert(jumpDistance(&chunk, 0) == loop);
+  assert(chunk.code[loop] == OP_LOOP);
+  assert(jumpDistance(&chunk, loop) == loop + 3);
+  assert(chunk.code[loop + 3] == OP_NIL);
+  assert(chunk.count == (size_t)loop + 5);
+  freeChunk(&chunk);
+}
+
+void runOptimizerTests(void) {
+  test_optimizer_folds_threads_and_keeps_lines();
+  test_optimizer_never_lengthens_code();
+  test_optimizer_long_jumps();
+  printf("✅ Optimizer tests passed.\n");
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+# Correctness of the register VM: runs every script under the stack VM and
+# under --register-vm, then compares stdout, stderr and the exit status.
+#
+#   sh tests/register.sh [script.lox...]
+#
+# Without arguments the scripts under benches/ are used, along with a few
+# scripts below that end in runtime errors, where the stack traces and the
+# output printed before the error have to match too.
+set -u
+
+cd "$(dirname "$0")/.."
+CC=${CC:-cc}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CC -O2 $(find . -maxdepth 1 -name '*.c') -o "$OUT/clox" || exit 1
+
+if [ "$#" -eq 0 ]; then
+  mkdir "$OUT/errors"
+  cat >"$OUT/errors/operands.lox" <<'EOF'
+fun add(a, b) { return a + b; }
+var total = 0;
+for (var i = 0; i < 10; i = i + 1) {
+  total = add(total, i);
+  print total;
+}
+print add(total, "x");
+EOF
+  cat >"$OUT/errors/undefined.lox" <<'EOF'
+fun outer() {
+  var a = 1;
+  fun inner() { return a + missing; }
+  return inner();
+}
+print outer();
+EOF
+  cat >"$OUT/errors/arity.lox" <<'EOF'
+class Point {
+  init(x, y) { this.x = x; this.y = y; }
+  sum() { return this.x + this.y; }
+}
+var p = Point(1, 2);
+print p.sum();
+print p.sum(3);
+EOF
+  cat >"$OUT/errors/property.lox" <<'EOF'
+class A {}
+var a = A();
+a.x = 1;
+print a.x;
+print a.y;
+EOF
+  cat >"$OUT/errors/overflow.lox" <<'EOF'
+fun down(n) {
+  if (n < 0) return 0;
+  return 1 + down(n + 1);
+}
+print down(0);
+EOF
+  set -- benches/*.lox "$OUT"/errors/*.lox
+fi
+
+failed=0
+for script in "$@"; do
+  "$OUT/clox" --no-cache "$script" >"$OUT/stack.out" 2>&1
+  echo "exit $?" >>"$OUT/stack.out"
+  "$OUT/clox" --no-cache --register-vm "$script" >"$OUT/register.out" 2>&1
+  echo "exit $?" >>"$OUT/register.out"
+  if cmp -s "$OUT/stack.out" "$OUT/register.out"; then
+    echo "ok   $script"
+  else
+    echo "FAIL $script"
+    diff "$OUT/stack.out" "$OUT/register.out" | head -20
+    failed=1
+  fi
+done
+exit $failed
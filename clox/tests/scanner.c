@@ -1,5 +1,6 @@
 // clox/tests/test_scanner.c
 #include "../scanner.h"
+#include "tests.h"
 #include <assert.h>
 #include <stdio.h>
 
@@ -14,8 +15,7 @@ void test_scanner_basic() {
     assert(token.lenght == 3);
 }
 
-int main() {
+void runScannerTests(void) {
     test_scanner_basic();
     printf("✅ Scanner tests passed.\n");
-    return 0;
 }
@@ -0,0 +1,106 @@
+#include "../memory.h"
+#include "../object.h"
+#include "../table.h"
+#include "../vm.h"
+#include "tests.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static bool isInterned(VM *vm, const char *chars) {
+  int length = (int)strlen(chars);
+  return tableFindString(&vm->strings, chars, length,
+                         hashString(chars, length)) != NULL;
+}
+
+static void test_table_interning() {
+  VM vm;
+  initVM(&vm);
+  char buffer[] = "interned";
+  ObjString *a = copyString(&vm, "interned", 8);
+  ObjString *b = copyString(&vm, buffer, 8);
+  assert(a == b);
+  assert(copyString(&vm, "intern", 6) != a);
+
+  // Concatenation interns its result, above and below its stack buffer
+  ObjString *left = copyString(&vm, "inter", 5);
+  ObjString *right = copyString(&vm, "ned", 3);
+  assert(concatenateStrings(&vm, left, right) == a);
+  char big[600];
+  memset(big, 'x', sizeof(big));
+  ObjString *half = copyString(&vm, big, 300);
+  assert(concatenateStrings(&vm, half, half) ==
+         copyString(&vm, big, sizeof(big)));
+  freeVM(&vm);
+}
+
+// The intern table is weak: a collection drops the strings nothing else holds
+static void test_table_weak_strings() {
+  VM vm;
+  initVM(&vm);
+  pushVM(&vm, OBJ_VAL(copyString(&vm, "kept", 4)));
+  copyString(&vm, "dropped", 7);
+  collectGarbage(&vm);
+  assert(isInterned(&vm, "kept"));
+  assert(!isInterned(&vm, "dropped"));
+  popVM(&vm);
+  freeVM(&vm);
+
+  // A minor collection moves the survivors, the table follows them
+  initVM(&vm);
+  setGCMode(&vm, GC_GENERATIONAL);
+  ObjString *young = copyString(&vm, "kept", 4);
+  pushVM(&vm, OBJ_VAL(young));
+  copyString(&vm, "dropped", 7);
+  collectAtSafepoint(&vm);
+  assert(vm.gcStats.minorCollections == 1);
+  ObjString *moved = AS_STRING(vm.stackTop[-1]);
+  assert(moved != young && !isYoung(&vm, (Obj *)moved));
+  assert(copyString(&vm, "kept", 4) == moved);
+  assert(!isInterned(&vm, "dropped"));
+  popVM(&vm);
+  freeVM(&vm);
+}
+
+static void test_table_stats() {
+  Table table;
+  initTable(&table);
+  TableStats stats;
+  tableStats(&table, &stats);
+  assert(stats.live == 0 && stats.capacity == 0 && stats.loadFactor == 0);
+
+  VM vm;
+  initVM(&vm);
+  ObjString *keys[100];
+  for (int i = 0; i < 100; i++) {
+    char name[8];
+    int length = snprintf(name, sizeof(name), "k%d", i);
+    keys[i] = copyString(&vm, name, length);
+    pushVM(&vm, OBJ_VAL(keys[i]));
+    assert(tableSet(&table, keys[i], NUMBER_VAL(i)));
+  }
+  for (int i = 0; i < 10; i++) {
+    assert(tableDelete(&table, keys[i]));
+  }
+  tableStats(&table, &stats);
+  assert(stats.live == 90);
+  assert(stats.tombstones == 10);
+  assert((stats.capacity & (stats.capacity - 1)) == 0);
+  assert(stats.loadFactor == 100.0 / stats.capacity);
+  assert(stats.loadFactor <= 0.75);
+  assert(stats.meanProbe >= 1 && stats.meanProbe <= stats.maxProbe);
+  assert(stats.maxProbe <= stats.capacity);
+
+  // The VM's own intern table holds the keys
+  tableStats(&vm.strings, &stats);
+  assert(stats.live >= 100 && stats.live < stats.capacity);
+  freeTable(&table);
+  freeVM(&vm);
+}
+
+void runTableTests(void) {
+  test_table_interning();
+  test_table_weak_strings();
+  test_table_stats();
+  printf("✅ Table tests passed.\n");
+}
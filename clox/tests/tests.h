@@ -0,0 +1,17 @@
+#ifndef clox_tests_h
+#define clox_tests_h
+
+// Every tests/*.c file is linked into one test runner, see flake.nix. Each
+// file exposes one entry point that asserts its cases and reports success,
+// tests/main.c calls them in order
+void runScannerTests(void);
+void runCompilerTests(void);
+void runOptimizerTests(void);
+void runChunkTests(void);
+void runBytecodeTests(void);
+void runCacheTests(void);
+void runGCTests(void);
+void runTableTests(void);
+void runVMTests(void);
+
+#endif
@@ -0,0 +1,264 @@
+#include "../object.h"
+#include "../vm.h"
+#include "tests.h"
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs source, which must fail at run time, and checks the error and stack
+// trace it reported on stderr
+static void expectRuntimeError(const char *source, bool tailCalls,
+                               const char *expected) {
+  FILE *errors = tmpfile();
+  assert(errors != NULL);
+  fflush(stderr);
+  int saved = dup(fileno(stderr));
+  dup2(fileno(errors), fileno(stderr));
+
+  VM vm;
+  initVM(&vm);
+  vm.tailCalls = tailCalls;
+  InterpretResult result = interpret(&vm, source);
+  freeVM(&vm);
+
+  fflush(stderr);
+  dup2(saved, fileno(stderr));
+  close(saved);
+  char reported[256];
+  rewind(errors);
+  size_t length = fread(reported, 1, sizeof(reported) - 1, errors);
+  reported[length] = '\0';
+  fclose(errors);
+  assert(result == INTERPRET_RUNTIME_ERROR);
+  assert(strcmp(reported, expected) == 0);
+}
+
+// A tail call that fails its checks still has the caller's frame to report
+static void test_vm_tail_call_errors() {
+  for (int tailCalls = 0; tailCalls <= 1; tailCalls++) {
+    expectRuntimeError("fun f(a) { return a; }\n"
+                       "fun g() { return f(); }\n"
+                       "g();",
+                       tailCalls,
+                       "Expected 1 arguments but got 0.\n"
+                       "[line 2] in g()\n"
+                       "[line 3] in script\n");
+    expectRuntimeError("fun g() {\n"
+                       "  return 1();\n"
+                       "}\n"
+                       "g();",
+                       tailCalls,
+                       "Can only call functions and classes.\n"
+                       "[line 2] in g()\n"
+                       "[line 4] in script\n");
+    expectRuntimeError("class A { init(a) {} }\n"
+                       "fun g() { return A(1, 2); }\n"
+                       "g();",
+                       tailCalls,
+                       "Expected 1 arguments but got 2.\n"
+                       "[line 2] in g()\n"
+                       "[line 3] in script\n");
+  }
+}
+
+// Runs fault in a child process with a VM alive, returns its wait status
+static int statusAfter(void (*fault)(void)) {
+  fflush(stdout);
+  pid_t child = fork();
+  assert(child >= 0);
+  if (child == 0) {
+    VM vm;
+    initVM(&vm);
+    fault();
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(child, &status, 0) == child);
+  return status;
+}
+
+static void faultOutsideTheStack(void) {
+  volatile char *page = mmap(NULL, 4096, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(page != MAP_FAILED);
+  page[0] = 1;
+}
+
+static void sendSegv(void) { raise(SIGSEGV); }
+
+// The guard page handler passes faults that are not its own on, the process
+// must not carry on past them
+static void test_vm_foreign_faults() {
+  int status = statusAfter(faultOutsideTheStack);
+  assert(!WIFEXITED(status) || WEXITSTATUS(status) != 0);
+  status = statusAfter(sendSegv);
+  assert(!WIFEXITED(status) || WEXITSTATUS(status) != 0);
+}
+
+static void run(VM *vm, const char *source) {
+  assert(interpret(vm, source) == INTERPRET_OK);
+}
+
+static Value global(VM *vm, const char *name) {
+  int slot = globalSlot(vm, copyString(vm, name, (int)strlen(name)));
+  return vm->globalValues.values[slot];
+}
+
+// The code of the function held by the global called name
+static uint8_t *codeOf(VM *vm, const char *name) {
+  return AS_CLOSURE(global(vm, name))->function->chunk.code;
+}
+
+// add's code is GET_LOCAL 1, GET_LOCAL 2, ADD, RETURN
+#define ADD_AT 4
+
+static void test_vm_quickening() {
+  VM vm;
+  initVM(&vm);
+  run(&vm, "fun add(a, b) { return a + b; }");
+  assert(codeOf(&vm, "add")[ADD_AT] == OP_ADD);
+
+  run(&vm, "var r = add(1, 2);");
+  assert(AS_NUMBER(global(&vm, "r")) == 3);
+  assert(codeOf(&vm, "add")[ADD_AT] == OP_ADD_NUM_NUM);
+  assert(vm.quickenStats.quickened[OP_ADD_NUM_NUM] == 1);
+  run(&vm, "r = add(3, 4);");
+  assert(AS_NUMBER(global(&vm, "r")) == 7);
+  assert(vm.quickenStats.quickened[OP_ADD_NUM_NUM] == 1);
+
+  // The guard misses, OP_ADD runs again and picks the string form
+  run(&vm, "r = add(\"a\", \"b\");");
+  assert(strcmp(AS_CSTRING(global(&vm, "r")), "ab") == 0);
+  assert(codeOf(&vm, "add")[ADD_AT] == OP_ADD_STR_STR);
+  assert(vm.quickenStats.despecialized[OP_ADD_NUM_NUM] == 1);
+  assert(vm.quickenStats.quickened[OP_ADD_STR_STR] == 1);
+  assert(vm.quickenStats.despecialized[OP_ADD_STR_STR] == 0);
+  freeVM(&vm);
+
+  initVM(&vm);
+  vm.quicken = false;
+  run(&vm, "fun add(a, b) { return a + b; }\n"
+           "var r = add(1, 2);\n"
+           "r = add(\"a\", \"b\");");
+  assert(strcmp(AS_CSTRING(global(&vm, "r")), "ab") == 0);
+  assert(codeOf(&vm, "add")[ADD_AT] == OP_ADD);
+  for (int op = 0; op < UINT8_COUNT; op++) {
+    assert(vm.quickenStats.quickened[op] == 0);
+    assert(vm.quickenStats.despecialized[op] == 0);
+  }
+  freeVM(&vm);
+}
+
+static ObjShape *shapeOf(VM *vm, const char *name) {
+  return AS_INSTANCE(global(vm, name))->shape;
+}
+
+// Instances that got the same fields in the same order share a shape, one
+// property site caches the last shape it saw
+static void test_vm_property_caches() {
+  VM vm;
+  initVM(&vm);
+  run(&vm, "class P {}\n"
+           "fun make(xFirst, x, y) {\n"
+           "  var p = P();\n"
+           "  if (xFirst) { p.x = x; p.y = y; } else { p.y = y; p.x = x; }\n"
+           "  return p;\n"
+           "}\n"
+           "fun getX(p) { return p.x; }\n"
+           "fun setZ(p, z) { p.z = z; }\n"
+           "var a = make(true, 1, 2);\n"
+           "var b = make(true, 3, 4);\n"
+           "var c = make(false, 5, 6);");
+  assert(shapeOf(&vm, "a") == shapeOf(&vm, "b"));
+  assert(shapeOf(&vm, "a") != shapeOf(&vm, "c"));
+
+  vm.icStats = (ICStats){0};
+  run(&vm, "var r = getX(a) + getX(b);");
+  assert(AS_NUMBER(global(&vm, "r")) == 4);
+  assert(vm.icStats.getMisses == 1 && vm.icStats.getHits == 1);
+  // x is the second field of c, the site misses and then caches c's shape
+  run(&vm, "r = getX(c) + getX(c) + getX(a);");
+  assert(AS_NUMBER(global(&vm, "r")) == 11);
+  assert(vm.icStats.getMisses == 3 && vm.icStats.getHits == 2);
+
+  // A field added after the site cached a's shape moves a to a new one
+  run(&vm, "a.z = 7; r = getX(a);");
+  assert(AS_NUMBER(global(&vm, "r")) == 1);
+  assert(vm.icStats.getMisses == 4);
+  ObjShape *withZ = shapeOf(&vm, "a");
+
+  // setZ misses on b and reuses the transition a took, then hits on d and
+  // moves it to the shape it cached
+  vm.icStats = (ICStats){0};
+  run(&vm, "var d = make(true, 8, 9);\n"
+           "setZ(b, 10); setZ(d, 11);\n"
+           "r = b.z + d.z;");
+  assert(AS_NUMBER(global(&vm, "r")) == 21);
+  assert(shapeOf(&vm, "b") == withZ && shapeOf(&vm, "d") == withZ);
+  // make's two set sites hit for d, b and d share setZ's site
+  assert(vm.icStats.setHits == 3 && vm.icStats.setMisses == 1);
+  freeVM(&vm);
+}
+
+// Runs source, then returns the number it left in the global r
+static double runNumber(VM *vm, const char *source) {
+  run(vm, source);
+  return AS_NUMBER(global(vm, "r"));
+}
+
+// One OP_INVOKE site seeing one receiver class, then four, which fill its
+// own cache, then a fifth, which sends it to the shared method cache
+static void test_vm_invoke_caches() {
+  VM vm;
+  initVM(&vm);
+  run(&vm, "class C1 { m() { return 1; } }\n"
+           "class C2 { m() { return 2; } }\n"
+           "class C3 { m() { return 3; } }\n"
+           "class C4 { m() { return 4; } }\n"
+           "class C5 { m() { return 5; } }\n"
+           "fun callM(o) { return o.m(); }\n"
+           "fun callOne(o) { return o.m(); }\n"
+           "var c1 = C1(); var c2 = C2(); var c3 = C3(); var c4 = C4();\n"
+           "var c5 = C5();\n"
+           "var r;");
+  ICStats *stats = &vm.icStats;
+  *stats = (ICStats){0};
+  assert(runNumber(&vm, "r = callM(c1) + callM(c1);") == 2);
+  assert(stats->invokeMisses == 1 && stats->invokeHits == 1);
+
+  assert(runNumber(&vm, "r = callM(c2) + callM(c3) + callM(c4);") == 9);
+  assert(stats->invokeMisses == 4 && stats->invokeHits == 1);
+  assert(runNumber(&vm, "r = callM(c1) + callM(c2) + callM(c3) + "
+                        "callM(c4);") == 10);
+  assert(stats->invokeMisses == 4 && stats->invokeHits == 5);
+
+  assert(runNumber(&vm, "r = callM(c5) + callM(c5);") == 10);
+  assert(stats->megamorphicMisses == 1 && stats->megamorphicHits == 1);
+  assert(stats->invokeMisses == 4 && stats->invokeHits == 5);
+
+  // A field called m shadows the method the site cached for C1. The field
+  // moves the instance to another shape, so the site misses and finds it
+  *stats = (ICStats){0};
+  assert(runNumber(&vm, "var s = C1(); r = callOne(s);") == 1);
+  assert(runNumber(&vm, "fun seven() { return 7; }\n"
+                        "s.m = seven;\n"
+                        "r = callOne(s) + callOne(s) + callOne(c1);") == 15);
+  assert(stats->invokeMisses == 3 && stats->invokeHits == 1);
+  // The full site shadows the same way
+  assert(runNumber(&vm, "r = callM(s);") == 7);
+  assert(stats->megamorphicMisses == 1 && stats->megamorphicHits == 0);
+  freeVM(&vm);
+}
+
+void runVMTests(void) {
+  test_vm_tail_call_errors();
+  test_vm_foreign_faults();
+  test_vm_quickening();
+  test_vm_property_caches();
+  test_vm_invoke_caches();
+  printf("✅ VM tests passed.\n");
+}
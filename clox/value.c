@@ -1,8 +1,36 @@
 #include "value.h"
 #include "memory.h"
+#include "object.h"
 #include <stdio.h>
 
-void printValue(Value value) { printf("%.15g", value); }
+// NOTE: only the IS_/AS_ macros are used here so this works with both value
+// layouts, see NAN_BOXING in common.h
+void printValue(Value value) {
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%.15g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  }
+}
+
+bool valuesEqual(Value a, Value b) {
+  // Compare numbers as doubles, NaN is not equal to itself
+  if (IS_NUMBER(a) || IS_NUMBER(b)) {
+    return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  if (IS_BOOL(a) && IS_BOOL(b))
+    return AS_BOOL(a) == AS_BOOL(b);
+  if (IS_NIL(a) && IS_NIL(b))
+    return true;
+  // NOTE: strings are interned, equal strings are the same object
+  if (IS_OBJ(a) && IS_OBJ(b))
+    return AS_OBJ(a) == AS_OBJ(b);
+  return false;
+}
 
 void initValueArray(ValueArray *array) {
   array->count = 0;
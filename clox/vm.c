@@ -2,18 +2,217 @@
 #include "compiler.h"
 #include "chunk.h"
 #include "debug.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "regvm.h"
+#include "table.h"
 #include "value.h"
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-static void resetStack(VM *vm) { vm->stackTop = vm->stack; }
+// The VM whose guard page the SIGSEGV handler checks, see initVM.
+// NOTE: one per process, the handler is process wide and only knows the VM
+// initialized last. Any other VM still alive runs unguarded, running off the
+// end of its stack faults like any stray access
+static VM *guardOwner = NULL;
+// What SIGSEGV did before stackGuardHandler was installed
+static struct sigaction previousGuardAction;
 
-void initVM(VM *vm) { resetStack(vm); }
+#define TRACE_FRAMES 16
+
+static void resetStack(VM *vm) {
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
+  vm->openUpvalues = NULL;
+}
+
+static void runtimeError(VM *vm, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputs("\n", stderr);
+
+  // Innermost call first. NOTE: every ip already moved past the instruction
+  // that failed or made the call. Runaway recursion leaves thousands of
+  // frames, only both ends of those are shown
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    if (i == vm->frameCount - TRACE_FRAMES - 1 && i >= TRACE_FRAMES) {
+      fprintf(stderr, "[... %d more calls]\n", i - TRACE_FRAMES + 1);
+      i = TRACE_FRAMES - 1;
+    }
+    CallFrame *frame = &vm->frames[i];
+    size_t instruction = frame->ip - frame->chunk->code - 1;
+    int line = getLine(frame->chunk, (int)instruction);
+    if (frame->closure == NULL) {
+      fprintf(stderr, "[line %d] in script\n", line);
+    } else {
+      fprintf(stderr, "[line %d] in %s()\n", line,
+              frame->closure->function->name->chars);
+    }
+  }
+  resetStack(vm);
+}
+
+static size_t pageSize(void) { return (size_t)sysconf(_SC_PAGESIZE); }
+
+// Maps room for capacity values and a guard page right after them. Nothing
+// is committed up front, MAP_NORESERVE leaves every page to the first write
+// that touches it. NOTE: the page before the stack holds stack[-1], where
+// run() spills its cached top while the stack is empty, see TOS
+static Value *mapStack(size_t capacity) {
+  size_t size = capacity * sizeof(Value) + 2 * pageSize();
+  uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+  if (mprotect(base + size - pageSize(), pageSize(), PROT_NONE) != 0) {
+    munmap(base, size);
+    return NULL;
+  }
+  return (Value *)(base + pageSize());
+}
+
+static void unmapStack(Value *stack, size_t capacity) {
+  munmap((uint8_t *)stack - pageSize(),
+         capacity * sizeof(Value) + 2 * pageSize());
+}
+
+// Moves the stack to a mapping twice as large. Every pointer into the old
+// one is rebased: stackTop, the slots of each frame and the location of each
+// open upvalue. NOTE: only called from call(), run() reloads its frame and
+// ip after every call and holds no other pointer into the stack
+static bool growStack(VM *vm) {
+  size_t capacity = vm->stackLimit - vm->stack;
+  if (capacity >= STACK_MAX)
+    return false;
+  Value *stack = mapStack(capacity * 2);
+  if (stack == NULL)
+    return false;
+  memcpy(stack, vm->stack, sizeof(Value) * (vm->stackTop - vm->stack));
+  for (int i = 0; i < vm->frameCount; i++)
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  for (ObjUpvalue *upvalue = vm->openUpvalues; upvalue != NULL;
+       upvalue = upvalue->nextOpen)
+    upvalue->location = stack + (upvalue->location - vm->stack);
+  vm->stackTop = stack + (vm->stackTop - vm->stack);
+  unmapStack(vm->stack, capacity);
+  vm->stack = stack;
+  vm->stackLimit = stack + capacity * 2;
+  return true;
+}
+
+static bool growFrames(VM *vm) {
+  if (vm->frameCapacity >= FRAMES_MAX)
+    return false;
+  vm->frameCapacity *= 2;
+  vm->frames = (CallFrame *)realloc(vm->frames,
+                                    sizeof(CallFrame) * vm->frameCapacity);
+  if (vm->frames == NULL)
+    exit(1);
+  return true;
+}
+
+// A push past stackLimit faults in the guard page. While run() is running
+// that unwinds to interpretChunk. Any other fault is not ours: the action the
+// handler replaced is put back and the signal raised again
+static void stackGuardHandler(int signal, siginfo_t *info, void *context) {
+  VM *vm = guardOwner;
+  uint8_t *address = (uint8_t *)info->si_addr;
+  bool fromKernel = info->si_code > 0;
+  if (fromKernel && vm != NULL && vm->guardArmed &&
+      address >= (uint8_t *)vm->stackLimit &&
+      address < (uint8_t *)vm->stackLimit + pageSize())
+    siglongjmp(vm->stackOverflow, 1);
+  sigaction(SIGSEGV, &previousGuardAction, NULL);
+  // NOTE: a real fault happens again, with its own address, when the
+  // instruction is retried on return. A signal sent with kill is not retried
+  if (!fromKernel)
+    raise(signal);
+}
+
+void initVM(VM *vm) {
+  vm->stack = mapStack(STACK_INITIAL);
+  if (vm->stack == NULL)
+    exit(1);
+  vm->stackLimit = vm->stack + STACK_INITIAL;
+  vm->guardArmed = false;
+  vm->frameCapacity = FRAMES_INITIAL;
+  vm->frames = (CallFrame *)malloc(sizeof(CallFrame) * vm->frameCapacity);
+  if (vm->frames == NULL)
+    exit(1);
+  if (guardOwner == NULL) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = stackGuardHandler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previousGuardAction);
+  }
+  guardOwner = vm;
+  resetStack(vm);
+  vm->chunk = NULL;
+  vm->objects = NULL;
+  vm->trace = false;
+  vm->tailCalls = true;
+  vm->quicken = true;
+  vm->jit = false;
+  vm->jitThreshold = JIT_THRESHOLD;
+  vm->tracing = false;
+  vm->traceThreshold = TRACE_THRESHOLD;
+  vm->recorder = NULL;
+  vm->lastExit = NULL;
+  vm->traceStats = (TraceStats){0};
+  vm->native = false;
+  vm->registers = false;
+  vm->countInstructions = false;
+  vm->vmStats = (VMStats){0};
+  vm->parser = NULL;
+  vm->rootShape = NULL;
+  vm->icStats = (ICStats){0};
+  memset(&vm->quickenStats, 0, sizeof(vm->quickenStats));
+  memset(vm->methodCache, 0, sizeof(vm->methodCache));
+  initGC(vm);
+  initTable(&vm->globalSlots);
+  initValueArray(&vm->globalNames);
+  initValueArray(&vm->globalValues);
+  initTable(&vm->strings);
+}
+
+static void freeObjects(VM *vm) {
+  Obj *object = vm->objects;
+  while (object != NULL) {
+    Obj *next = object->next;
+    freeObject(object);
+    object = next;
+  }
+  vm->objects = NULL;
+}
+
+void freeVM(VM *vm) {
+  freeTable(&vm->globalSlots);
+  freeValueArray(&vm->globalNames);
+  freeValueArray(&vm->globalValues);
+  freeTable(&vm->strings);
+  freeObjects(vm);
+  freeGC(vm);
+  unmapStack(vm->stack, vm->stackLimit - vm->stack);
+  free(vm->frames);
+  if (guardOwner == vm) {
+    guardOwner = NULL;
+    sigaction(SIGSEGV, &previousGuardAction, NULL);
+  }
+}
 
 void pushVM(VM *vm, Value value) {
-  // NOTE: ponter magic. The stacktop points to the location in the array, so
-  // when we set the value in puts it in the array
-  // then when we increase stacktop, we are move the pointer to the next
-  // location
+  // NOTE: no room check, see stackGuardHandler. stackTop points at the next
+  // free slot, the value goes there and stackTop moves past it
   *vm->stackTop = value;
   vm->stackTop++;
 }
@@ -23,76 +222,1033 @@ Value popVM(VM *vm) {
   return *vm->stackTop;
 }
 
+// Returns the slot of the global called name, assigning the next free one the
+// first time the name is seen. Slots are never reused, so a chunk compiled
+// against this VM stays valid for its whole life. Returns -1 once the 24 bit
+// operand of the long global instructions runs out
+int globalSlot(VM *vm, ObjString *name) {
+  Value slot;
+  if (tableGet(&vm->globalSlots, name, &slot))
+    return (int)AS_NUMBER(slot);
+  if (vm->globalValues.count > MAX_LONG_CONSTANT)
+    return -1;
+
+  int index = (int)vm->globalValues.count;
+  // NOTE: a fresh name is only reachable from the stack while the arrays grow
+  pushVM(vm, OBJ_VAL(name));
+  writeValueArray(&vm->globalNames, OBJ_VAL(name));
+  writeValueArray(&vm->globalValues, UNDEFINED_VAL);
+  tableSet(&vm->globalSlots, name, NUMBER_VAL(index));
+  writeBarrier(vm, NULL, OBJ_VAL(name));
+  popVM(vm);
+  return index;
+}
+
+static const char *globalName(VM *vm, size_t slot) {
+  return AS_STRING(vm->globalNames.values[slot])->chars;
+}
+
+static Value peekVM(VM *vm, int distance) { return vm->stackTop[-1 - distance]; }
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool call(VM *vm, ObjClosure *closure, int argCount) {
+  if (argCount != closure->function->arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.",
+                 closure->function->arity, argCount);
+    return false;
+  }
+  ObjFunction *function = closure->function;
+  if (vm->jit && function->jit == NULL &&
+      ++function->hotness >= vm->jitThreshold)
+    jitCompile(function);
+  // NOTE: checked once per call rather than on every push
+  if ((vm->frameCount == vm->frameCapacity && !growFrames(vm)) ||
+      (vm->stackLimit - vm->stackTop < STACK_HEADROOM && !growStack(vm))) {
+    runtimeError(vm, "Stack overflow.");
+    return false;
+  }
+  // NOTE: the callee and its arguments are already in place, slot 0 of the
+  // new frame is the closure and the parameters are the first locals
+  CallFrame *frame = &vm->frames[vm->frameCount++];
+  frame->closure = closure;
+  frame->chunk = &closure->function->chunk;
+  frame->ip = frame->chunk->code;
+  frame->slots = vm->stackTop - argCount - 1;
+  return true;
+}
+
+static bool callValue(VM *vm, Value callee, int argCount) {
+  if (IS_CLOSURE(callee))
+    return call(vm, AS_CLOSURE(callee), argCount);
+  if (IS_BOUND_METHOD(callee)) {
+    // The receiver takes the slot of the callee, it is this in the method
+    ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+    vm->stackTop[-argCount - 1] = bound->receiver;
+    return call(vm, bound->method, argCount);
+  }
+  if (IS_CLASS(callee)) {
+    // NOTE: the class stays in its slot while the instance is allocated
+    ObjClass *klass = AS_CLASS(callee);
+    vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
+    if (!IS_NIL(klass->initializer))
+      return call(vm, AS_CLOSURE(klass->initializer), argCount);
+    if (argCount != 0) {
+      runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+      return false;
+    }
+    return true;
+  }
+  runtimeError(vm, "Can only call functions and classes.");
+  return false;
+}
+
+// Reports the error callValue would, without calling anything. A tail call
+// checks first, once the caller's frame is dropped the stack trace has lost it
+static bool checkCall(VM *vm, Value callee, int argCount) {
+  int arity;
+  if (IS_CLOSURE(callee)) {
+    arity = AS_CLOSURE(callee)->function->arity;
+  } else if (IS_BOUND_METHOD(callee)) {
+    arity = AS_BOUND_METHOD(callee)->method->function->arity;
+  } else if (IS_CLASS(callee)) {
+    Value initializer = AS_CLASS(callee)->initializer;
+    arity = IS_NIL(initializer) ? 0 : AS_CLOSURE(initializer)->function->arity;
+  } else {
+    runtimeError(vm, "Can only call functions and classes.");
+    return false;
+  }
+  if (argCount != arity) {
+    runtimeError(vm, "Expected %d arguments but got %d.", arity, argCount);
+    return false;
+  }
+  return true;
+}
+
+static MethodCacheEntry *methodCacheEntry(VM *vm, ObjInstance *instance,
+                                          ObjString *name) {
+  uintptr_t hash = ((uintptr_t)instance->klass >> 4) ^
+                   ((uintptr_t)instance->shape >> 4) ^ name->hash;
+  return &vm->methodCache[hash & (METHOD_CACHE_SIZE - 1)];
+}
+
+// Calls the method called name on the receiver below the arguments, without
+// the bound method a GET_PROPERTY then CALL would allocate. The call site's
+// cache remembers the method for up to INVOKE_CACHE_ENTRIES kinds of
+// receivers, sites that see more share vm->methodCache. owner is the function
+// whose chunk holds the cache, NULL for the script
+static bool invoke(VM *vm, InvokeCache *cache, Obj *owner, ObjString *name,
+                   int argCount) {
+  Value receiver = peekVM(vm, argCount);
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError(vm, "Only instances have methods.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(receiver);
+
+  int used = 0;
+  for (; used < INVOKE_CACHE_ENTRIES; used++) {
+    InvokeEntry *entry = &cache->entries[used];
+    if (entry->klass == NULL)
+      break;
+    if (entry->klass == instance->klass && entry->shape == instance->shape) {
+      vm->icStats.invokeHits++;
+      return call(vm, entry->method, argCount);
+    }
+  }
+  MethodCacheEntry *shared = NULL;
+  if (used == INVOKE_CACHE_ENTRIES) {
+    shared = methodCacheEntry(vm, instance, name);
+    if (shared->klass == instance->klass && shared->shape == instance->shape &&
+        shared->name == name) {
+      vm->icStats.megamorphicHits++;
+      return call(vm, shared->method, argCount);
+    }
+    vm->icStats.megamorphicMisses++;
+  } else {
+    vm->icStats.invokeMisses++;
+  }
+
+  // A field shadows the method, whatever it holds is called instead. The
+  // shape decides, so this is never cached
+  int slot = shapeSlot(instance->shape, name);
+  if (slot >= 0) {
+    Value field = instance->fields[slot];
+    vm->stackTop[-argCount - 1] = field;
+    return callValue(vm, field, argCount);
+  }
+  Value method;
+  if (!tableGet(&instance->klass->methods, name, &method)) {
+    runtimeError(vm, "Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  ObjClosure *closure = AS_CLOSURE(method);
+  if (shared != NULL) {
+    *shared = (MethodCacheEntry){instance->klass, instance->shape, name,
+                                 closure};
+  } else {
+    cache->entries[used] =
+        (InvokeEntry){instance->klass, instance->shape, closure};
+    writeBarrier(vm, owner, OBJ_VAL(instance->klass));
+    writeBarrier(vm, owner, method);
+  }
+  return call(vm, closure, argCount);
+}
+
+// Returns the upvalue for the stack slot, sharing it with every closure that
+// already captured the same variable
+static ObjUpvalue *captureUpvalue(VM *vm, Value *local) {
+  ObjUpvalue *prev = NULL;
+  ObjUpvalue *upvalue = vm->openUpvalues;
+  while (upvalue != NULL && upvalue->location > local) {
+    prev = upvalue;
+    upvalue = upvalue->nextOpen;
+  }
+  if (upvalue != NULL && upvalue->location == local)
+    return upvalue;
+
+  ObjUpvalue *created = newUpvalue(vm, local);
+  created->nextOpen = upvalue;
+  if (prev == NULL) {
+    vm->openUpvalues = created;
+  } else {
+    prev->nextOpen = created;
+  }
+  return created;
+}
+
+// Moves every variable at or above last off the stack into its upvalue
+static void closeUpvalues(VM *vm, Value *last) {
+  while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+    ObjUpvalue *upvalue = vm->openUpvalues;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    writeBarrier(vm, (Obj *)upvalue, upvalue->closed);
+    vm->openUpvalues = upvalue->nextOpen;
+  }
+}
+
+static void concatenate(VM *vm) {
+  // NOTE: the operands stay on the stack until the result exists, allocating
+  // it may run a collection
+  ObjString *b = AS_STRING(peekVM(vm, 0));
+  ObjString *a = AS_STRING(peekVM(vm, 1));
+  ObjString *result = concatenateStrings(vm, a, b);
+  popVM(vm);
+  popVM(vm);
+  pushVM(vm, OBJ_VAL(result));
+}
+
+// Binds the method on top of the stack to the class below it
+static void defineMethod(VM *vm, ObjString *name) {
+  Value method = peekVM(vm, 0);
+  ObjClass *klass = AS_CLASS(peekVM(vm, 1));
+  tableSet(&klass->methods, name, method);
+  writeBarrier(vm, (Obj *)klass, OBJ_VAL(name));
+  writeBarrier(vm, (Obj *)klass, method);
+  // NOTE: looked up once here instead of on every instantiation
+  if (name->length == 4 && memcmp(name->chars, "init", 4) == 0)
+    klass->initializer = method;
+  popVM(vm);
+}
+
+// Replaces the instance on top of the stack with its method called name,
+// bound to it. Returns false when the class has no such method
+static bool bindMethod(VM *vm, ObjClass *klass, ObjString *name) {
+  Value method;
+  if (!tableGet(&klass->methods, name, &method))
+    return false;
+  ObjBoundMethod *bound = newBoundMethod(vm, peekVM(vm, 0), AS_CLOSURE(method));
+  popVM(vm);
+  pushVM(vm, OBJ_VAL(bound));
+  return true;
+}
+
+// Prints the stack and the instruction about to run, used by --trace
+static void traceExecution(VM *vm, Chunk *chunk, uint8_t *ip) {
+  printf("    ");
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+    printf("[ ");
+    printValue(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+  disassembleInstruction(chunk, (int)(ip - chunk->code));
+}
+
 static InterpretResult run(VM *vm) {
-#define READ_BYTE() (*vm->ip++)
-#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
-#define BINARY_OP(op)                                                          \
+  // NOTE: the instruction pointer lives in a local so the compiler can keep it
+  // in a register, frame->ip is only synced when something else needs to read
+  // it: a call, or an error reporting the line
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  uint8_t *ip = frame->ip;
+  // NOTE: same for the stack top, and with TOS_CACHE for the value on top of
+  // the stack: a binary operator loads its left operand and nothing else, the
+  // result stays in a register for the next instruction. The top slot in
+  // memory is stale until SAVE_STACK, which anything reading the stack
+  // through vm (calls, the collector, the JITs) must see first
+  Value *sp = vm->stackTop;
+#ifdef TOS_CACHE
+  Value top = sp[-1];
+
+#define TOS top
+// The old top goes to its slot before value is read, which may be that slot
+#define PUSH(value)                                                            \
   do {                                                                         \
-    double b = popVM(vm);                                                      \
-    double a = popVM(vm);                                                      \
-    pushVM(vm, a op b);                                                        \
+    sp[-1] = top;                                                              \
+    top = (value);                                                             \
+    sp++;                                                                      \
   } while (false)
+#define POP()                                                                  \
+  do {                                                                         \
+    sp--;                                                                      \
+    top = sp[-1];                                                              \
+  } while (false)
+#define SAVE_STACK() (sp[-1] = top, vm->stackTop = sp)
+#define LOAD_STACK() (sp = vm->stackTop, top = sp[-1])
+#else
+#define TOS sp[-1]
+#define PUSH(value)                                                            \
+  do {                                                                         \
+    *sp = (value);                                                             \
+    sp++;                                                                      \
+  } while (false)
+#define POP() (sp--)
+#define SAVE_STACK() (vm->stackTop = sp)
+#define LOAD_STACK() (sp = vm->stackTop)
+#endif
 
-  for (;;) {
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (frame->chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG()                                                   \
+  (ip += 3,                                                                    \
+   frame->chunk->constants.values[(ip[-3] << 16) | (ip[-2] << 8) | ip[-1]])
+// For handlers shared by a short and a long form, ip[-1] is the opcode
+#define READ_SLOT(shortOp)                                                     \
+  (ip[-1] == shortOp ? READ_BYTE()                                             \
+                     : (ip += 3, (ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    frame->ip = ip;                                                            \
+    SAVE_STACK();                                                              \
+    runtimeError(vm, __VA_ARGS__);                                             \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
 
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("    ");
-    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(vm->chunk, (int)(vm->ip - vm->chunk->code));
+// Rewrites the running instruction, ip[-1], to the form for the operand
+// types it just checked. NOTE: the code is patched in place. A .loxc mapping
+// is private and the cache stores a chunk before it runs, so no file ever
+// holds a quickened form
+#define QUICKEN(form)                                                          \
+  do {                                                                         \
+    if (vm->quicken) {                                                         \
+      ip[-1] = form;                                                           \
+      vm->quickenStats.quickened[form]++;                                      \
+    }                                                                          \
+  } while (false)
+// The guard of a quickened form failed: back to the generic instruction,
+// which runs again right away and either picks another form or reports the
+// type error
+#define DESPECIALIZE(generic)                                                  \
+  do {                                                                         \
+    vm->quickenStats.despecialized[ip[-1]]++;                                  \
+    ip[-1] = generic;                                                          \
+    ip--;                                                                      \
+    DISPATCH();                                                                \
+  } while (false)
+// The result replaces both operands: after sp--, TOS is the left one's slot
+#define BINARY_OP(valueType, op, form)                                         \
+  do {                                                                         \
+    Value b = TOS;                                                             \
+    Value a = sp[-2];                                                          \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                      \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    QUICKEN(form);                                                             \
+    sp--;                                                                      \
+    TOS = valueType(AS_NUMBER(a) op AS_NUMBER(b));                             \
+  } while (false)
+// Quickened BINARY_OP: one guard and no error path
+#define NUMBER_OP(valueType, op, generic)                                      \
+  do {                                                                         \
+    Value b = TOS;                                                             \
+    Value a = sp[-2];                                                          \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))                                        \
+      DESPECIALIZE(generic);                                                   \
+    sp--;                                                                      \
+    TOS = valueType(AS_NUMBER(a) op AS_NUMBER(b));                             \
+  } while (false)
+
+// Hands the frame to the machine code of its function, if it has any. It runs
+// until an instruction it leaves to run(). Done on entering a frame, on
+// returning to one and on every back edge, but not while a trace is being
+// recorded, the recorder has to see every instruction
+#define JIT_ENTER()                                                            \
+  do {                                                                         \
+    if (vm->jit && vm->recorder == NULL && frame->closure != NULL &&           \
+        frame->closure->function->jit != NULL) {                               \
+      SAVE_STACK();                                                            \
+      ip = jitRun(vm, frame, ip);                                              \
+      LOAD_STACK();                                                            \
+    }                                                                          \
+  } while (false)
+
+#ifdef COMPUTED_GOTO
+  // NOTE: direct threading. Every handler ends with its own indirect jump to
+  // the next handler, so the branch predictor gets one history per opcode
+  // instead of a single shared jump, and there is no range check of a switch
+  static void *dispatchTable[] = {
+      [OP_CONSTANT] = &&op_CONSTANT,
+      [OP_RETURN] = &&op_RETURN,
+      [OP_NEGATE] = &&op_NEGATE,
+      [OP_ADD] = &&op_ADD,
+      [OP_SUBTRACT] = &&op_SUBTRACT,
+      [OP_MULTIPLY] = &&op_MULTIPLY,
+      [OP_DIVIDE] = &&op_DIVIDE,
+      [OP_NIL] = &&op_NIL,
+      [OP_TRUE] = &&op_TRUE,
+      [OP_FALSE] = &&op_FALSE,
+      [OP_NOT] = &&op_NOT,
+      [OP_EQUAL] = &&op_EQUAL,
+      [OP_GREATER] = &&op_GREATER,
+      [OP_LESS] = &&op_LESS,
+      [OP_PRINT] = &&op_PRINT,
+      [OP_POP] = &&op_POP,
+      [OP_DEFINE_GLOBAL] = &&op_DEFINE_GLOBAL,
+      [OP_GET_GLOBAL] = &&op_GET_GLOBAL,
+      [OP_SET_GLOBAL] = &&op_SET_GLOBAL,
+      [OP_GET_LOCAL] = &&op_GET_LOCAL,
+      [OP_SET_LOCAL] = &&op_SET_LOCAL,
+      [OP_JUMP] = &&op_JUMP,
+      [OP_JUMP_IF_FALSE] = &&op_JUMP_IF_FALSE,
+      [OP_LOOP] = &&op_LOOP,
+      [OP_CONSTANT_LONG] = &&op_CONSTANT_LONG,
+      [OP_DEFINE_GLOBAL_LONG] = &&op_DEFINE_GLOBAL_LONG,
+      [OP_GET_GLOBAL_LONG] = &&op_GET_GLOBAL_LONG,
+      [OP_SET_GLOBAL_LONG] = &&op_SET_GLOBAL_LONG,
+      [OP_CALL] = &&op_CALL,
+      [OP_TAIL_CALL] = &&op_TAIL_CALL,
+      [OP_CLOSURE] = &&op_CLOSURE,
+      [OP_CLOSURE_LONG] = &&op_CLOSURE_LONG,
+      [OP_GET_UPVALUE] = &&op_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&op_SET_UPVALUE,
+      [OP_CLOSE_UPVALUE] = &&op_CLOSE_UPVALUE,
+      [OP_CLASS] = &&op_CLASS,
+      [OP_METHOD] = &&op_METHOD,
+      [OP_GET_PROPERTY] = &&op_GET_PROPERTY,
+      [OP_SET_PROPERTY] = &&op_SET_PROPERTY,
+      [OP_INVOKE] = &&op_INVOKE,
+      [OP_CLASS_LONG] = &&op_CLASS_LONG,
+      [OP_METHOD_LONG] = &&op_METHOD_LONG,
+      [OP_GET_PROPERTY_LONG] = &&op_GET_PROPERTY_LONG,
+      [OP_SET_PROPERTY_LONG] = &&op_SET_PROPERTY_LONG,
+      [OP_INVOKE_LONG] = &&op_INVOKE_LONG,
+      [OP_ADD_NUM_NUM] = &&op_ADD_NUM_NUM,
+      [OP_ADD_STR_STR] = &&op_ADD_STR_STR,
+      [OP_SUBTRACT_NUM] = &&op_SUBTRACT_NUM,
+      [OP_MULTIPLY_NUM] = &&op_MULTIPLY_NUM,
+      [OP_DIVIDE_NUM] = &&op_DIVIDE_NUM,
+      [OP_GREATER_NUM] = &&op_GREATER_NUM,
+      [OP_LESS_NUM] = &&op_LESS_NUM,
+      [OP_NEGATE_NUM] = &&op_NEGATE_NUM,
+  };
+  // Same shape as dispatchTable but every opcode lands on the tracing stub,
+  // which prints and then jumps to the real handler. Picking the table once
+  // here keeps the handlers free of any tracing check
+  static void *traceTable[] = {
+      [0 ... sizeof(dispatchTable) / sizeof(dispatchTable[0]) - 1] =
+          &&traceInstruction,
+  };
+  // While the tracing JIT records a loop every opcode goes through
+  // traceRecord first, see START_RECORDING
+  static void *recordTable[] = {
+      [0 ... sizeof(dispatchTable) / sizeof(dispatchTable[0]) - 1] =
+          &&recordInstruction,
+  };
+  // A program built from --emit-c output runs its chunks as C and leaves
+  // run() one instruction at a time, the ones the C has no form for. The
+  // next dispatch goes back into the C, see nativeInstruction
+  static void *nativeTable[] = {
+      [0 ... sizeof(dispatchTable) / sizeof(dispatchTable[0]) - 1] =
+          &&nativeInstruction,
+  };
+  // With --register-vm every instruction first goes to the register form of
+  // the chunk, run() only gets the ones it leaves, see registerInstruction
+  static void *registerTable[] = {
+      [0 ... sizeof(dispatchTable) / sizeof(dispatchTable[0]) - 1] =
+          &&registerInstruction,
+  };
+  // Counts every instruction first, see --vm-stats
+  static void *countTable[] = {
+      [0 ... sizeof(dispatchTable) / sizeof(dispatchTable[0]) - 1] =
+          &&countInstruction,
+  };
+  void **baseTable = vm->trace               ? traceTable
+                     : vm->native            ? nativeTable
+                     : vm->registers         ? registerTable
+                     : vm->countInstructions ? countTable
+                                             : dispatchTable;
+  void **table = baseTable;
+
+#define START_RECORDING() (table = recordTable)
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name) op_##name
+#define DISPATCH() goto *table[READ_BYTE()]
+#else
+  // NOTE: the portable switch pays one well predicted branch per instruction
+  bool trace = vm->trace;
+  bool recording = false;
+  bool native = vm->native;
+  bool registers = vm->registers;
+  bool count = vm->countInstructions;
+
+#define START_RECORDING() (recording = true)
+#define INTERPRET_LOOP                                                         \
+  loop:                                                                        \
+  if (native && frame->chunk->native != NULL) {                                \
+    SAVE_STACK();                                                              \
+    ip = frame->chunk->native(vm, frame->slots, frame->closure, ip);           \
+    LOAD_STACK();                                                              \
+  }                                                                            \
+  if (registers) {                                                             \
+    SAVE_STACK();                                                              \
+    ip = registerRun(vm, ip);                                                  \
+    frame = &vm->frames[vm->frameCount - 1];                                   \
+    LOAD_STACK();                                                              \
+  }                                                                            \
+  if (count)                                                                   \
+    vm->vmStats.stackInstructions++;                                           \
+  if (trace || recording)                                                      \
+    SAVE_STACK();                                                              \
+  if (trace)                                                                   \
+    traceExecution(vm, frame->chunk, ip);                                      \
+  if (recording && !traceRecord(vm, frame, ip))                                \
+    recording = false;                                                         \
+  switch (READ_BYTE())
+#define CASE(name) case OP_##name
+#define DISPATCH() goto loop
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_ADD:
-      BINARY_OP(+);
-      break;
-    case OP_MULTIPLY:
-      BINARY_OP(*);
-      break;
-    case OP_SUBTRACT:
-      BINARY_OP(-);
-      break;
-    case OP_DIVIDE:
-      BINARY_OP(/);
-      break;
-    case OP_RETURN: {
-      Value popedValue = popVM(vm);
-      printValue(popedValue);
-      printf("\n");
-      return INTERPRET_OK;
+  INTERPRET_LOOP {
+#ifdef COMPUTED_GOTO
+  traceInstruction:
+    ip--; // Reached through table[READ_BYTE()], step back to the opcode
+    SAVE_STACK();
+    traceExecution(vm, frame->chunk, ip);
+    goto *dispatchTable[READ_BYTE()];
+  recordInstruction:
+    ip--;
+    SAVE_STACK();
+    if (vm->trace)
+      traceExecution(vm, frame->chunk, ip);
+    if (!traceRecord(vm, frame, ip))
+      table = baseTable;
+    goto *dispatchTable[READ_BYTE()];
+  nativeInstruction:
+    ip--;
+    if (frame->chunk->native != NULL) {
+      SAVE_STACK();
+      ip = frame->chunk->native(vm, frame->slots, frame->closure, ip);
+      LOAD_STACK();
+    }
+    goto *dispatchTable[READ_BYTE()];
+  registerInstruction:
+    ip--;
+    // Calls and returns in the register code may leave another frame on top
+    SAVE_STACK();
+    ip = registerRun(vm, ip);
+    frame = &vm->frames[vm->frameCount - 1];
+    LOAD_STACK();
+    if (vm->countInstructions)
+      vm->vmStats.stackInstructions++;
+    goto *dispatchTable[READ_BYTE()];
+  countInstruction:
+    vm->vmStats.stackInstructions++;
+    goto *dispatchTable[ip[-1]];
+#endif
+    CASE(ADD) : {
+      Value b = TOS;
+      Value a = sp[-2];
+      if (IS_STRING(a) && IS_STRING(b)) {
+        QUICKEN(OP_ADD_STR_STR);
+        SAVE_STACK();
+        concatenate(vm);
+        LOAD_STACK();
+      } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        QUICKEN(OP_ADD_NUM_NUM);
+        sp--;
+        TOS = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+    CASE(MULTIPLY) : {
+      BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+      DISPATCH();
+    }
+    CASE(SUBTRACT) : {
+      BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+      DISPATCH();
+    }
+    CASE(DIVIDE) : {
+      BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+      DISPATCH();
+    }
+    CASE(GREATER) : {
+      BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+      DISPATCH();
+    }
+    CASE(LESS) : {
+      BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+      DISPATCH();
+    }
+    CASE(ADD_NUM_NUM) : {
+      NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+      DISPATCH();
+    }
+    CASE(ADD_STR_STR) : {
+      if (!IS_STRING(TOS) || !IS_STRING(sp[-2]))
+        DESPECIALIZE(OP_ADD);
+      SAVE_STACK();
+      concatenate(vm);
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(SUBTRACT_NUM) : {
+      NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+      DISPATCH();
+    }
+    CASE(MULTIPLY_NUM) : {
+      NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+      DISPATCH();
     }
-    case OP_CONSTANT: {
+    CASE(DIVIDE_NUM) : {
+      NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+      DISPATCH();
+    }
+    CASE(GREATER_NUM) : {
+      NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+      DISPATCH();
+    }
+    CASE(LESS_NUM) : {
+      NUMBER_OP(BOOL_VAL, <, OP_LESS);
+      DISPATCH();
+    }
+    CASE(EQUAL) : {
+      Value b = TOS;
+      Value a = sp[-2];
+      sp--;
+      TOS = BOOL_VAL(valuesEqual(a, b));
+      DISPATCH();
+    }
+    CASE(NOT) : {
+      TOS = BOOL_VAL(isFalsey(TOS));
+      DISPATCH();
+    }
+    CASE(NIL) : {
+      PUSH(NIL_VAL);
+      DISPATCH();
+    }
+    CASE(TRUE) : {
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
+    }
+    CASE(FALSE) : {
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
+    }
+    CASE(RETURN) : {
+      // NOTE: the result is never a captured local, every slot the upvalues
+      // below can point at is in memory
+      Value result = TOS;
+      closeUpvalues(vm, frame->slots);
+      vm->frameCount--;
+      if (vm->frameCount == 0) {
+        // Exit the interpreter, the script is done
+        vm->stackTop = vm->stack;
+        return INTERPRET_OK;
+      }
+      // Drop the callee and its arguments, the result takes their place
+      sp = frame->slots + 1;
+      TOS = result;
+      frame = &vm->frames[vm->frameCount - 1];
+      ip = frame->ip;
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(CONSTANT_LONG) : {
+      Value constant = READ_CONSTANT_LONG();
+      PUSH(constant);
+      DISPATCH();
+    }
+    CASE(CONSTANT) : {
       Value constant = READ_CONSTANT();
-      printf("const \n");
-      printValue(constant);
-      printf("\n");
-      pushVM(vm, constant);
-      break;
+      PUSH(constant);
+      DISPATCH();
+    }
+    CASE(NEGATE) : {
+      if (!IS_NUMBER(TOS)) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      QUICKEN(OP_NEGATE_NUM);
+      TOS = NUMBER_VAL(-AS_NUMBER(TOS));
+      DISPATCH();
     }
-    case OP_NEGATE: {
-      Value popedValue = popVM(vm);
-      printf("negate \n");
-      printValue(popedValue);
+    CASE(NEGATE_NUM) : {
+      Value value = TOS;
+      if (!IS_NUMBER(value))
+        DESPECIALIZE(OP_NEGATE);
+      TOS = NUMBER_VAL(-AS_NUMBER(value));
+      DISPATCH();
+    }
+    CASE(PRINT) : {
+      printValue(TOS);
       printf("\n");
-      pushVM(vm, -popedValue);
-      break;
+      POP();
+      DISPATCH();
+    }
+    CASE(POP) : {
+      POP();
+      DISPATCH();
+    }
+    CASE(DEFINE_GLOBAL_LONG) :
+    CASE(DEFINE_GLOBAL) : {
+      size_t slot = READ_SLOT(OP_DEFINE_GLOBAL);
+      vm->globalValues.values[slot] = TOS;
+      writeBarrier(vm, NULL, TOS);
+      POP();
+      DISPATCH();
+    }
+    CASE(GET_GLOBAL_LONG) :
+    CASE(GET_GLOBAL) : {
+      size_t slot = READ_SLOT(OP_GET_GLOBAL);
+      Value value = vm->globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, slot));
+      }
+      PUSH(value);
+      DISPATCH();
+    }
+    CASE(SET_GLOBAL_LONG) :
+    CASE(SET_GLOBAL) : {
+      size_t slot = READ_SLOT(OP_SET_GLOBAL);
+      // Assignment never creates a global
+      if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, slot));
+      }
+      vm->globalValues.values[slot] = TOS;
+      writeBarrier(vm, NULL, TOS);
+      DISPATCH();
+    }
+    CASE(GET_LOCAL) : {
+      uint8_t slot = READ_BYTE();
+      PUSH(frame->slots[slot]);
+      DISPATCH();
     }
+    CASE(SET_LOCAL) : {
+      uint8_t slot = READ_BYTE();
+      // Assignment is an expression, its value stays on the stack
+      frame->slots[slot] = TOS;
+      DISPATCH();
+    }
+    CASE(JUMP) : {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(JUMP_IF_FALSE) : {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(TOS))
+        ip += offset;
+      DISPATCH();
+    }
+    CASE(LOOP) : {
+      uint8_t *loop = ip - 1;
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      // NOTE: safepoint, between instructions every live object is held by a
+      // root so the collector is free to move young objects
+      if (vm->gcRequested) {
+        SAVE_STACK();
+        collectAtSafepoint(vm);
+        LOAD_STACK();
+      }
+      // A trace runs until a guard fails, in whatever frame that happens
+      if (vm->tracing && vm->recorder == NULL) {
+        SAVE_STACK();
+        ip = traceLoop(vm, frame, loop, ip);
+        frame = &vm->frames[vm->frameCount - 1];
+        LOAD_STACK();
+        if (vm->recorder != NULL)
+          START_RECORDING();
+      }
+      if (vm->jit && frame->closure != NULL) {
+        ObjFunction *function = frame->closure->function;
+        if (function->jit == NULL && ++function->hotness >= vm->jitThreshold)
+          jitCompile(function);
+        JIT_ENTER();
+      }
+      DISPATCH();
+    }
+    CASE(CALL) : {
+      int argCount = READ_BYTE();
+      frame->ip = ip;
+      SAVE_STACK();
+      if (!callValue(vm, peekVM(vm, argCount), argCount))
+        return INTERPRET_RUNTIME_ERROR;
+      frame = &vm->frames[vm->frameCount - 1];
+      ip = frame->ip;
+      // NOTE: safepoint, recursion without loops must still let the
+      // generational collector run
+      if (vm->gcRequested)
+        collectAtSafepoint(vm);
+      LOAD_STACK();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(TAIL_CALL) : {
+      int argCount = READ_BYTE();
+      frame->ip = ip;
+      SAVE_STACK();
+      // The caller's frame is done with, the callee and its arguments slide
+      // down over it and the call reuses its place. Deep tail recursion then
+      // runs in constant stack space. NOTE: turned off, this is a plain call
+      // and the next instruction returns its result, stack traces keep every
+      // frame
+      if (vm->tailCalls) {
+        if (!checkCall(vm, peekVM(vm, argCount), argCount))
+          return INTERPRET_RUNTIME_ERROR;
+        closeUpvalues(vm, frame->slots);
+        Value *callee = vm->stackTop - argCount - 1;
+        memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+        vm->stackTop = frame->slots + argCount + 1;
+        vm->frameCount--;
+      }
+      // NOTE: a callee that pushes no frame (a class without init) leaves its
+      // result where the caller expects ours
+      if (!callValue(vm, peekVM(vm, argCount), argCount))
+        return INTERPRET_RUNTIME_ERROR;
+      frame = &vm->frames[vm->frameCount - 1];
+      ip = frame->ip;
+      if (vm->gcRequested)
+        collectAtSafepoint(vm);
+      LOAD_STACK();
+      JIT_ENTER();
+      DISPATCH();
+    }
+    CASE(CLOSURE_LONG) :
+    CASE(CLOSURE) : {
+      ObjFunction *function = AS_FUNCTION(
+          ip[-1] == OP_CLOSURE ? READ_CONSTANT() : READ_CONSTANT_LONG());
+      SAVE_STACK();
+      ObjClosure *closure = newClosure(vm, function);
+      PUSH(OBJ_VAL(closure));
+      SAVE_STACK(); // NOTE: reachable while capturing
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        ObjUpvalue *upvalue = isLocal
+                                  ? captureUpvalue(vm, frame->slots + index)
+                                  : frame->closure->upvalues[index];
+        closure->upvalues[i] = upvalue;
+        writeBarrier(vm, (Obj *)closure, OBJ_VAL(upvalue));
+      }
+      DISPATCH();
+    }
+    CASE(GET_UPVALUE) : {
+      uint8_t slot = READ_BYTE();
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(SET_UPVALUE) : {
+      uint8_t slot = READ_BYTE();
+      ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = TOS;
+      writeBarrier(vm, (Obj *)upvalue, TOS);
+      DISPATCH();
+    }
+    CASE(CLOSE_UPVALUE) : {
+      // The variable leaves the stack, closures that captured it keep it
+      SAVE_STACK();
+      closeUpvalues(vm, sp - 1);
+      POP();
+      DISPATCH();
+    }
+    CASE(CLASS_LONG) :
+    CASE(CLASS) : {
+      size_t name = READ_SLOT(OP_CLASS);
+      ObjString *className = AS_STRING(frame->chunk->constants.values[name]);
+      SAVE_STACK();
+      PUSH(OBJ_VAL(newClass(vm, className)));
+      DISPATCH();
+    }
+    CASE(METHOD_LONG) :
+    CASE(METHOD) : {
+      size_t name = READ_SLOT(OP_METHOD);
+      SAVE_STACK();
+      defineMethod(vm, AS_STRING(frame->chunk->constants.values[name]));
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(GET_PROPERTY_LONG) :
+    CASE(GET_PROPERTY) : {
+      size_t name = READ_SLOT(OP_GET_PROPERTY);
+      PropertyCache *cache = &frame->chunk->propertyCaches[READ_SHORT()];
+      if (!IS_INSTANCE(TOS)) {
+        RUNTIME_ERROR("Only instances have properties.");
+      }
+      ObjInstance *instance = AS_INSTANCE(TOS);
+      // Monomorphic hit, the instance looks like the last one seen here
+      if (instance->shape == cache->shape) {
+        vm->icStats.getHits++;
+        TOS = instance->fields[cache->slot];
+        DISPATCH();
+      }
+      vm->icStats.getMisses++;
+      ObjString *key = AS_STRING(frame->chunk->constants.values[name]);
+      int slot = shapeSlot(instance->shape, key);
+      if (slot >= 0) {
+        cache->shape = instance->shape;
+        cache->slot = slot;
+        TOS = instance->fields[slot];
+        DISPATCH();
+      }
+      // NOTE: methods are not cached, fields shadow them and a hit must not
+      // have to look anywhere else
+      SAVE_STACK();
+      if (!bindMethod(vm, instance->klass, key)) {
+        RUNTIME_ERROR("Undefined property '%s'.", key->chars);
+      }
+      LOAD_STACK();
+      DISPATCH();
+    }
+    CASE(SET_PROPERTY_LONG) :
+    CASE(SET_PROPERTY) : {
+      size_t name = READ_SLOT(OP_SET_PROPERTY);
+      PropertyCache *cache = &frame->chunk->propertyCaches[READ_SHORT()];
+      if (!IS_INSTANCE(sp[-2])) {
+        RUNTIME_ERROR("Only instances have fields.");
+      }
+      ObjInstance *instance = AS_INSTANCE(sp[-2]);
+      if (instance->shape == cache->shape) {
+        vm->icStats.setHits++;
+      } else {
+        vm->icStats.setMisses++;
+        ObjString *key = AS_STRING(frame->chunk->constants.values[name]);
+        int slot = shapeSlot(instance->shape, key);
+        cache->shape = instance->shape;
+        if (slot >= 0) {
+          cache->next = instance->shape;
+          cache->slot = slot;
+        } else {
+          // NOTE: the instance and the value stay on the stack while the
+          // transition is allocated
+          SAVE_STACK();
+          cache->next = shapeTransition(vm, instance->shape, key);
+          cache->slot = instance->shape->fieldCount;
+        }
+      }
+      if (cache->next != instance->shape) {
+        SAVE_STACK();
+        addField(vm, instance, cache->next);
+      }
+      Value value = TOS;
+      instance->fields[cache->slot] = value;
+      writeBarrier(vm, (Obj *)instance, value);
+      // Assignment is an expression, the value replaces the instance
+      sp--;
+      TOS = value;
+      DISPATCH();
+    }
+    CASE(INVOKE_LONG) :
+    CASE(INVOKE) : {
+      size_t name = READ_SLOT(OP_INVOKE);
+      int argCount = READ_BYTE();
+      InvokeCache *cache = &frame->chunk->invokeCaches[READ_SHORT()];
+      frame->ip = ip;
+      SAVE_STACK();
+      Obj *owner = frame->closure != NULL ? (Obj *)frame->closure->function
+                                          : NULL;
+      if (!invoke(vm, cache, owner,
+                  AS_STRING(frame->chunk->constants.values[name]), argCount))
+        return INTERPRET_RUNTIME_ERROR;
+      frame = &vm->frames[vm->frameCount - 1];
+      ip = frame->ip;
+      // NOTE: safepoint, same as OP_CALL
+      if (vm->gcRequested)
+        collectAtSafepoint(vm);
+      LOAD_STACK();
+      JIT_ENTER();
+      DISPATCH();
     }
   }
+
+  // Only reachable with the switch fallback and a corrupted opcode
+  RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+#undef TOS
+#undef PUSH
+#undef POP
+#undef SAVE_STACK
+#undef LOAD_STACK
 #undef READ_BYTE
+#undef READ_SHORT
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef READ_SLOT
+#undef RUNTIME_ERROR
+#undef QUICKEN
+#undef DESPECIALIZE
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef JIT_ENTER
+#undef START_RECORDING
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(VM* vm, const char *source) {
-  Scanner scanner; //TODO: maybe remove
-  compile(&scanner, source);
-  return INTERPRET_OK;
+InterpretResult interpretChunk(VM *vm, Chunk *chunk) {
+  vm->chunk = chunk;
+  // The script runs in a frame of its own, its locals start at the bottom of
+  // the stack
+  CallFrame *frame = &vm->frames[vm->frameCount++];
+  frame->closure = NULL;
+  frame->chunk = chunk;
+  frame->ip = chunk->code;
+  frame->slots = vm->stack;
+  InterpretResult result;
+  if (sigsetjmp(vm->stackOverflow, 1) == 0) {
+    vm->guardArmed = true;
+    result = run(vm);
+  } else {
+    // NOTE: the innermost ip was not saved before the fault, its line is
+    // only as recent as its last call
+    runtimeError(vm, "Stack overflow.");
+    result = INTERPRET_RUNTIME_ERROR;
+  }
+  vm->guardArmed = false;
+  // A recording cut short by the end of the script or an error
+  abortRecording(vm);
+  // NOTE: the caller frees the chunk next, the collector must not see it
+  vm->chunk = NULL;
+  return result;
 }
 
-void freeVM(VM *vm) {}
+InterpretResult interpret(VM *vm, const char *source) {
+  Chunk chunk;
+  initChunk(&chunk);
+
+  if (!compile(vm, source, &chunk)) {
+    freeChunk(&chunk);
+    return INTERPRET_COMPILE_ERROR;
+  }
+
+  InterpretResult result = interpretChunk(vm, &chunk);
+  freeChunk(&chunk);
+  return result;
+}
@@ -2,9 +2,77 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
-#define STACK_MAX 256
 #include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
 #include "value.h"
+#include <setjmp.h>
+
+#define FRAMES_MAX (1 << 16)
+#define FRAMES_INITIAL 64
+// The value stack starts with STACK_INITIAL slots and doubles up to
+// STACK_MAX, see growStack. NOTE: both are powers of two so every mapping is
+// a whole number of pages
+#define STACK_MAX (1 << 22)
+#define STACK_INITIAL (1 << 16)
+// Free slots a call makes sure of before its frame starts: room for its
+// locals and the arguments of one more call. A frame that needs more runs
+// into the guard page
+#define STACK_HEADROOM (2 * UINT8_COUNT)
+#define METHOD_CACHE_SIZE 1024 // a power of two
+
+// One running call. Locals and temporaries of the call live in the VM stack
+// starting at slots, so a local is addressed by its index from there
+typedef struct {
+  ObjClosure *closure; // NULL for the top level script
+  Chunk *chunk;        // closure->function->chunk, or the script itself
+  uint8_t *ip;         // saved here while a callee runs
+  Value *slots;
+} CallFrame;
+
+// Inline cache counters, see --ic-stats. Only fields are cached by the
+// property instructions, reading a method always counts as a get miss
+typedef struct {
+  size_t getHits;
+  size_t getMisses;
+  size_t setHits;
+  size_t setMisses;
+  size_t invokeHits;   // found in the call site's own cache
+  size_t invokeMisses; // looked up and added to it
+  size_t megamorphicHits; // full call site, found in vm->methodCache
+  size_t megamorphicMisses;
+} ICStats;
+
+// Rewrites done by quickening, indexed by the quickened opcode, see
+// --quicken-stats. A site whose operand types keep changing shows up in both
+typedef struct {
+  size_t quickened[UINT8_COUNT];     // generic instruction -> this form
+  size_t despecialized[UINT8_COUNT]; // this form -> generic instruction
+} QuickenStats;
+
+// Work of the tracing JIT, see --jit-stats
+typedef struct {
+  size_t rootTraces;  // compiled from a loop header
+  size_t sideTraces;  // compiled from a hot exit and linked to it
+  size_t aborted;     // recordings that ran into something traces don't do
+  size_t sideExits;   // runs of a trace that left it through a guard
+} TraceStats;
+
+// Instructions run by each engine, see --vm-stats
+typedef struct {
+  size_t stackInstructions;    // by run()
+  size_t registerInstructions; // by registerRun, see regvm.c
+} VMStats;
+
+// Shared cache of the OP_INVOKE sites that saw too many receiver classes.
+// NOTE: not traced, it is emptied by every collection instead
+typedef struct {
+  ObjClass *klass; // NULL for an empty entry
+  ObjShape *shape;
+  ObjString *name;
+  ObjClosure *method;
+} MethodCacheEntry;
 
 typedef enum {
   INTERPRET_OK,
@@ -12,16 +80,106 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-typedef struct {
-  Chunk *chunk;
-  uint8_t *ip; // the next instruction
-  Value stack[STACK_MAX];
-  Value *stackTop; // place where the next value will go
-} VM;
+struct VM {
+  Chunk *chunk; // the top level script being run
+  CallFrame *frames; // grown by call() up to FRAMES_MAX
+  int frameCount;
+  int frameCapacity;
+  // The stack is an anonymous mapping the OS backs with pages as they are
+  // first touched, followed by an inaccessible guard page. pushVM never
+  // checks for room, running past stackLimit faults and the fault becomes a
+  // runtime error
+  Value *stack;
+  Value *stackLimit; // the start of the guard page
+  Value *stackTop;   // place where the next value will go
+  sigjmp_buf stackOverflow; // where a fault in the guard page lands
+  bool guardArmed;          // stackOverflow is set, run() is running
+  ObjUpvalue *openUpvalues; // upvalues still pointing into the stack
+  // Globals are resolved to slots at compile time, see globalSlot. A slot
+  // holds UNDEFINED_VAL until its DEFINE_GLOBAL runs
+  Table globalSlots;       // name -> slot index as a number
+  ValueArray globalNames;  // slot -> name, for errors and .loxc files
+  ValueArray globalValues; // slot -> value
+  Table strings; // every live string, weak, see copyString
+  ObjShape *rootShape; // shape of new instances, NULL until the first one
+  ICStats icStats;
+  QuickenStats quickenStats;
+  MethodCacheEntry methodCache[METHOD_CACHE_SIZE];
+  Obj *objects; // head of the list of every allocated object
+  bool trace;   // print every instruction as it runs, see --trace
+  bool tailCalls; // OP_TAIL_CALL reuses frames, off with --no-tail-calls
+  bool quicken;   // rewrite arithmetic to typed forms, off with --no-quicken
+  bool jit;       // compile hot functions to machine code, see --jit
+  uint32_t jitThreshold;
+  bool tracing;   // compile hot loops to traces, see --tracing-jit
+  uint32_t traceThreshold;
+  struct Recorder *recorder;  // the trace being recorded, if any
+  struct TraceExit *lastExit; // the side exit the last trace left through
+  TraceStats traceStats;
+  bool native; // chunks may carry C from --emit-c, set by runNative
+  bool registers; // run chunks in their register form, see --register-vm
+  bool countInstructions; // fill vmStats, see --vm-stats
+  VMStats vmStats;
+
+  // Garbage collector, see memory.c
+  struct Parser *parser; // compiler state while compile() runs, also a root
+  size_t bytesAllocated;
+  size_t nextGC; // collect once bytesAllocated goes past this
+  Obj **grayStack;
+  int grayCount;
+  int grayCapacity;
+  GCStats gcStats;
+  GCMode gcMode;
+  GCPhase gcPhase;
+  bool markBit;      // flipped at the start of every cycle, see Obj.mark
+  Obj **sweepLink;   // the link to the next object an incremental sweep visits
+  size_t gcDebt;     // bytes allocated since the last incremental step
+  size_t cycleAllocated; // bytes allocated since the cycle began
+  uint64_t gcPauseNs; // time budget of an incremental step
+  size_t scanGlobals; // root cursors of an incremental cycle, see
+                      // scanRootArrays
+  Chunk *scanChunk;
+  size_t scanConstants;
+  bool gcRequested;  // collect at the next safepoint of run()
+  uint8_t *nursery; // bump allocated young objects, generational mode only
+  uint8_t *nurseryTop;
+  uint8_t *nurseryEnd;
+  Obj **remembered; // old objects that may reference young ones
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj **youngOwners; // see trackYoungOwner
+  int youngOwnerCount;
+  int youngOwnerCapacity;
+};
+
+static inline bool isYoung(VM *vm, Obj *object) {
+  return (uint8_t *)object >= vm->nursery && (uint8_t *)object < vm->nurseryEnd;
+}
+
+// Must follow every store of value into a field of owner, or into a global
+// slot with a NULL owner.
+// While an incremental cycle is marking, the holder may already be scanned, so
+// the value is shaded gray instead of being missed. A minor collection only
+// scans the roots and the remembered set, so an old object pointing to a
+// young one has to be recorded
+static inline void writeBarrier(VM *vm, Obj *owner, Value value) {
+  if (!IS_OBJ(value))
+    return;
+  if (vm->gcPhase == GC_MARKING)
+    markObject(vm, AS_OBJ(value));
+  if (owner != NULL && isYoung(vm, AS_OBJ(value)) && !isYoung(vm, owner) &&
+      !owner->isRemembered)
+    rememberObject(vm, owner);
+}
 
+// NOTE: installs a process wide SIGSEGV handler that turns a fault in the
+// guard page into a runtime error. Only the VM initialized last is guarded,
+// run one VM at a time
 void initVM(VM *vm);
 void freeVM(VM *vm);
 void pushVM(VM *vm, Value value);
 Value popVM(VM *vm);
+int globalSlot(VM *vm, ObjString *name);
 InterpretResult interpret(VM *vm, const char *source);
+InterpretResult interpretChunk(VM *vm, Chunk *chunk);
 #endif
@@ -42,7 +42,7 @@
             cSources=$(find . -maxdepth 1 -name '*.c' -print);
             echo "C source files found:"
             echo $cSources
-            $CC $cSources -o clox
+            $CC -O2 $cSources -o clox
           '';
 
           installPhase = ''
@@ -86,6 +86,26 @@
             license = licenses.mit;
           };
         };
+
+        checks =
+          {
+            clox-tests = self.packages.${system}.clox-tests;
+            clox-aot = pkgs.runCommandCC "clox-aot" {} ''
+              sh ${./clox}/tests/aot.sh
+              touch $out
+            '';
+            clox-register = pkgs.runCommandCC "clox-register" {} ''
+              sh ${./clox}/tests/register.sh
+              touch $out
+            '';
+          }
+          # The JITs emit x86-64 code and map it with Linux calls
+          // pkgs.lib.optionalAttrs (system == "x86_64-linux") {
+            clox-jit = pkgs.runCommandCC "clox-jit" {} ''
+              sh ${./clox}/tests/jit.sh
+              touch $out
+            '';
+          };
       }
     );
 }